@@ -0,0 +1,214 @@
+#include <cerrno>
+#include <cstdio>
+#include <cstring>
+#include <ctime>
+#include <thread>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "AccessLog.h"
+#include "AsyncLog.h"
+
+bool AccessLog::Open(const std::string& dir, size_t segment_size, size_t segments)
+{
+    if(mkdir(dir.c_str(), 0755) == -1 && errno != EEXIST)
+    {
+        LOG(INFO) << "Access log directory " << dir << " failed, error=" << strerror(errno);
+        return false;
+    }
+    dir_ = dir;
+    // Restarts and upgrades write segments of their own, names sort by age
+    char prefix[64];
+    snprintf(prefix, sizeof(prefix), "access.%010ld.%d.", (long)time(nullptr), (int)getpid());
+    prefix_ = prefix;
+    segment_size_ = segment_size / sizeof(Record) * sizeof(Record);
+    segments_ = segments > 0 ? segments : 1;
+    records_per_segment_ = segment_size_ / sizeof(Record) - 1;
+    for(auto& mapping : mappings_)
+    {
+        mapping.segment_.store(kNoSegment, std::memory_order_relaxed);
+        mapping.writers_.store(0, std::memory_order_relaxed);
+        mapping.base_ = nullptr;
+        mapping.fd_ = -1;
+    }
+    // The first two before any worker runs, the mapper stays one ahead
+    Map(0);
+    Map(1);
+    if(mappings_[0].base_ == nullptr || mappings_[1].base_ == nullptr)
+    {
+        for(auto& mapping : mappings_)
+        {
+            Unmap(mapping, segment_size_);
+        }
+        records_per_segment_ = 0;
+        return false;
+    }
+    map_wanted_ = 1;
+    map_done_ = 1;
+    mapper_stopping_ = false;
+    mapper_ = std::thread(MapperMain);
+    LOG(INFO) << "Access log " << SegmentPath(0) << ", " << records_per_segment_ << " records per segment";
+    return true;
+}
+
+void AccessLog::Close()
+{
+    if(!Enabled())
+    {
+        return;
+    }
+    {
+        std::lock_guard<std::mutex> lock(mapper_mutex_);
+        mapper_stopping_ = true;
+    }
+    mapper_cv_.notify_one();
+    mapper_.join();
+    // The last segment is cut after its last claimed slot, the one created
+    // ahead of it was never used
+    uint64_t next = next_.load(std::memory_order_acquire);
+    uint64_t last = next / records_per_segment_;
+    size_t used = (next % records_per_segment_ + 1) * sizeof(Record);
+    for(auto& mapping : mappings_)
+    {
+        uint64_t segment = mapping.segment_.load(std::memory_order_relaxed);
+        if(segment == last && mapping.fd_ != -1 && ftruncate(mapping.fd_, used) == -1)
+        {
+            LOG(INFO) << "Access log trim failed, error=" << strerror(errno);
+        }
+        if(segment != kNoSegment && segment > last)
+        {
+            unlink(SegmentPath(segment).c_str());
+        }
+        Unmap(mapping, segment_size_);
+    }
+    records_per_segment_ = 0;
+}
+
+void AccessLog::Append(const Record& record)
+{
+    uint64_t seq = next_.fetch_add(1, std::memory_order_relaxed);
+    uint64_t segment = seq / records_per_segment_;
+    size_t slot = seq % records_per_segment_;
+    // Exactly one appender takes the first slot of each segment, it asks
+    // for the next one a whole segment before anybody needs it
+    if(slot == 0)
+    {
+        RequestMap(segment + 1);
+    }
+
+    Mapping& mapping = mappings_[segment % kMapped];
+    // Only appenders that found their segment mapped announce themselves,
+    // the ones running ahead of a Map() must not hold it up
+    if(mapping.segment_.load(std::memory_order_acquire) == segment)
+    {
+        mapping.writers_.fetch_add(1, std::memory_order_seq_cst);
+        if(mapping.segment_.load(std::memory_order_seq_cst) == segment)
+        {
+            memcpy(mapping.base_ + (slot + 1) * sizeof(Record), &record, sizeof(Record));
+            mapping.writers_.fetch_sub(1, std::memory_order_release);
+            return;
+        }
+        mapping.writers_.fetch_sub(1, std::memory_order_release);
+    }
+    dropped_.fetch_add(1, std::memory_order_relaxed);
+}
+
+void AccessLog::RequestMap(uint64_t segment)
+{
+    {
+        std::lock_guard<std::mutex> lock(mapper_mutex_);
+        if(segment <= map_wanted_)
+        {
+            return;
+        }
+        map_wanted_ = segment;
+    }
+    mapper_cv_.notify_one();
+}
+
+void AccessLog::MapperMain()
+{
+    std::unique_lock<std::mutex> lock(mapper_mutex_);
+    while(true)
+    {
+        mapper_cv_.wait(lock, [] { return mapper_stopping_ || map_done_ < map_wanted_; });
+        if(mapper_stopping_)
+        {
+            return;
+        }
+        uint64_t segment = ++ map_done_;
+        lock.unlock();
+        Map(segment);
+        lock.lock();
+    }
+}
+
+void AccessLog::Map(uint64_t segment)
+{
+    Mapping& mapping = mappings_[segment % kMapped];
+    // Retire the segment kMapped back. Appenders check segment_ again after
+    // announcing themselves in writers_, once it drops to 0 nobody can
+    // still be copying into it
+    mapping.segment_.store(kNoSegment, std::memory_order_seq_cst);
+    while(mapping.writers_.load(std::memory_order_seq_cst) != 0)
+    {
+        std::this_thread::yield();
+    }
+    Unmap(mapping, segment_size_);
+
+    std::string path = SegmentPath(segment);
+    int fd = open(path.c_str(), O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if(fd == -1 || ftruncate(fd, segment_size_) == -1)
+    {
+        LOG(INFO) << "Access log segment " << path << " failed, error=" << strerror(errno);
+        if(fd != -1)
+        {
+            close(fd);
+        }
+        return;
+    }
+    void* base = mmap(nullptr, segment_size_, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if(base == MAP_FAILED)
+    {
+        LOG(INFO) << "Access log mmap of " << path << " failed, error=" << strerror(errno);
+        close(fd);
+        return;
+    }
+    SegmentHeader* header = (SegmentHeader*)base;
+    header->magic_ = kMagic;
+    header->version_ = kVersion;
+    header->record_size_ = sizeof(Record);
+    header->segment_ = segment;
+    header->pid_ = getpid();
+
+    mapping.base_ = (char*)base;
+    mapping.fd_ = fd;
+    mapping.segment_.store(segment, std::memory_order_release);
+
+    if(segment >= segments_)
+    {
+        unlink(SegmentPath(segment - segments_).c_str());
+    }
+}
+
+void AccessLog::Unmap(Mapping& mapping, size_t len)
+{
+    if(mapping.base_ != nullptr)
+    {
+        munmap(mapping.base_, len);
+        mapping.base_ = nullptr;
+    }
+    if(mapping.fd_ != -1)
+    {
+        close(mapping.fd_);
+        mapping.fd_ = -1;
+    }
+}
+
+std::string AccessLog::SegmentPath(uint64_t segment)
+{
+    char seq[32];
+    snprintf(seq, sizeof(seq), "%06lu.bin", (unsigned long)segment);
+    return dir_ + "/" + prefix_ + seq;
+}
@@ -0,0 +1,165 @@
+#pragma once
+
+#include <atomic>
+#include <condition_variable>
+#include <cstddef>
+#include <cstdint>
+#include <mutex>
+#include <string>
+#include <thread>
+
+// One fixed-width binary record per session, for capacity planning. Every
+// worker thread appends straight into memory mapped segment files: a slot
+// is claimed with one atomic increment and filled with one copy, there is
+// no lock, no formatting and no write call on the loop. The kernel writes
+// the pages back, so records survive the process dying, not the machine.
+//
+// Segments are named access.<start time>.<pid>.<seq>.bin and hold a header
+// record followed by records in slot order. Once a segment fills up the
+// next one takes over. A background thread creates it ahead of time, when
+// the one before it takes its first record, so no appender ever waits on
+// the filesystem. Only the newest --access-log-segments of this process
+// are kept. A zero start_us_ marks
+// a slot nobody wrote, appends finish out of order. See AccessLogDecode.cc
+// for the reader.
+class AccessLog
+{
+    // Segments mapped at a time, the one being filled and those around it
+    static const size_t kMapped = 4;
+    static const uint64_t kNoSegment = UINT64_MAX;
+public:
+    static const uint32_t kMagic = 0x4c41554c; // "ULAL"
+    static const uint16_t kVersion = 2;
+
+    enum CloseReason : uint8_t
+    {
+        // Still open when the process shut down
+        kShutdown,
+        // Both directions finished with a FIN
+        kFinished,
+        // The client hung up before the tunnel was up
+        kPeerAborted,
+        kPeerError,
+        kRemoteError,
+        kHandshakeTimeout,
+        kIdleTimeout,
+        kResolveFailed,
+        kConnectFailed,
+        // Closed through the admin socket
+        kKilled,
+        // Asked for a version, method, command or address type we don't serve
+        kUnsupported,
+        kReasonCount,
+    };
+
+    enum Flags : uint8_t
+    {
+        // Taken over from another process by a hot upgrade
+        kFlagUpgraded = 1 << 0,
+        // Moved between worker loops at least once
+        kFlagMigrated = 1 << 1,
+    };
+
+    struct Record
+    {
+        // Wall clock at accept in microseconds, 0 for an unwritten slot
+        uint64_t start_us_;
+        // Read from the client, handshake included, and from the upstream
+        uint64_t bytes_up_;
+        uint64_t bytes_down_;
+        // Accept to a complete request, request to upstream connected, 0
+        // when the session never got that far
+        uint32_t handshake_us_;
+        uint32_t connect_us_;
+        uint32_t lifetime_ms_;
+        // Data path syscalls made for the session, and times the loop
+        // called into it
+        uint32_t syscalls_;
+        uint32_t wakeups_;
+        // Network byte order, as in sockaddr_in
+        uint32_t client_addr_;
+        uint32_t dst_addr_;
+        uint16_t client_port_;
+        uint16_t dst_port_;
+        uint8_t close_reason_;
+        // SOCKS5 reply sent to the CONNECT, 0xFF when none was
+        uint8_t reply_;
+        uint8_t worker_;
+        uint8_t flags_;
+        // Requested domain, cut short to fit
+        uint8_t dst_len_;
+        char dst_[67];
+    };
+    static_assert(sizeof(Record) == 128, "AccessLog::Record must stay 128 bytes");
+
+    // Fills the first slot of every segment
+    struct SegmentHeader
+    {
+        uint32_t magic_;
+        uint16_t version_;
+        uint16_t record_size_;
+        uint64_t segment_;
+        uint64_t pid_;
+        char reserved_[104];
+    };
+    static_assert(sizeof(SegmentHeader) == sizeof(Record), "AccessLog::SegmentHeader must fill one slot");
+
+    // Maps the first segment, false when dir is unusable. Called before any
+    // worker runs
+    static bool Open(const std::string& dir, size_t segment_size, size_t segments);
+    // After every worker stopped: trims the last segment and unmaps
+    static void Close();
+    static bool Enabled() { return records_per_segment_ > 0; }
+    // Any thread, never blocks. Dropped when the segment is not mapped yet
+    static void Append(const Record& record);
+    // Slots claimed, dropped records included, and records dropped
+    static uint64_t Appended() { return next_.load(std::memory_order_relaxed); }
+    static uint64_t Dropped() { return dropped_.load(std::memory_order_relaxed); }
+
+    static const char* ReasonName(uint8_t reason)
+    {
+        static const char* const kNames[kReasonCount] = {
+            "shutdown", "finished", "peer_aborted", "peer_error", "remote_error",
+            "handshake_timeout", "idle_timeout", "resolve_failed", "connect_failed",
+            "killed", "unsupported",
+        };
+        return reason < kReasonCount ? kNames[reason] : "unknown";
+    }
+private:
+    struct Mapping
+    {
+        // Segment mapped at base_, kNoSegment while being replaced
+        std::atomic<uint64_t> segment_;
+        // Appenders copying into base_ right now
+        std::atomic<uint32_t> writers_;
+        char* base_;
+        int fd_;
+    };
+
+    // Creates segment and maps it over the oldest mapping
+    static void Map(uint64_t segment);
+    // Has the mapper thread map everything up to segment
+    static void RequestMap(uint64_t segment);
+    static void MapperMain();
+    static void Unmap(Mapping& mapping, size_t len);
+    static std::string SegmentPath(uint64_t segment);
+private:
+    static inline std::string dir_;
+    static inline std::string prefix_;
+    static inline size_t segment_size_ = 0;
+    static inline size_t segments_ = 0;
+    // Record slots per segment, the header not counted. 0 while closed
+    static inline size_t records_per_segment_ = 0;
+    static inline std::atomic<uint64_t> next_{0};
+    static inline std::atomic<uint64_t> dropped_{0};
+    static inline Mapping mappings_[kMapped];
+
+    static inline std::thread mapper_;
+    static inline std::mutex mapper_mutex_;
+    static inline std::condition_variable mapper_cv_;
+    // Guarded by mapper_mutex_: the newest segment asked for, the newest
+    // one mapped
+    static inline uint64_t map_wanted_ = 0;
+    static inline uint64_t map_done_ = 0;
+    static inline bool mapper_stopping_ = false;
+};
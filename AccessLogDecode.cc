@@ -0,0 +1,366 @@
+// Reads the segments AccessLog writes: prints the records, filtered, or
+// aggregates them by close reason and destination.
+//
+//   access-decode logs/access                        every record, one per line
+//   access-decode --reason connect_failed logs/access
+//   access-decode --summary --top 20 logs/access/access.*.bin
+#include <algorithm>
+#include <cerrno>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <ctime>
+#include <map>
+#include <string>
+#include <vector>
+#include <dirent.h>
+#include <getopt.h>
+#include <arpa/inet.h>
+#include <sys/stat.h>
+#include "AccessLog.h"
+
+struct Filter
+{
+    Filter() : client_(0), has_client_(false), reason_(-1), since_us_(0), until_us_(UINT64_MAX), min_bytes_(0) {}
+    std::string dst_;
+    uint32_t client_;
+    bool has_client_;
+    int reason_;
+    uint64_t since_us_;
+    uint64_t until_us_;
+    uint64_t min_bytes_;
+};
+
+struct DstStats
+{
+    DstStats() : sessions_(0), bytes_(0) {}
+    uint64_t sessions_;
+    uint64_t bytes_;
+};
+
+struct Summary
+{
+    Summary() : sessions_(0), bytes_up_(0), bytes_down_(0), syscalls_(0), wakeups_(0), first_us_(UINT64_MAX), last_us_(0)
+    {
+        memset(reasons_, 0, sizeof(reasons_));
+    }
+    uint64_t sessions_;
+    uint64_t bytes_up_;
+    uint64_t bytes_down_;
+    uint64_t syscalls_;
+    uint64_t wakeups_;
+    uint64_t first_us_;
+    uint64_t last_us_;
+    uint64_t reasons_[AccessLog::kReasonCount + 1];
+    std::vector<uint32_t> handshake_us_;
+    std::vector<uint32_t> connect_us_;
+    std::vector<uint32_t> lifetime_ms_;
+    std::map<std::string, DstStats> dsts_;
+};
+
+static void Usage(const char* prog)
+{
+    fprintf(stderr,
+        "Usage: %s [options] FILE|DIR...\n"
+        "  -d, --dst SUBSTR       only destinations containing SUBSTR\n"
+        "  -c, --client ADDR      only sessions from client ADDR\n"
+        "  -r, --reason NAME      only sessions closed for NAME (finished, idle_timeout, connect_failed, ...)\n"
+        "      --since UNIXTIME   only sessions accepted at or after UNIXTIME\n"
+        "      --until UNIXTIME   ... before UNIXTIME\n"
+        "  -m, --min-bytes N      only sessions relaying at least N bytes both ways together\n"
+        "  -s, --summary          totals, close reasons and duration percentiles instead of records\n"
+        "  -t, --top N            with --summary, the N destinations with the most bytes (default 10)\n"
+        "  -h, --help             show this message\n",
+        prog);
+}
+
+static std::string Dst(const AccessLog::Record& record)
+{
+    return std::string(record.dst_, std::min<size_t>(record.dst_len_, sizeof(record.dst_)));
+}
+
+static bool Matches(const Filter& filter, const AccessLog::Record& record)
+{
+    if(record.start_us_ < filter.since_us_ || record.start_us_ >= filter.until_us_)
+    {
+        return false;
+    }
+    if(filter.has_client_ && record.client_addr_ != filter.client_)
+    {
+        return false;
+    }
+    if(filter.reason_ >= 0 && record.close_reason_ != filter.reason_)
+    {
+        return false;
+    }
+    if(record.bytes_up_ + record.bytes_down_ < filter.min_bytes_)
+    {
+        return false;
+    }
+    return filter.dst_.empty() || Dst(record).find(filter.dst_) != std::string::npos;
+}
+
+static void Print(const AccessLog::Record& record)
+{
+    time_t secs = record.start_us_ / 1000000;
+    struct tm tm;
+    localtime_r(&secs, &tm);
+    char when[32];
+    strftime(when, sizeof(when), "%Y-%m-%d %H:%M:%S", &tm);
+
+    char client[INET_ADDRSTRLEN];
+    char dst_addr[INET_ADDRSTRLEN];
+    inet_ntop(AF_INET, &record.client_addr_, client, sizeof(client));
+    inet_ntop(AF_INET, &record.dst_addr_, dst_addr, sizeof(dst_addr));
+    printf("%s.%06u client=%s:%u dst=%s:%u (%s) up=%lu down=%lu handshake=%uus connect=%uus lifetime=%ums"
+           " syscalls=%u wakeups=%u reason=%s reply=%u worker=%u%s%s\n",
+           when, (unsigned)(record.start_us_ % 1000000), client, ntohs(record.client_port_),
+           Dst(record).c_str(), ntohs(record.dst_port_), dst_addr,
+           (unsigned long)record.bytes_up_, (unsigned long)record.bytes_down_,
+           record.handshake_us_, record.connect_us_, record.lifetime_ms_, record.syscalls_, record.wakeups_,
+           AccessLog::ReasonName(record.close_reason_), record.reply_, record.worker_,
+           (record.flags_ & AccessLog::kFlagUpgraded) ? " upgraded" : "",
+           (record.flags_ & AccessLog::kFlagMigrated) ? " migrated" : "");
+}
+
+static void Add(Summary& summary, const AccessLog::Record& record)
+{
+    summary.sessions_ ++;
+    summary.bytes_up_ += record.bytes_up_;
+    summary.bytes_down_ += record.bytes_down_;
+    summary.syscalls_ += record.syscalls_;
+    summary.wakeups_ += record.wakeups_;
+    summary.first_us_ = std::min(summary.first_us_, record.start_us_);
+    summary.last_us_ = std::max(summary.last_us_, record.start_us_);
+    summary.reasons_[std::min<uint8_t>(record.close_reason_, AccessLog::kReasonCount)] ++;
+    if(record.handshake_us_ > 0)
+    {
+        summary.handshake_us_.push_back(record.handshake_us_);
+    }
+    if(record.connect_us_ > 0)
+    {
+        summary.connect_us_.push_back(record.connect_us_);
+    }
+    summary.lifetime_ms_.push_back(record.lifetime_ms_);
+    DstStats& dst = summary.dsts_[Dst(record) + ":" + std::to_string(ntohs(record.dst_port_))];
+    dst.sessions_ ++;
+    dst.bytes_ += record.bytes_up_ + record.bytes_down_;
+}
+
+static void PrintPercentiles(const char* name, std::vector<uint32_t>& values, const char* unit)
+{
+    if(values.empty())
+    {
+        printf("%-10s none\n", name);
+        return;
+    }
+    std::sort(values.begin(), values.end());
+    auto at = [&](double q) { return values[std::min(values.size() - 1, (size_t)(q * values.size()))]; };
+    printf("%-10s p50=%u%s p90=%u%s p99=%u%s max=%u%s\n", name,
+           at(0.5), unit, at(0.9), unit, at(0.99), unit, values.back(), unit);
+}
+
+static void PrintSummary(Summary& summary, size_t top)
+{
+    printf("sessions=%lu up=%lu down=%lu\n", (unsigned long)summary.sessions_,
+           (unsigned long)summary.bytes_up_, (unsigned long)summary.bytes_down_);
+    uint64_t bytes = summary.bytes_up_ + summary.bytes_down_;
+    printf("syscalls=%lu wakeups=%lu bytes/syscall=%.1f wakeups/MB=%.1f\n", (unsigned long)summary.syscalls_,
+           (unsigned long)summary.wakeups_, summary.syscalls_ ? (double)bytes / summary.syscalls_ : 0.0,
+           bytes ? summary.wakeups_ * 1048576.0 / bytes : 0.0);
+    if(summary.sessions_ > 1 && summary.last_us_ > summary.first_us_)
+    {
+        printf("accepted over %.1fs, %.1f sessions/s\n", (summary.last_us_ - summary.first_us_) / 1e6,
+               summary.sessions_ * 1e6 / (summary.last_us_ - summary.first_us_));
+    }
+    for(size_t i = 0; i <= AccessLog::kReasonCount; i++)
+    {
+        if(summary.reasons_[i] > 0)
+        {
+            printf("  %-18s %lu\n", AccessLog::ReasonName(i), (unsigned long)summary.reasons_[i]);
+        }
+    }
+    PrintPercentiles("handshake", summary.handshake_us_, "us");
+    PrintPercentiles("connect", summary.connect_us_, "us");
+    PrintPercentiles("lifetime", summary.lifetime_ms_, "ms");
+
+    std::vector<std::pair<std::string, DstStats>> dsts(summary.dsts_.begin(), summary.dsts_.end());
+    std::sort(dsts.begin(), dsts.end(), [](const std::pair<std::string, DstStats>& a, const std::pair<std::string, DstStats>& b) {
+        return a.second.bytes_ > b.second.bytes_;
+    });
+    for(size_t i = 0; i < dsts.size() && i < top; i++)
+    {
+        printf("  %-40s sessions=%lu bytes=%lu\n", dsts[i].first.c_str(),
+               (unsigned long)dsts[i].second.sessions_, (unsigned long)dsts[i].second.bytes_);
+    }
+}
+
+// Segment files of a directory in the order they were written
+static void ExpandPath(const std::string& path, std::vector<std::string>& files)
+{
+    struct stat st;
+    if(stat(path.c_str(), &st) == 0 && S_ISDIR(st.st_mode))
+    {
+        std::vector<std::string> names;
+        DIR* dir = opendir(path.c_str());
+        struct dirent* entry;
+        while(dir != nullptr && (entry = readdir(dir)) != nullptr)
+        {
+            std::string name = entry->d_name;
+            if(name.compare(0, 7, "access.") == 0 && name.size() > 4 && name.compare(name.size() - 4, 4, ".bin") == 0)
+            {
+                names.push_back(name);
+            }
+        }
+        if(dir != nullptr)
+        {
+            closedir(dir);
+        }
+        std::sort(names.begin(), names.end());
+        for(auto& name : names)
+        {
+            files.push_back(path + "/" + name);
+        }
+        return;
+    }
+    files.push_back(path);
+}
+
+static bool ReadSegment(const std::string& path, const Filter& filter, Summary* summary)
+{
+    FILE* file = fopen(path.c_str(), "rb");
+    if(file == nullptr)
+    {
+        fprintf(stderr, "%s: %s\n", path.c_str(), strerror(errno));
+        return false;
+    }
+    AccessLog::SegmentHeader header;
+    if(fread(&header, sizeof(header), 1, file) != 1 || header.magic_ != AccessLog::kMagic
+        || header.version_ != AccessLog::kVersion || header.record_size_ != sizeof(AccessLog::Record))
+    {
+        fprintf(stderr, "%s: not an access log segment\n", path.c_str());
+        fclose(file);
+        return false;
+    }
+    AccessLog::Record record;
+    while(fread(&record, sizeof(record), 1, file) == 1)
+    {
+        // Slots not written (yet) are zero
+        if(record.start_us_ == 0 || !Matches(filter, record))
+        {
+            continue;
+        }
+        if(summary != nullptr)
+        {
+            Add(*summary, record);
+        }
+        else
+        {
+            Print(record);
+        }
+    }
+    fclose(file);
+    return true;
+}
+
+int main(int argc, char* argv[])
+{
+    enum
+    {
+        kOptSince = 256,
+        kOptUntil,
+    };
+
+    static const struct option options[] = {
+        {"dst", required_argument, nullptr, 'd'},
+        {"client", required_argument, nullptr, 'c'},
+        {"reason", required_argument, nullptr, 'r'},
+        {"since", required_argument, nullptr, kOptSince},
+        {"until", required_argument, nullptr, kOptUntil},
+        {"min-bytes", required_argument, nullptr, 'm'},
+        {"summary", no_argument, nullptr, 's'},
+        {"top", required_argument, nullptr, 't'},
+        {"help", no_argument, nullptr, 'h'},
+        {nullptr, 0, nullptr, 0},
+    };
+
+    Filter filter;
+    bool summarize = false;
+    size_t top = 10;
+    int opt;
+    while((opt = getopt_long(argc, argv, "d:c:r:m:st:h", options, nullptr)) != -1)
+    {
+        switch(opt)
+        {
+            case 'd':
+                filter.dst_ = optarg;
+                break;
+            case 'c':
+                if(inet_pton(AF_INET, optarg, &filter.client_) != 1)
+                {
+                    fprintf(stderr, "Invalid client address: %s\n", optarg);
+                    return 1;
+                }
+                filter.has_client_ = true;
+                break;
+            case 'r':
+                for(int i = 0; i < AccessLog::kReasonCount; i++)
+                {
+                    if(strcmp(optarg, AccessLog::ReasonName(i)) == 0)
+                    {
+                        filter.reason_ = i;
+                    }
+                }
+                if(filter.reason_ < 0)
+                {
+                    fprintf(stderr, "Invalid close reason: %s\n", optarg);
+                    return 1;
+                }
+                break;
+            case kOptSince:
+                filter.since_us_ = strtoull(optarg, nullptr, 10) * 1000000;
+                break;
+            case kOptUntil:
+                filter.until_us_ = strtoull(optarg, nullptr, 10) * 1000000;
+                break;
+            case 'm':
+                filter.min_bytes_ = strtoull(optarg, nullptr, 10);
+                break;
+            case 's':
+                summarize = true;
+                break;
+            case 't':
+                top = strtoul(optarg, nullptr, 10);
+                break;
+            case 'h':
+            default:
+                Usage(argv[0]);
+                return 1;
+        }
+    }
+    if(optind == argc)
+    {
+        Usage(argv[0]);
+        return 1;
+    }
+
+    std::vector<std::string> files;
+    for(int i = optind; i < argc; i++)
+    {
+        ExpandPath(argv[i], files);
+    }
+    Summary summary;
+    int ret = 0;
+    for(auto& file : files)
+    {
+        if(!ReadSegment(file, filter, summarize ? &summary : nullptr))
+        {
+            ret = 1;
+        }
+    }
+    if(summarize)
+    {
+        PrintSummary(summary, top);
+    }
+    return ret;
+}
@@ -0,0 +1,278 @@
+#include <cerrno>
+#include <cstdio>
+#include <cstring>
+#include <sstream>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include "Admin.h"
+#include "AsyncLog.h"
+#include "Socks5Server.h"
+
+void AdminJob::Done(int worker, const std::string& result)
+{
+    results_[worker] = result;
+    if(pending_.fetch_sub(1, std::memory_order_acq_rel) == 1)
+    {
+        notifier_->Notify();
+    }
+}
+
+void AdminNotifier::Notify()
+{
+    std::lock_guard<std::mutex> lock(mutex_);
+    if(admin_ != nullptr)
+    {
+        admin_->Wake();
+    }
+}
+
+void AdminNotifier::Detach()
+{
+    std::lock_guard<std::mutex> lock(mutex_);
+    admin_ = nullptr;
+}
+
+AdminServer::AdminServer(struct ev_loop* loop) :
+    loop_(loop),
+    listen_fd_(-1),
+    io_(loop),
+    done_async_(loop),
+    notifier_(std::make_shared<AdminNotifier>(this))
+{
+}
+
+AdminServer::~AdminServer()
+{
+    Close();
+    notifier_->Detach();
+}
+
+bool AdminServer::Listen(const std::string& path)
+{
+    struct sockaddr_un addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    if(path.size() >= sizeof(addr.sun_path))
+    {
+        LOG(INFO) << "Admin socket path too long: " << path;
+        return false;
+    }
+    memcpy(addr.sun_path, path.c_str(), path.size());
+    listen_fd_ = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    // A previous or upgrading process may still hold the path
+    unlink(path.c_str());
+    if(listen_fd_ == -1 || bind(listen_fd_, (struct sockaddr*)&addr, sizeof(addr)) == -1 || listen(listen_fd_, 16) == -1)
+    {
+        LOG(INFO) << "Admin socket " << path << " failed, error=" << strerror(errno);
+        Close();
+        return false;
+    }
+    io_.set<AdminServer, &AdminServer::OnAccept>(this);
+    io_.start(listen_fd_, ev::READ);
+    done_async_.set<AdminServer, &AdminServer::OnJobDone>(this);
+    done_async_.start();
+    LOG(INFO) << "Admin socket " << path;
+    return true;
+}
+
+void AdminServer::Close()
+{
+    io_.stop();
+    if(listen_fd_ != -1)
+    {
+        close(listen_fd_);
+        listen_fd_ = -1;
+    }
+    // Jobs still out keep running, nobody waits for their answer anymore
+    while(!clients_.empty())
+    {
+        CloseClient(clients_.begin()->first);
+    }
+}
+
+void AdminServer::SetWorkers(const std::vector<Socks5Server*>& workers)
+{
+    workers_ = workers;
+}
+
+void AdminServer::OnAccept()
+{
+    int fd = accept4(listen_fd_, nullptr, nullptr, SOCK_NONBLOCK | SOCK_CLOEXEC);
+    if(fd == -1)
+    {
+        return;
+    }
+    std::unique_ptr<Client> client(new Client(loop_));
+    client->fd_ = fd;
+    client->watcher_.set<AdminServer, &AdminServer::OnClientEvent>(this);
+    client->watcher_.start(fd, ev::READ);
+    clients_[fd] = std::move(client);
+}
+
+void AdminServer::OnClientEvent(ev::io& watcher, int revents)
+{
+    auto it = clients_.find(watcher.fd);
+    if(it == clients_.end())
+    {
+        return;
+    }
+    Client& client = *it->second;
+    if(revents & EV_READ)
+    {
+        char buf[256];
+        ssize_t ret = read(client.fd_, buf, sizeof(buf));
+        if(ret < 0 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR))
+        {
+            return;
+        }
+        if(ret < 0)
+        {
+            CloseClient(client.fd_);
+            return;
+        }
+        client.request_.append(buf, ret);
+        size_t eol = client.request_.find('\n');
+        if(ret > 0 && eol == std::string::npos && client.request_.size() < kMaxCommand)
+        {
+            return;
+        }
+        // One command per connection, whatever follows it is ignored
+        client.watcher_.stop();
+        Execute(client, client.request_.substr(0, eol));
+        return;
+    }
+    if(revents & EV_WRITE)
+    {
+        ssize_t ret = send(client.fd_, client.response_.data(), client.response_.size(), MSG_NOSIGNAL);
+        if(ret < 0 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR))
+        {
+            return;
+        }
+        if(ret > 0 && (size_t)ret < client.response_.size())
+        {
+            client.response_.erase(0, ret);
+            return;
+        }
+        CloseClient(client.fd_);
+    }
+}
+
+void AdminServer::Execute(Client& client, const std::string& command)
+{
+    std::istringstream in(command);
+    std::string verb;
+    std::string arg;
+    in >> verb >> arg;
+    LOG(INFO) << "Admin command: " << command;
+
+    std::shared_ptr<AdminJob> job;
+    int worker = -1;
+    if(verb == "sessions")
+    {
+        job = std::make_shared<AdminJob>(AdminJob::kList, workers_.size());
+    }
+    else if(verb == "kill")
+    {
+        int fd = -1;
+        if(sscanf(arg.c_str(), "%d:%d", &worker, &fd) != 2 || worker < 0 || (size_t)worker >= workers_.size() || fd < 0)
+        {
+            return Reply(client, "usage: kill WORKER:FD\n");
+        }
+        job = std::make_shared<AdminJob>(AdminJob::kKill, workers_.size());
+        job->fd_ = fd;
+    }
+    else if(verb == "kill-dest")
+    {
+        if(arg.empty())
+        {
+            return Reply(client, "usage: kill-dest DOMAIN|ADDR|ADDR:PORT\n");
+        }
+        job = std::make_shared<AdminJob>(AdminJob::kKillDestination, workers_.size());
+        job->destination_ = arg;
+    }
+    else if(verb == "log-level")
+    {
+        AsyncLog::Severity level;
+        if(!AsyncLog::ParseLevel(arg, level))
+        {
+            return Reply(client, "usage: log-level trace|debug|info|warning|error\n");
+        }
+        AsyncLog::SetLevel(level);
+        return Reply(client, "log level " + arg + "\n");
+    }
+    else if(verb == "trace-sample")
+    {
+        char* end = nullptr;
+        unsigned long sample = strtoul(arg.c_str(), &end, 10);
+        if(arg.empty() || *end != '\0')
+        {
+            return Reply(client, "usage: trace-sample N\n");
+        }
+        job = std::make_shared<AdminJob>(AdminJob::kTraceSample, workers_.size());
+        job->sample_ = sample;
+    }
+    else
+    {
+        return Reply(client, "commands: sessions, kill WORKER:FD, kill-dest DST, log-level LEVEL, trace-sample N\n");
+    }
+
+    job->notifier_ = notifier_;
+    job->pending_.store(worker == -1 ? workers_.size() : 1, std::memory_order_relaxed);
+    client.job_ = job;
+    for(size_t i = 0; i < workers_.size(); i++)
+    {
+        if(worker != -1 && (size_t)worker != i)
+        {
+            continue;
+        }
+        // Our own loop runs it right away, the others once they get to it.
+        // Its Done() still goes through done_async_, a round trip through
+        // the loop we don't bother saving for an admin command
+        if(i == 0)
+        {
+            workers_[i]->RunAdminJob(*job);
+        }
+        else
+        {
+            workers_[i]->RequestAdminJob(job);
+        }
+    }
+}
+
+void AdminServer::OnJobDone()
+{
+    for(auto& entry : clients_)
+    {
+        Client& client = *entry.second;
+        if(client.job_ == nullptr || client.job_->pending_.load(std::memory_order_acquire) != 0)
+        {
+            continue;
+        }
+        std::string text;
+        for(auto& result : client.job_->results_)
+        {
+            text += result;
+        }
+        client.job_.reset();
+        Reply(client, text.empty() ? "ok\n" : text);
+    }
+}
+
+void AdminServer::Reply(Client& client, const std::string& text)
+{
+    client.response_ = text;
+    client.watcher_.start(client.fd_, ev::WRITE);
+}
+
+void AdminServer::CloseClient(int fd)
+{
+    auto it = clients_.find(fd);
+    if(it == clients_.end())
+    {
+        return;
+    }
+    it->second->watcher_.stop();
+    close(fd);
+    clients_.erase(it);
+}
@@ -0,0 +1,116 @@
+#pragma once
+
+#include <atomic>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <vector>
+#include <ev++.h>
+
+class AdminServer;
+class Socks5Server;
+
+// How a worker tells the admin loop a job is done. Jobs hold it by
+// shared_ptr and may outlive the AdminServer, in a queue that is never
+// drained or on a worker still running it: the server detaches itself
+// before its async watcher goes away, later notifications are dropped.
+class AdminNotifier
+{
+public:
+    explicit AdminNotifier(AdminServer* admin) : admin_(admin) {}
+
+    // Any thread
+    void Notify();
+    // The admin loop, once nobody waits for answers anymore
+    void Detach();
+private:
+    std::mutex mutex_;
+    AdminServer* admin_;
+};
+
+// One admin command, run by each worker it concerns on that worker's own
+// loop, see Socks5Server::RunAdminJob(). Nothing is shared while it runs:
+// every worker writes its own result, the last one to finish wakes the
+// admin loop up to answer.
+struct AdminJob
+{
+    enum Type
+    {
+        kList,
+        kKill,
+        kKillDestination,
+        kTraceSample,
+    };
+
+    AdminJob(Type type, size_t workers) : type_(type), fd_(-1), sample_(0), results_(workers), pending_(0) {}
+
+    // Any thread, once per worker the job was given to
+    void Done(int worker, const std::string& result);
+
+    Type type_;
+    // kKill: the session's peer fd on the worker it was sent to
+    int fd_;
+    // kKillDestination: a domain, an upstream address or address:port
+    std::string destination_;
+    // kTraceSample: the new --trace-sample
+    size_t sample_;
+    // By worker
+    std::vector<std::string> results_;
+    std::atomic<size_t> pending_;
+    std::shared_ptr<AdminNotifier> notifier_;
+};
+
+// Text commands on a unix socket, one per connection, for looking into a
+// running process:
+//
+//   sessions              every session of every worker, one per line
+//   kill WORKER:FD        close one session, ids as listed
+//   kill-dest DST         close the sessions to a domain, address or address:port,
+//                         established ones match a domain with --access-log only
+//   log-level LEVEL       trace, debug, info, warning or error
+//   trace-sample N        trace every Nth new session, 0 for none
+//
+// e.g. echo sessions | nc -U PATH. Runs on worker 0's loop, the other
+// workers only ever see a job in their queue.
+class AdminServer
+{
+    static const size_t kMaxCommand = 1024;
+
+    struct Client
+    {
+        explicit Client(struct ev_loop* loop) : fd_(-1), watcher_(loop) {}
+        int fd_;
+        ev::io watcher_;
+        std::string request_;
+        std::string response_;
+        // Answered once it is done everywhere
+        std::shared_ptr<AdminJob> job_;
+    };
+public:
+    explicit AdminServer(struct ev_loop* loop);
+    ~AdminServer();
+
+    bool Listen(const std::string& path);
+    void Close();
+    // All worker loops by index, worker 0 being the one we run on
+    void SetWorkers(const std::vector<Socks5Server*>& workers);
+    // Any thread: some job finished on the last of its workers
+    void Wake() { done_async_.send(); }
+private:
+    void OnAccept();
+    void OnClientEvent(ev::io& watcher, int revents);
+    void OnJobDone();
+    // Answers right away, or hands a job to every worker it concerns
+    void Execute(Client& client, const std::string& command);
+    void Reply(Client& client, const std::string& text);
+    void CloseClient(int fd);
+private:
+    ev::loop_ref loop_;
+    int listen_fd_;
+    ev::io io_;
+    ev::async done_async_;
+    std::shared_ptr<AdminNotifier> notifier_;
+    std::vector<Socks5Server*> workers_;
+    std::unordered_map<int, std::unique_ptr<Client>> clients_;
+};
@@ -0,0 +1,247 @@
+#include <chrono>
+#include <condition_variable>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+#include "AsyncLog.h"
+#include "SpscQueue.h"
+
+struct LogRing
+{
+    LogRing() : queue_(AsyncLog::kRingSize), dropped_(0), reported_(0) {}
+    SpscQueue<AsyncLog::Record> queue_;
+    // Written by the owning thread only
+    std::atomic<uint64_t> dropped_;
+    // Drops already reported, backend side
+    uint64_t reported_;
+};
+
+// Rings are never freed, a thread that exits leaves its records behind
+// for the backend to write
+static std::mutex registry_mutex;
+static std::vector<LogRing*> rings;
+// Held by whoever consumes from the rings, the backend or a Flush()
+static std::mutex drain_mutex;
+static std::thread backend;
+static std::atomic<bool> running(false);
+// Set by the backend before it waits for records. The producer that
+// finds it set wakes it, the others stay off the mutex
+static std::atomic<bool> sleeping(false);
+static std::mutex wake_mutex;
+static std::condition_variable wake_cv;
+static bool wake_pending = false;
+// Only a safety net, producers wake the backend
+static const std::chrono::milliseconds kIdleWait(100);
+
+static thread_local LogRing* thread_ring = nullptr;
+
+static LogRing* RegisterThread()
+{
+    thread_ring = new LogRing();
+    std::lock_guard<std::mutex> lock(registry_mutex);
+    rings.push_back(thread_ring);
+    return thread_ring;
+}
+
+static size_t Drain()
+{
+    std::lock_guard<std::mutex> drain(drain_mutex);
+    std::vector<LogRing*> snapshot;
+    {
+        std::lock_guard<std::mutex> lock(registry_mutex);
+        snapshot = rings;
+    }
+    size_t written = 0;
+    AsyncLog::Record record;
+    for(LogRing* ring : snapshot)
+    {
+        while(ring->queue_.Pop(record))
+        {
+            el::base::Writer((el::Level)record.level_, record.file_, record.line_, "").construct(1, "default")
+                << AsyncLog::Format(record);
+            written ++;
+        }
+        uint64_t dropped = ring->dropped_.load(std::memory_order_relaxed);
+        if(dropped != ring->reported_)
+        {
+            CLOG(WARNING, "default") << "Log ring full, dropped " << dropped - ring->reported_ << " records";
+            ring->reported_ = dropped;
+        }
+    }
+    return written;
+}
+
+static void Wake()
+{
+    std::lock_guard<std::mutex> lock(wake_mutex);
+    wake_pending = true;
+    wake_cv.notify_one();
+}
+
+static void BackendMain()
+{
+    while(running.load(std::memory_order_acquire))
+    {
+        if(Drain() > 0)
+        {
+            continue;
+        }
+        sleeping.store(true, std::memory_order_relaxed);
+        // Pairs with the fence in Submit(): either the producer sees us
+        // sleeping, or this drain sees its record
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        if(Drain() > 0)
+        {
+            sleeping.store(false, std::memory_order_relaxed);
+            continue;
+        }
+        std::unique_lock<std::mutex> lock(wake_mutex);
+        wake_cv.wait_for(lock, kIdleWait, [] { return wake_pending; });
+        wake_pending = false;
+        sleeping.store(false, std::memory_order_relaxed);
+    }
+    Drain();
+}
+
+void AsyncLog::Line::AddString(const char* str, size_t len)
+{
+    size_t room = sizeof(record_.args_) - record_.len_;
+    if(room < 1 + sizeof(uint16_t))
+    {
+        record_.truncated_ = true;
+        return;
+    }
+    room -= 1 + sizeof(uint16_t);
+    if(len > room)
+    {
+        len = room;
+        record_.truncated_ = true;
+    }
+    uint16_t len16 = len;
+    record_.args_[record_.len_] = kArgString;
+    memcpy(record_.args_ + record_.len_ + 1, &len16, sizeof(len16));
+    memcpy(record_.args_ + record_.len_ + 1 + sizeof(len16), str, len);
+    record_.len_ += 1 + sizeof(len16) + len;
+}
+
+void AsyncLog::Submit(const Record& record)
+{
+    LogRing* ring = thread_ring != nullptr ? thread_ring : RegisterThread();
+    if(!ring->queue_.Push(record))
+    {
+        ring->dropped_.store(ring->dropped_.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+        return;
+    }
+    // A backend that found every ring empty waits to be woken, see BackendMain()
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    if(sleeping.load(std::memory_order_relaxed) && sleeping.exchange(false, std::memory_order_relaxed))
+    {
+        Wake();
+    }
+}
+
+std::string AsyncLog::Format(const Record& record)
+{
+    std::ostringstream out;
+    size_t pos = 0;
+    while(pos < record.len_)
+    {
+        uint8_t type = record.args_[pos++];
+        const char* arg = record.args_ + pos;
+        switch(type)
+        {
+            case kArgInt:
+            {
+                int64_t value;
+                memcpy(&value, arg, sizeof(value));
+                out << value;
+                pos += sizeof(value);
+                break;
+            }
+            case kArgUint:
+            {
+                uint64_t value;
+                memcpy(&value, arg, sizeof(value));
+                out << value;
+                pos += sizeof(value);
+                break;
+            }
+            case kArgDouble:
+            {
+                double value;
+                memcpy(&value, arg, sizeof(value));
+                out << value;
+                pos += sizeof(value);
+                break;
+            }
+            case kArgChar:
+                out << *arg;
+                pos += sizeof(char);
+                break;
+            case kArgString:
+            {
+                uint16_t len;
+                memcpy(&len, arg, sizeof(len));
+                out.write(arg + sizeof(len), len);
+                pos += sizeof(len) + len;
+                break;
+            }
+            default:
+                pos = record.len_;
+                break;
+        }
+    }
+    if(record.truncated_)
+    {
+        out << "...";
+    }
+    return out.str();
+}
+
+void AsyncLog::Start()
+{
+    running.store(true, std::memory_order_release);
+    backend = std::thread(BackendMain);
+}
+
+void AsyncLog::Stop()
+{
+    if(!backend.joinable())
+    {
+        return;
+    }
+    running.store(false, std::memory_order_release);
+    Wake();
+    backend.join();
+}
+
+void AsyncLog::Flush()
+{
+    Drain();
+}
+
+uint64_t AsyncLog::Dropped()
+{
+    std::lock_guard<std::mutex> lock(registry_mutex);
+    uint64_t dropped = 0;
+    for(LogRing* ring : rings)
+    {
+        dropped += ring->dropped_.load(std::memory_order_relaxed);
+    }
+    return dropped;
+}
+
+bool AsyncLog::ParseLevel(const std::string& name, Severity& level)
+{
+    static const char* const kNames[] = {"trace", "debug", "info", "warning", "error"};
+    for(size_t i = 0; i < sizeof(kNames) / sizeof(kNames[0]); i++)
+    {
+        if(name == kNames[i])
+        {
+            level = (Severity)i;
+            return true;
+        }
+    }
+    return false;
+}
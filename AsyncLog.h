@@ -0,0 +1,182 @@
+#pragma once
+
+#include <atomic>
+#include <cstdint>
+#include <cstring>
+#include <sstream>
+#include <string>
+#include <type_traits>
+#include "easylogging++.h"
+
+// Takes formatting and file I/O off the event loops. LOG(INFO) << ...
+// no longer goes through easylogging++ on the calling thread: the call
+// site (file and line, the format id) and the raw arguments are packed into
+// a fixed-size record and pushed onto a ring owned by that thread. A
+// background thread drains the rings, formats each record and hands it to
+// easylogging++, so its configuration and output stay what they were,
+// except that the time stamp is taken when the line is written. A full
+// ring drops the record and counts it instead of blocking the loop.
+//
+// LOG(FATAL) stays synchronous, after flushing whatever is queued.
+//
+// TRACE and DEBUG are per-event detail. Building with log_level=debug or
+// log_level=info (see the Makefile) compiles the levels below out
+// entirely. What is compiled in is still only written while a TraceScope
+// that is on is active on the thread, sessions open one around their
+// callbacks when they were sampled for tracing at accept time. Code that
+// runs outside a session, like the server's timers, logs at INFO or above.
+//
+// On top of that SetLevel() drops every level below the one given at run
+// time, for the admin socket. LOG(FATAL) is always written.
+class AsyncLog
+{
+public:
+    static const size_t kRecordSize = 256;
+    // Records per thread, a burst beyond this is dropped
+    static const size_t kRingSize = 4096;
+
+    // Levels in order, el::Level is a bit mask
+    enum Severity : uint8_t
+    {
+        kTrace,
+        kDebug,
+        kInfo,
+        kWarning,
+        kError,
+    };
+
+    enum ArgType : uint8_t
+    {
+        kArgInt,
+        kArgUint,
+        kArgDouble,
+        kArgChar,
+        // uint16_t length and the bytes, cut short at the end of the record
+        kArgString,
+    };
+
+    struct Record
+    {
+        const char* file_;
+        uint32_t line_;
+        uint8_t level_;
+        bool truncated_;
+        uint16_t len_;
+        char args_[kRecordSize - 16];
+    };
+
+    // One LOG() statement, submitted when it goes out of scope at the end
+    // of the full expression
+    class Line
+    {
+    public:
+        Line(const char* file, uint32_t line, el::Level level)
+        {
+            record_.file_ = file;
+            record_.line_ = line;
+            record_.level_ = (uint8_t)level;
+            record_.truncated_ = false;
+            record_.len_ = 0;
+        }
+        ~Line() { Submit(record_); }
+
+        Line& operator<<(const char* str) { AddString(str ? str : "(null)", str ? strlen(str) : 6); return *this; }
+        Line& operator<<(char* str) { return *this << (const char*)str; }
+        Line& operator<<(const std::string& str) { AddString(str.data(), str.size()); return *this; }
+        Line& operator<<(char c) { AddScalar(kArgChar, c); return *this; }
+        Line& operator<<(unsigned char c) { AddScalar(kArgChar, (char)c); return *this; }
+        Line& operator<<(signed char c) { AddScalar(kArgChar, (char)c); return *this; }
+        Line& operator<<(bool b) { AddScalar(kArgInt, (int64_t)b); return *this; }
+        Line& operator<<(float d) { AddScalar(kArgDouble, (double)d); return *this; }
+        Line& operator<<(double d) { AddScalar(kArgDouble, d); return *this; }
+
+        template<class T>
+        typename std::enable_if<std::is_integral<T>::value && std::is_signed<T>::value, Line&>::type
+        operator<<(T value) { AddScalar(kArgInt, (int64_t)value); return *this; }
+
+        template<class T>
+        typename std::enable_if<std::is_integral<T>::value && std::is_unsigned<T>::value, Line&>::type
+        operator<<(T value) { AddScalar(kArgUint, (uint64_t)value); return *this; }
+
+        // Anything else is formatted on the spot, off the fast path
+        template<class T>
+        typename std::enable_if<!std::is_arithmetic<T>::value, Line&>::type
+        operator<<(const T& value)
+        {
+            std::ostringstream out;
+            out << value;
+            return *this << out.str();
+        }
+    private:
+        template<class T>
+        void AddScalar(ArgType type, T value)
+        {
+            if(record_.len_ + 1 + sizeof(T) > sizeof(record_.args_))
+            {
+                record_.truncated_ = true;
+                return;
+            }
+            record_.args_[record_.len_] = type;
+            memcpy(record_.args_ + record_.len_ + 1, &value, sizeof(T));
+            record_.len_ += 1 + sizeof(T);
+        }
+        void AddString(const char* str, size_t len);
+    private:
+        Record record_;
+    };
+
+    // Marks everything the thread logs until it goes out of scope as traced
+    class TraceScope
+    {
+    public:
+        explicit TraceScope(bool tracing) : saved_(tracing_) { tracing_ = tracing; }
+        ~TraceScope() { tracing_ = saved_; }
+    private:
+        bool saved_;
+    };
+    static bool Tracing() { return tracing_; }
+
+    static void SetLevel(Severity level) { level_.store(level, std::memory_order_relaxed); }
+    static bool Enabled(Severity level) { return level >= level_.load(std::memory_order_relaxed); }
+    // trace, debug, info, warning or error
+    static bool ParseLevel(const std::string& name, Severity& level);
+
+    // Starts the backend thread, records logged before are kept queued
+    static void Start();
+    // Writes out everything queued so far and stops the backend thread
+    static void Stop();
+    // Writes out everything queued so far, on the calling thread
+    static void Flush();
+    // Records dropped on full rings, all threads together
+    static uint64_t Dropped();
+    // The text a record stands for
+    static std::string Format(const Record& record);
+private:
+    static void Submit(const Record& record);
+private:
+    static inline thread_local bool tracing_ = false;
+    static inline std::atomic<uint8_t> level_{kTrace};
+};
+
+#undef LOG
+#define LOG(LEVEL) ASYNC_LOG_##LEVEL
+// The arguments of a disabled statement are never evaluated, one compiled
+// out leaves no code behind
+#define ASYNC_LOG_OFF(level) if(true) {} else AsyncLog::Line(__FILE__, __LINE__, level)
+#define ASYNC_LOG_AT(severity, level) if(!AsyncLog::Enabled(severity)) {} else AsyncLog::Line(__FILE__, __LINE__, level)
+#define ASYNC_LOG_TRACED(severity, level) \
+    if(!AsyncLog::Tracing() || !AsyncLog::Enabled(severity)) {} else AsyncLog::Line(__FILE__, __LINE__, level)
+#if defined(ELPP_DISABLE_TRACE_LOGS)
+#define ASYNC_LOG_TRACE ASYNC_LOG_OFF(el::Level::Trace)
+#else
+#define ASYNC_LOG_TRACE ASYNC_LOG_TRACED(AsyncLog::kTrace, el::Level::Trace)
+#endif
+#if defined(ELPP_DISABLE_DEBUG_LOGS)
+#define ASYNC_LOG_DEBUG ASYNC_LOG_OFF(el::Level::Debug)
+#else
+#define ASYNC_LOG_DEBUG ASYNC_LOG_TRACED(AsyncLog::kDebug, el::Level::Debug)
+#endif
+#define ASYNC_LOG_INFO ASYNC_LOG_AT(AsyncLog::kInfo, el::Level::Info)
+#define ASYNC_LOG_WARNING ASYNC_LOG_AT(AsyncLog::kWarning, el::Level::Warning)
+#define ASYNC_LOG_ERROR ASYNC_LOG_AT(AsyncLog::kError, el::Level::Error)
+#define ASYNC_LOG_FATAL AsyncLog::Flush(), CLOG(FATAL, "default")
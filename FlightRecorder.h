@@ -0,0 +1,90 @@
+#pragma once
+
+#include <cstdint>
+#include <ev++.h>
+
+// The last kEvents things that happened to one session, kept in memory
+// only: a few stores per event, no formatting and no I/O. Written out
+// when the session hits a fatal error path or on SIGUSR2, see
+// Socks5Session::DumpFlightRecorder().
+class FlightRecorder
+{
+public:
+    static const size_t kEvents = 16;
+
+    enum Event : uint8_t
+    {
+        kAccept,
+        // Taken over from another worker or process
+        kResumed,
+        kGreeting,
+        kRequest,
+        // bytes holds the number of addresses, error h_errno on failure
+        kResolved,
+        kPooled,
+        kConnect,
+        kConnected,
+        kConnectFailed,
+        // bytes moved, error the errno the read or write stopped at
+        kPeerRead,
+        kRemoteRead,
+        kPeerWrite,
+        kRemoteWrite,
+        kPeerEof,
+        kRemoteEof,
+        kShutdownPeer,
+        kShutdownRemote,
+        kYield,
+        // Stopped reading, bytes holds what the other side has not taken
+        kBackpressure,
+        kTimeout,
+        kReplyFailed,
+        kClose,
+        kDetach,
+        kEventCount,
+    };
+
+    struct Entry
+    {
+        // Since the session started
+        uint32_t when_ms_;
+        uint32_t bytes_;
+        uint8_t event_;
+        uint8_t state_;
+        uint16_t error_;
+    };
+
+    explicit FlightRecorder(ev::tstamp start) : start_(start), count_(0) {}
+
+    void Add(ev::tstamp now, Event event, uint8_t state, size_t bytes, int error)
+    {
+        Entry& entry = entries_[count_++ % kEvents];
+        entry.when_ms_ = (now - start_) * 1000;
+        entry.bytes_ = bytes < UINT32_MAX ? bytes : UINT32_MAX;
+        entry.event_ = event;
+        entry.state_ = state;
+        entry.error_ = error;
+    }
+
+    ev::tstamp Start() const { return start_; }
+    // Events ever added, the ring holds the last kEvents of them
+    uint32_t Count() const { return count_; }
+    // i-th oldest event still held
+    const Entry& At(size_t i) const { return entries_[(count_ - Held() + i) % kEvents]; }
+    size_t Held() const { return count_ < kEvents ? count_ : kEvents; }
+
+    static const char* EventName(uint8_t event)
+    {
+        static const char* const kNames[kEventCount] = {
+            "accept", "resumed", "greeting", "request", "resolved", "pooled", "connect", "connected",
+            "connect_failed", "peer_read", "remote_read", "peer_write", "remote_write", "peer_eof",
+            "remote_eof", "shutdown_peer", "shutdown_remote", "yield", "backpressure", "timeout",
+            "reply_failed", "close", "detach",
+        };
+        return event < kEventCount ? kNames[event] : "unknown";
+    }
+private:
+    ev::tstamp start_;
+    uint32_t count_;
+    Entry entries_[kEvents];
+};
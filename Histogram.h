@@ -0,0 +1,131 @@
+#pragma once
+
+#include <atomic>
+#include <cstdint>
+#include <ctime>
+
+// Latency histogram in microseconds, log-bucketed the HDR way: values
+// below kLinear are counted exactly, every power of two above that is
+// split into kLinear / 2 equal buckets, so a bucket is never wider than
+// about 3% of the values it holds. Values past 2^36us, 19 hours, land in
+// the last bucket. Fixed buckets make histograms of different workers
+// mergeable by adding them up.
+//
+// Like Metrics, only the owning loop records, any thread may read.
+class Histogram
+{
+    static const uint32_t kLinearBits = 6;
+    static const uint64_t kLinear = 1 << kLinearBits;
+    static const uint64_t kHalf = kLinear / 2;
+public:
+    static const size_t kBuckets = 1024;
+
+    Histogram()
+    {
+        for(auto& bucket : buckets_)
+        {
+            bucket.store(0, std::memory_order_relaxed);
+        }
+        count_.store(0, std::memory_order_relaxed);
+        sum_.store(0, std::memory_order_relaxed);
+        max_.store(0, std::memory_order_relaxed);
+    }
+
+    // Monotonic microseconds, a vDSO call without a syscall. Stage
+    // latencies are differences of two of these
+    static uint64_t Now()
+    {
+        struct timespec ts;
+        clock_gettime(CLOCK_MONOTONIC, &ts);
+        return ts.tv_sec * 1000000ull + ts.tv_nsec / 1000;
+    }
+
+    // Owning loop only
+    void Record(uint64_t us)
+    {
+        Bump(buckets_[Bucket(us)], 1);
+        Bump(count_, 1);
+        Bump(sum_, us);
+        if(us > max_.load(std::memory_order_relaxed))
+        {
+            max_.store(us, std::memory_order_relaxed);
+        }
+    }
+
+    // Any thread. Adds other's counts to ours, which nobody else records to
+    void Merge(const Histogram& other)
+    {
+        for(size_t i = 0; i < kBuckets; i++)
+        {
+            Bump(buckets_[i], other.buckets_[i].load(std::memory_order_relaxed));
+        }
+        Bump(count_, other.Count());
+        Bump(sum_, other.Sum());
+        if(other.Max() > Max())
+        {
+            max_.store(other.Max(), std::memory_order_relaxed);
+        }
+    }
+
+    uint64_t Count() const { return count_.load(std::memory_order_relaxed); }
+    uint64_t Sum() const { return sum_.load(std::memory_order_relaxed); }
+    uint64_t Max() const { return max_.load(std::memory_order_relaxed); }
+    uint64_t BucketCount(size_t i) const { return buckets_[i].load(std::memory_order_relaxed); }
+
+    // Highest value of the bucket holding the q-th quantile, 0 when empty.
+    // Never above the largest value recorded
+    uint64_t Percentile(double q) const
+    {
+        uint64_t count = Count();
+        if(count == 0)
+        {
+            return 0;
+        }
+        uint64_t rank = q * count;
+        rank = rank < 1 ? 1 : rank;
+        uint64_t seen = 0;
+        for(size_t i = 0; i < kBuckets; i++)
+        {
+            seen += BucketCount(i);
+            if(seen >= rank)
+            {
+                return BucketHigh(i) < Max() ? BucketHigh(i) : Max();
+            }
+        }
+        return Max();
+    }
+
+    static size_t Bucket(uint64_t us)
+    {
+        if(us < kLinear)
+        {
+            return us;
+        }
+        uint32_t shift = 63 - __builtin_clzll(us) - (kLinearBits - 1);
+        size_t bucket = shift * kHalf + (us >> shift);
+        return bucket < kBuckets ? bucket : kBuckets - 1;
+    }
+    static uint64_t BucketLow(size_t i)
+    {
+        if(i < kLinear)
+        {
+            return i;
+        }
+        uint32_t shift = i / kHalf - 1;
+        return (i % kHalf + kHalf) << shift;
+    }
+    static uint64_t BucketHigh(size_t i)
+    {
+        return i < kLinear ? i : BucketLow(i) + (1ull << (i / kHalf - 1)) - 1;
+    }
+private:
+    static void Bump(std::atomic<uint64_t>& value, uint64_t n)
+    {
+        value.store(value.load(std::memory_order_relaxed) + n, std::memory_order_relaxed);
+    }
+private:
+    std::atomic<uint64_t> buckets_[kBuckets];
+    std::atomic<uint64_t> count_;
+    std::atomic<uint64_t> sum_;
+    std::atomic<uint64_t> max_;
+};
@@ -0,0 +1,352 @@
+#include <cerrno>
+#include <csignal>
+#include <cstring>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/syscall.h>
+#include "HotUpgrade.h"
+#include "AsyncLog.h"
+
+HotUpgrade::HotUpgrade(const std::string& path) :
+    path_(path),
+    listen_fd_(-1)
+{
+}
+
+HotUpgrade::~HotUpgrade()
+{
+    if(listen_fd_ != -1)
+    {
+        close(listen_fd_);
+        unlink(path_.c_str());
+    }
+}
+
+static bool MakeUnixAddress(const std::string& path, struct sockaddr_un& addr)
+{
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    if(path.size() >= sizeof(addr.sun_path))
+    {
+        LOG(INFO) << "Upgrade socket path too long: " << path;
+        return false;
+    }
+    memcpy(addr.sun_path, path.c_str(), path.size());
+    return true;
+}
+
+int HotUpgrade::TakeOver(std::vector<Socks5HandoffRecord>& sessions)
+{
+    struct sockaddr_un addr;
+    if(!MakeUnixAddress(path_, addr))
+    {
+        return -1;
+    }
+    int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if(fd == -1)
+    {
+        return -1;
+    }
+    if(connect(fd, (struct sockaddr*)&addr, sizeof(addr)) == -1)
+    {
+        // Nobody to take over from, a plain start
+        close(fd);
+        return -1;
+    }
+
+    int listen_fd = -1;
+    for(;;)
+    {
+        uint32_t type;
+        int fds[2];
+        size_t nfds = 2;
+        std::string payload;
+        if(!RecvMessage(fd, type, fds, nfds, payload))
+        {
+            LOG(INFO) << "Upgrade handoff from " << path_ << " broken off, error=" << strerror(errno);
+            break;
+        }
+        if(type == kListenFd && nfds == 1)
+        {
+            listen_fd = fds[0];
+        }
+        else if(type == kSession && nfds == 2 && payload.size() >= sizeof(SessionHeader))
+        {
+            SessionHeader header;
+            memcpy(&header, payload.data(), sizeof(header));
+            if(payload.size() != sizeof(header) + header.peer_data_len_ + header.remote_data_len_)
+            {
+                close(fds[0]);
+                close(fds[1]);
+                continue;
+            }
+            Socks5HandoffRecord record;
+            record.peer_fd_ = fds[0];
+            record.remote_fd_ = fds[1];
+            record.peer_addr_ = header.peer_addr_;
+            record.flags_ = header.flags_;
+            record.access_ = header.access_;
+            record.start_us_ = header.start_us_;
+            record.bytes_up_ = header.bytes_up_;
+            record.bytes_down_ = header.bytes_down_;
+            record.peer_data_.assign(payload, sizeof(header), header.peer_data_len_);
+            record.remote_data_.assign(payload, sizeof(header) + header.peer_data_len_, header.remote_data_len_);
+            sessions.push_back(std::move(record));
+        }
+        else if(type == kDone)
+        {
+            break;
+        }
+        else
+        {
+            for(size_t i = 0; i < nfds; i++)
+            {
+                close(fds[i]);
+            }
+        }
+    }
+    close(fd);
+    LOG(INFO) << "Took over from " << path_ << ", listenfd=" << listen_fd << ", sessions=" << sessions.size();
+    return listen_fd;
+}
+
+int HotUpgrade::Listen()
+{
+    struct sockaddr_un addr;
+    if(!MakeUnixAddress(path_, addr))
+    {
+        return -1;
+    }
+    listen_fd_ = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if(listen_fd_ == -1)
+    {
+        return -1;
+    }
+    // Whoever held the path before has handed over, or died
+    unlink(path_.c_str());
+    if(bind(listen_fd_, (struct sockaddr*)&addr, sizeof(addr)) == -1 || listen(listen_fd_, 1) == -1)
+    {
+        LOG(INFO) << "Upgrade socket " << path_ << " failed, error=" << strerror(errno);
+        close(listen_fd_);
+        listen_fd_ = -1;
+        return -1;
+    }
+    LOG(INFO) << "Upgrade socket " << path_;
+    return listen_fd_;
+}
+
+int HotUpgrade::Accept()
+{
+    int fd = accept4(listen_fd_, nullptr, nullptr, SOCK_CLOEXEC);
+    if(fd == -1)
+    {
+        return -1;
+    }
+    // The handoff is a short local burst, blocking keeps it simple
+    fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) & ~O_NONBLOCK);
+    return fd;
+}
+
+void HotUpgrade::HandedOver()
+{
+    if(listen_fd_ != -1)
+    {
+        // Not unlinked, the new process binds path again for the next upgrade
+        close(listen_fd_);
+        listen_fd_ = -1;
+    }
+}
+
+bool HotUpgrade::SendListenFd(int fd, int listen_fd)
+{
+    return SendMessage(fd, kListenFd, &listen_fd, 1, std::string());
+}
+
+bool HotUpgrade::SendSession(int fd, const Socks5HandoffRecord& record)
+{
+    SessionHeader header;
+    memset(&header, 0, sizeof(header));
+    header.peer_addr_ = record.peer_addr_;
+    header.flags_ = record.flags_;
+    header.access_ = record.access_;
+    header.start_us_ = record.start_us_;
+    header.bytes_up_ = record.bytes_up_;
+    header.bytes_down_ = record.bytes_down_;
+    header.peer_data_len_ = record.peer_data_.size();
+    header.remote_data_len_ = record.remote_data_.size();
+
+    std::string payload((const char*)&header, sizeof(header));
+    payload += record.peer_data_;
+    payload += record.remote_data_;
+    int fds[2] = {record.peer_fd_, record.remote_fd_};
+    return SendMessage(fd, kSession, fds, 2, payload);
+}
+
+bool HotUpgrade::SendDone(int fd)
+{
+    return SendMessage(fd, kDone, nullptr, 0, std::string());
+}
+
+bool HotUpgrade::SendMessage(int fd, uint32_t type, const int* fds, size_t nfds, const std::string& payload)
+{
+    MessageHeader header;
+    header.type_ = type;
+    header.len_ = payload.size();
+
+    struct iovec iov;
+    iov.iov_base = &header;
+    iov.iov_len = sizeof(header);
+
+    char control[CMSG_SPACE(2 * sizeof(int))];
+    struct msghdr msg;
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    if(nfds > 0)
+    {
+        memset(control, 0, sizeof(control));
+        msg.msg_control = control;
+        msg.msg_controllen = CMSG_SPACE(nfds * sizeof(int));
+        struct cmsghdr* cmsg = CMSG_FIRSTHDR(&msg);
+        cmsg->cmsg_level = SOL_SOCKET;
+        cmsg->cmsg_type = SCM_RIGHTS;
+        cmsg->cmsg_len = CMSG_LEN(nfds * sizeof(int));
+        memcpy(CMSG_DATA(cmsg), fds, nfds * sizeof(int));
+    }
+
+    if(sendmsg(fd, &msg, MSG_NOSIGNAL) != (ssize_t)sizeof(header))
+    {
+        return false;
+    }
+    size_t sent = 0;
+    while(sent < payload.size())
+    {
+        ssize_t ret = send(fd, payload.data() + sent, payload.size() - sent, MSG_NOSIGNAL);
+        if(ret == -1 && errno == EINTR)
+        {
+            continue;
+        }
+        if(ret <= 0)
+        {
+            return false;
+        }
+        sent += ret;
+    }
+    return true;
+}
+
+bool HotUpgrade::RecvMessage(int fd, uint32_t& type, int* fds, size_t& nfds, std::string& payload)
+{
+    MessageHeader header;
+    struct iovec iov;
+    iov.iov_base = &header;
+    iov.iov_len = sizeof(header);
+
+    char control[CMSG_SPACE(2 * sizeof(int))];
+    struct msghdr msg;
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control;
+    msg.msg_controllen = CMSG_SPACE(nfds * sizeof(int));
+
+    ssize_t ret;
+    do
+    {
+        ret = recvmsg(fd, &msg, MSG_WAITALL | MSG_CMSG_CLOEXEC);
+    } while(ret == -1 && errno == EINTR);
+    if(ret != (ssize_t)sizeof(header))
+    {
+        return false;
+    }
+
+    size_t max_fds = nfds;
+    nfds = 0;
+    for(struct cmsghdr* cmsg = CMSG_FIRSTHDR(&msg); cmsg != nullptr; cmsg = CMSG_NXTHDR(&msg, cmsg))
+    {
+        if(cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_RIGHTS)
+        {
+            nfds = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+            if(nfds > max_fds)
+            {
+                nfds = max_fds;
+            }
+            memcpy(fds, CMSG_DATA(cmsg), nfds * sizeof(int));
+        }
+    }
+
+    type = header.type_;
+    payload.resize(header.len_);
+    if(header.len_ > 0 && !ReadFull(fd, &payload[0], header.len_))
+    {
+        // Without the session the fds are of no use here, the sender
+        // still has its copies and keeps the tunnel
+        for(size_t i = 0; i < nfds; i++)
+        {
+            close(fds[i]);
+        }
+        nfds = 0;
+        return false;
+    }
+    return true;
+}
+
+bool HotUpgrade::ReadFull(int fd, void* buf, size_t len)
+{
+    size_t done = 0;
+    while(done < len)
+    {
+        ssize_t ret = read(fd, (char*)buf + done, len - done);
+        if(ret == -1 && errno == EINTR)
+        {
+            continue;
+        }
+        if(ret <= 0)
+        {
+            return false;
+        }
+        done += ret;
+    }
+    return true;
+}
+
+bool HotUpgrade::Exec(const std::vector<std::string>& argv)
+{
+    pid_t pid = fork();
+    if(pid == -1)
+    {
+        LOG(INFO) << "Upgrade fork failed, error=" << strerror(errno);
+        return false;
+    }
+    if(pid > 0)
+    {
+        LOG(INFO) << "Upgrade started " << argv[0] << ", pid=" << pid;
+        return true;
+    }
+
+    // A client or upstream fd leaking into the child would keep that
+    // connection open long after we closed it
+#ifdef SYS_close_range
+    if(syscall(SYS_close_range, 3, ~0U, 0) == -1)
+#endif
+    {
+        for(int fd = 3, max = sysconf(_SC_OPEN_MAX); fd < max; fd++)
+        {
+            close(fd);
+        }
+    }
+    sigset_t mask;
+    sigemptyset(&mask);
+    sigprocmask(SIG_SETMASK, &mask, nullptr);
+
+    std::vector<char*> args;
+    for(auto& arg : argv)
+    {
+        args.push_back(const_cast<char*>(arg.c_str()));
+    }
+    args.push_back(nullptr);
+    execvp(args[0], args.data());
+    _exit(127);
+}
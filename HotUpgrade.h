@@ -0,0 +1,68 @@
+#pragma once
+
+#include <cstdint>
+#include <string>
+#include <vector>
+#include <netinet/in.h>
+#include "Socks5Session.h"
+
+// Binary upgrade without dropping connections. The running process listens
+// on a unix socket, a newly started one connects to it and is handed the
+// listening socket, and optionally the established tunnels, with
+// SCM_RIGHTS. The old process then stops accepting, drains and exits.
+class HotUpgrade
+{
+    enum MessageType
+    {
+        kListenFd = 1,
+        kSession,
+        kDone,
+    };
+
+    struct MessageHeader
+    {
+        uint32_t type_;
+        // Payload bytes following the header
+        uint32_t len_;
+    };
+
+    struct SessionHeader
+    {
+        struct sockaddr_in peer_addr_;
+        uint32_t flags_;
+        uint32_t peer_data_len_;
+        uint32_t remote_data_len_;
+        AccessLog::Record access_;
+        uint64_t start_us_;
+        uint64_t bytes_up_;
+        uint64_t bytes_down_;
+    };
+public:
+    HotUpgrade(const std::string& path);
+    ~HotUpgrade();
+
+    // New process: fetches the listening socket, and the tunnels handed
+    // over with it, from the process listening on path. Returns -1 when
+    // there is none, the caller then binds its own socket
+    int TakeOver(std::vector<Socks5HandoffRecord>& sessions);
+
+    // Old process: accept upgrade requests on path, returns the socket to watch
+    int Listen();
+    // Returns the connected new process, in blocking mode, or -1
+    int Accept();
+    static bool SendListenFd(int fd, int listen_fd);
+    static bool SendSession(int fd, const Socks5HandoffRecord& record);
+    static bool SendDone(int fd);
+    // Stop listening, leaving path to the process that took over
+    void HandedOver();
+
+    // Starts argv again as a child, which takes over through path
+    bool Exec(const std::vector<std::string>& argv);
+private:
+    static bool SendMessage(int fd, uint32_t type, const int* fds, size_t nfds, const std::string& payload);
+    static bool RecvMessage(int fd, uint32_t& type, int* fds, size_t& nfds, std::string& payload);
+    static bool ReadFull(int fd, void* buf, size_t len);
+private:
+    std::string path_;
+    int listen_fd_;
+};
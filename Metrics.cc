@@ -0,0 +1,396 @@
+#include <cerrno>
+#include <cstdio>
+#include <cstring>
+#include <iomanip>
+#include <sstream>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <netinet/in.h>
+#include "Metrics.h"
+#include "AsyncLog.h"
+#include "Socks5Config.h"
+#include "Socks5Session.h"
+
+MetricsExporter::MetricsExporter(struct ev_loop* loop) :
+    loop_(loop),
+    listen_fd_(-1),
+    io_(loop)
+{
+}
+
+MetricsExporter::~MetricsExporter()
+{
+    Close();
+}
+
+bool MetricsExporter::Listen(const std::string& addr)
+{
+    if(addr.find('/') != std::string::npos)
+    {
+        struct sockaddr_un un;
+        memset(&un, 0, sizeof(un));
+        un.sun_family = AF_UNIX;
+        if(addr.size() >= sizeof(un.sun_path))
+        {
+            LOG(INFO) << "Metrics socket path too long: " << addr;
+            return false;
+        }
+        memcpy(un.sun_path, addr.c_str(), addr.size());
+        listen_fd_ = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+        // A previous or upgrading process may still hold the path
+        unlink(addr.c_str());
+        if(listen_fd_ == -1 || bind(listen_fd_, (struct sockaddr*)&un, sizeof(un)) == -1)
+        {
+            LOG(INFO) << "Metrics socket " << addr << " failed, error=" << strerror(errno);
+            Close();
+            return false;
+        }
+    }
+    else
+    {
+        struct sockaddr_in in;
+        if(!Socks5Config::ParseAddress(addr, in))
+        {
+            LOG(INFO) << "Invalid metrics address " << addr;
+            return false;
+        }
+        listen_fd_ = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, IPPROTO_TCP);
+        // The process taking over in a hot upgrade binds while we still listen
+        int enabled = 1;
+        setsockopt(listen_fd_, SOL_SOCKET, SO_REUSEADDR, &enabled, sizeof(int));
+        setsockopt(listen_fd_, SOL_SOCKET, SO_REUSEPORT, &enabled, sizeof(int));
+        if(listen_fd_ == -1 || bind(listen_fd_, (struct sockaddr*)&in, sizeof(in)) == -1)
+        {
+            LOG(INFO) << "Metrics listener " << addr << " failed, error=" << strerror(errno);
+            Close();
+            return false;
+        }
+    }
+    listen(listen_fd_, 16);
+    io_.set<MetricsExporter, &MetricsExporter::OnAccept>(this);
+    io_.start(listen_fd_, ev::READ);
+    LOG(INFO) << "Metrics on " << addr;
+    return true;
+}
+
+void MetricsExporter::Close()
+{
+    io_.stop();
+    if(listen_fd_ != -1)
+    {
+        close(listen_fd_);
+        listen_fd_ = -1;
+    }
+    while(!clients_.empty())
+    {
+        CloseClient(clients_.begin()->first);
+    }
+}
+
+void MetricsExporter::AddSource(const Metrics* metrics)
+{
+    sources_.push_back(metrics);
+}
+
+void MetricsExporter::OnAccept()
+{
+    int fd = accept4(listen_fd_, nullptr, nullptr, SOCK_NONBLOCK | SOCK_CLOEXEC);
+    if(fd == -1)
+    {
+        return;
+    }
+    std::unique_ptr<Client> client(new Client(loop_));
+    client->fd_ = fd;
+    client->watcher_.set<MetricsExporter, &MetricsExporter::OnClientEvent>(this);
+    client->watcher_.start(fd, ev::READ);
+    clients_[fd] = std::move(client);
+}
+
+void MetricsExporter::OnClientEvent(ev::io& watcher, int revents)
+{
+    auto it = clients_.find(watcher.fd);
+    if(it == clients_.end())
+    {
+        return;
+    }
+    Client& client = *it->second;
+    if(revents & EV_READ)
+    {
+        char buf[1024];
+        ssize_t ret = read(client.fd_, buf, sizeof(buf));
+        if(ret < 0 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR))
+        {
+            return;
+        }
+        if(ret < 0)
+        {
+            CloseClient(client.fd_);
+            return;
+        }
+        client.request_.append(buf, ret);
+        // Whatever was asked, the answer is the same. Wait for the end of
+        // the headers unless the client stopped sending
+        if(ret > 0 && client.request_.size() < kMaxRequest && client.request_.find("\r\n\r\n") == std::string::npos)
+        {
+            return;
+        }
+        std::string body = Render();
+        std::ostringstream out;
+        out << "HTTP/1.0 200 OK\r\n"
+            << "Content-Type: text/plain; version=0.0.4\r\n"
+            << "Content-Length: " << body.size() << "\r\n"
+            << "Connection: close\r\n\r\n"
+            << body;
+        client.response_ = out.str();
+        client.watcher_.set(ev::WRITE);
+    }
+    if(revents & EV_WRITE)
+    {
+        ssize_t ret = send(client.fd_, client.response_.data(), client.response_.size(), MSG_NOSIGNAL);
+        if(ret < 0 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR))
+        {
+            return;
+        }
+        if(ret > 0 && (size_t)ret < client.response_.size())
+        {
+            client.response_.erase(0, ret);
+            return;
+        }
+        CloseClient(client.fd_);
+    }
+}
+
+void MetricsExporter::CloseClient(int fd)
+{
+    auto it = clients_.find(fd);
+    if(it == clients_.end())
+    {
+        return;
+    }
+    it->second->watcher_.stop();
+    close(fd);
+    clients_.erase(it);
+}
+
+static const double kQuantiles[] = {0.5, 0.9, 0.99, 0.999};
+static const char* const kQuantileLabels[] = {"0.5", "0.9", "0.99", "0.999"};
+
+static void Header(std::ostringstream& out, const char* name, const char* type, const char* help)
+{
+    out << "# HELP " << name << " " << help << "\n# TYPE " << name << " " << type << "\n";
+}
+
+// merged holds Metrics::kLatencyCount histograms
+static void MergeLatencies(const std::vector<const Metrics*>& sources, Histogram* merged)
+{
+    for(const Metrics* metrics : sources)
+    {
+        for(uint8_t i = 0; i < Metrics::kLatencyCount; i++)
+        {
+            merged[i].Merge(metrics->Latencies((Metrics::Latency)i));
+        }
+    }
+}
+
+bool Metrics::WriteLatencies(const std::vector<const Metrics*>& sources, const std::string& path)
+{
+    std::unique_ptr<Histogram[]> merged(new Histogram[kLatencyCount]);
+    MergeLatencies(sources, merged.get());
+    FILE* file = fopen(path.c_str(), "w");
+    if(file == nullptr)
+    {
+        LOG(INFO) << "Latency file " << path << " failed, error=" << strerror(errno);
+        return false;
+    }
+    fprintf(file, "# stage count mean_us p50_us p90_us p99_us p999_us max_us\n");
+    for(uint8_t i = 0; i < kLatencyCount; i++)
+    {
+        const Histogram& latency = merged[i];
+        fprintf(file, "%s %lu %lu", LatencyName(i), (unsigned long)latency.Count(),
+                (unsigned long)(latency.Count() ? latency.Sum() / latency.Count() : 0));
+        for(double q : kQuantiles)
+        {
+            fprintf(file, " %lu", (unsigned long)latency.Percentile(q));
+        }
+        fprintf(file, " %lu\n", (unsigned long)latency.Max());
+    }
+    // Enough to merge runs or recompute any percentile later
+    fprintf(file, "# stage bucket_low_us bucket_high_us count\n");
+    for(uint8_t i = 0; i < kLatencyCount; i++)
+    {
+        for(size_t bucket = 0; bucket < Histogram::kBuckets; bucket++)
+        {
+            if(merged[i].BucketCount(bucket) > 0)
+            {
+                fprintf(file, "%s %lu %lu %lu\n", LatencyName(i), (unsigned long)Histogram::BucketLow(bucket),
+                        (unsigned long)Histogram::BucketHigh(bucket), (unsigned long)merged[i].BucketCount(bucket));
+            }
+        }
+    }
+    fclose(file);
+    LOG(INFO) << "Latencies written to " << path;
+    return true;
+}
+
+std::string MetricsExporter::Render()
+{
+    // Workers keep counting while we add up, each sum is as of some
+    // instant during the scrape
+    uint64_t counters[Metrics::kCounterCount] = {};
+    uint64_t failures[AccessLog::kReasonCount] = {};
+    int64_t sessions[Metrics::kSessionStates] = {};
+    uint64_t syscalls[Metrics::kSyscallCount] = {};
+    uint64_t eagain[Metrics::kSyscallCount] = {};
+    int64_t buffered = 0;
+    for(const Metrics* metrics : sources_)
+    {
+        buffered += metrics->Buffered();
+        for(size_t i = 0; i < Metrics::kCounterCount; i++)
+        {
+            counters[i] += metrics->Get((Metrics::Counter)i);
+        }
+        for(uint8_t i = 0; i < AccessLog::kReasonCount; i++)
+        {
+            failures[i] += metrics->HandshakeFailures(i);
+        }
+        for(uint8_t i = 0; i < Metrics::kSessionStates; i++)
+        {
+            sessions[i] += metrics->Sessions(i);
+        }
+        for(uint8_t i = 0; i < Metrics::kSyscallCount; i++)
+        {
+            syscalls[i] += metrics->Syscalls(i);
+            eagain[i] += metrics->Eagain(i);
+        }
+    }
+
+    std::ostringstream out;
+    out << std::fixed << std::setprecision(6);
+    Header(out, "uladder_sessions", "gauge", "Open sessions by state.");
+    for(uint8_t i = 0; i < Metrics::kSessionStates; i++)
+    {
+        out << "uladder_sessions{state=\"" << Socks5Session::StateName(i) << "\"} " << sessions[i] << "\n";
+    }
+    Header(out, "uladder_accepted_total", "counter", "Clients given a session.");
+    out << "uladder_accepted_total " << counters[Metrics::kAccepted] << "\n";
+    Header(out, "uladder_rejected_total", "counter", "Clients turned away over an admission limit.");
+    out << "uladder_rejected_total " << counters[Metrics::kRejected] << "\n";
+    Header(out, "uladder_greetings_rejected_total", "counter", "Greetings offering no supported method.");
+    out << "uladder_greetings_rejected_total " << counters[Metrics::kGreetingsRejected] << "\n";
+    Header(out, "uladder_handshake_failures_total", "counter", "Sessions closed before their tunnel was up, by reason.");
+    for(uint8_t i = 0; i < AccessLog::kReasonCount; i++)
+    {
+        // The rest only happen to established tunnels
+        if(i != AccessLog::kShutdown && i != AccessLog::kFinished && i != AccessLog::kIdleTimeout)
+        {
+            out << "uladder_handshake_failures_total{reason=\"" << AccessLog::ReasonName(i) << "\"} " << failures[i] << "\n";
+        }
+    }
+    Header(out, "uladder_relayed_bytes_total", "counter", "Bytes read from clients (up) and upstreams (down).");
+    out << "uladder_relayed_bytes_total{direction=\"up\"} " << counters[Metrics::kBytesUp] << "\n";
+    out << "uladder_relayed_bytes_total{direction=\"down\"} " << counters[Metrics::kBytesDown] << "\n";
+    Header(out, "uladder_buffer_bytes", "gauge", "Heap memory held by session buffers.");
+    out << "uladder_buffer_bytes " << buffered << "\n";
+    Header(out, "uladder_dns_lookup_failures_total", "counter", "Lookups that found no IPv4 address.");
+    out << "uladder_dns_lookup_failures_total " << counters[Metrics::kResolveFailures] << "\n";
+
+    uint64_t total_syscalls = 0;
+    Header(out, "uladder_syscalls_total", "counter", "Syscalls on the data path, epoll_ctl counts watcher mask changes.");
+    for(uint8_t i = 0; i < Metrics::kSyscallCount; i++)
+    {
+        out << "uladder_syscalls_total{call=\"" << Metrics::SyscallName(i) << "\"} " << syscalls[i] << "\n";
+        total_syscalls += syscalls[i];
+    }
+    Header(out, "uladder_syscalls_eagain_total", "counter", "Syscalls that found nothing to do.");
+    for(uint8_t i = 0; i < Metrics::kSyscallCount; i++)
+    {
+        if(eagain[i] > 0)
+        {
+            out << "uladder_syscalls_eagain_total{call=\"" << Metrics::SyscallName(i) << "\"} " << eagain[i] << "\n";
+        }
+    }
+    Header(out, "uladder_loop_wakeups_total", "counter", "Event loop iterations.");
+    out << "uladder_loop_wakeups_total " << counters[Metrics::kWakeups] << "\n";
+    uint64_t relayed = counters[Metrics::kBytesUp] + counters[Metrics::kBytesDown];
+    Header(out, "uladder_bytes_per_syscall", "gauge", "Relayed bytes per data path syscall since start.");
+    out << "uladder_bytes_per_syscall " << Metrics::BytesPerSyscall(relayed, total_syscalls) << "\n";
+    Header(out, "uladder_wakeups_per_mb", "gauge", "Event loop iterations per relayed MB since start.");
+    out << "uladder_wakeups_per_mb " << Metrics::WakeupsPerMB(counters[Metrics::kWakeups], relayed) << "\n";
+
+    std::unique_ptr<Histogram[]> latencies(new Histogram[Metrics::kLatencyCount]);
+    MergeLatencies(sources_, latencies.get());
+    Header(out, "uladder_latency_seconds", "summary", "Session stage latencies, the resolve stage blocks the event loop.");
+    for(uint8_t i = 0; i < Metrics::kLatencyCount; i++)
+    {
+        const char* stage = Metrics::LatencyName(i);
+        for(size_t q = 0; q < sizeof(kQuantiles) / sizeof(kQuantiles[0]); q++)
+        {
+            out << "uladder_latency_seconds{stage=\"" << stage << "\",quantile=\"" << kQuantileLabels[q] << "\"} "
+                << latencies[i].Percentile(kQuantiles[q]) / 1e6 << "\n";
+        }
+        out << "uladder_latency_seconds_sum{stage=\"" << stage << "\"} " << latencies[i].Sum() / 1e6 << "\n";
+        out << "uladder_latency_seconds_count{stage=\"" << stage << "\"} " << latencies[i].Count() << "\n";
+    }
+    Header(out, "uladder_latency_max_seconds", "gauge", "Longest latency of each stage so far.");
+    for(uint8_t i = 0; i < Metrics::kLatencyCount; i++)
+    {
+        out << "uladder_latency_max_seconds{stage=\"" << Metrics::LatencyName(i) << "\"} " << latencies[i].Max() / 1e6 << "\n";
+    }
+    Histogram lag;
+    for(const Metrics* metrics : sources_)
+    {
+        lag.Merge(metrics->LoopLag());
+    }
+    Header(out, "uladder_loop_lag_seconds", "summary", "Time event loop iterations spent on callbacks, what a ready socket may wait.");
+    for(size_t q = 0; q < sizeof(kQuantiles) / sizeof(kQuantiles[0]); q++)
+    {
+        out << "uladder_loop_lag_seconds{quantile=\"" << kQuantileLabels[q] << "\"} " << lag.Percentile(kQuantiles[q]) / 1e6 << "\n";
+    }
+    out << "uladder_loop_lag_seconds_sum " << lag.Sum() / 1e6 << "\n";
+    out << "uladder_loop_lag_seconds_count " << lag.Count() << "\n";
+    Header(out, "uladder_loop_lag_max_seconds", "gauge", "Longest event loop iteration so far.");
+    out << "uladder_loop_lag_max_seconds " << lag.Max() / 1e6 << "\n";
+    // Per worker, they are there to compare loops and builds
+    std::ostringstream perf;
+    for(size_t w = 0; w < sources_.size(); w++)
+    {
+        for(uint8_t r = 0; r < Metrics::kPerfRegionCount; r++)
+        {
+            for(uint8_t e = 0; e < PerfCounters::kEventCount; e++)
+            {
+                if(sources_[w]->Perf(r, e) > 0)
+                {
+                    perf << "uladder_perf_events_total{worker=\"" << w << "\",region=\"" << Metrics::PerfRegionName(r)
+                         << "\",event=\"" << PerfCounters::EventName(e) << "\"} " << sources_[w]->Perf(r, e) << "\n";
+                }
+            }
+        }
+    }
+    if(!perf.str().empty())
+    {
+        Header(out, "uladder_perf_events_total", "counter", "Hardware counters around the callbacks of sampled sessions.");
+        out << perf.str();
+        Header(out, "uladder_perf_units_total", "counter", "What the perf events were spent on: handshakes completed, bytes relayed.");
+        for(size_t w = 0; w < sources_.size(); w++)
+        {
+            for(uint8_t r = 0; r < Metrics::kPerfRegionCount; r++)
+            {
+                out << "uladder_perf_units_total{worker=\"" << w << "\",region=\"" << Metrics::PerfRegionName(r) << "\"} "
+                    << sources_[w]->PerfUnits(r) << "\n";
+            }
+        }
+    }
+    Header(out, "uladder_log_dropped_total", "counter", "Log records dropped on full queues.");
+    out << "uladder_log_dropped_total " << AsyncLog::Dropped() << "\n";
+    if(AccessLog::Enabled())
+    {
+        Header(out, "uladder_access_log_records_total", "counter", "Access log slots claimed.");
+        out << "uladder_access_log_records_total " << AccessLog::Appended() << "\n";
+        Header(out, "uladder_access_log_dropped_total", "counter", "Access log records dropped.");
+        out << "uladder_access_log_dropped_total " << AccessLog::Dropped() << "\n";
+    }
+    Header(out, "uladder_workers", "gauge", "Event loop threads.");
+    out << "uladder_workers " << sources_.size() << "\n";
+    return out.str();
+}
@@ -0,0 +1,247 @@
+#pragma once
+
+#include <atomic>
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <unordered_map>
+#include <vector>
+#include <ev++.h>
+#include "AccessLog.h"
+#include "Histogram.h"
+#include "PerfCounters.h"
+
+// Counters and gauges of one worker loop. Only that loop updates them, so
+// an update is a plain load and store on cache lines no other thread
+// writes: no locked instruction and no line bouncing between workers. A
+// scrape reads every worker's copy with relaxed loads and adds them up,
+// see MetricsExporter.
+class alignas(64) Metrics
+{
+public:
+    enum Counter
+    {
+        // Clients given a session, and turned away over an admission limit
+        kAccepted,
+        kRejected,
+        // Read from clients, and from upstreams
+        kBytesUp,
+        kBytesDown,
+        // Greetings offering no method we support
+        kGreetingsRejected,
+        // Lookups of requested domains that found nothing, kResolve times all
+        kResolveFailures,
+        // Loop iterations, each one return from epoll_wait
+        kWakeups,
+        kCounterCount,
+    };
+
+    // Syscalls on the data path, counted where they are made
+    enum Syscall
+    {
+        // Socket reads and writes of session buffers
+        kReadCall,
+        kWriteCall,
+        // Liveness probes of pooled upstream sockets
+        kRecvCall,
+        // Reject replies and TCP Fast Open connects
+        kSendCall,
+        kAcceptCall,
+        kConnectCall,
+        // Watcher event mask changes, each costs libev an epoll_ctl
+        kEpollCtl,
+        kSyscallCount,
+    };
+
+    // Stages of a session's life, timed with Histogram::Now()
+    enum Latency
+    {
+        // Greeting parsed to a complete request
+        kHandshake,
+        // The blocking lookup of the requested domain
+        kResolve,
+        // Upstream TCP connect, from the first attempt, pooled sockets not
+        // counted
+        kConnect,
+        // Success reply to the first upstream byte
+        kFirstByte,
+        // Accept to close, across migrations and upgrades
+        kLifetime,
+        kLatencyCount,
+    };
+
+    // Where the hardware counters of sampled sessions are charged to, see
+    // --perf-sample
+    enum PerfRegion
+    {
+        // Callbacks before the tunnel is up, per completed handshake
+        kPerfHandshake,
+        // Callbacks of established tunnels, per byte relayed
+        kPerfRelay,
+        kPerfRegionCount,
+    };
+
+    // Socks5Session states, see Socks5Session::StateName()
+    static const size_t kSessionStates = 6;
+
+    Metrics()
+    {
+        for(auto& counter : counters_)
+        {
+            counter.store(0, std::memory_order_relaxed);
+        }
+        for(auto& failures : handshake_failures_)
+        {
+            failures.store(0, std::memory_order_relaxed);
+        }
+        for(auto& sessions : sessions_)
+        {
+            sessions.store(0, std::memory_order_relaxed);
+        }
+        buffered_.store(0, std::memory_order_relaxed);
+        for(size_t i = 0; i < kSyscallCount; i++)
+        {
+            syscalls_[i].store(0, std::memory_order_relaxed);
+            eagain_[i].store(0, std::memory_order_relaxed);
+        }
+        for(size_t i = 0; i < kPerfRegionCount; i++)
+        {
+            for(auto& count : perf_[i])
+            {
+                count.store(0, std::memory_order_relaxed);
+            }
+            perf_units_[i].store(0, std::memory_order_relaxed);
+        }
+    }
+
+    // Owning loop only
+    void Add(Counter counter, uint64_t n = 1) { Bump(counters_[counter], n); }
+    // A session given up on before its tunnel was up, by AccessLog reason
+    void AddHandshakeFailure(uint8_t reason) { Bump(handshake_failures_[reason % AccessLog::kReasonCount], 1); }
+    void AddSessions(uint8_t state, int64_t n) { Bump(sessions_[state % kSessionStates], n); }
+    // Heap bytes session buffers of this loop took, or gave back, see StreamBuffer::AccountTo()
+    void AddBuffered(int64_t bytes) { Bump(buffered_, bytes); }
+    void AddLatency(Latency stage, uint64_t us) { latencies_[stage].Record(us); }
+    // Time one loop iteration spent between epoll_wait calls
+    void AddLoopLag(uint64_t us) { loop_lag_.Record(us); }
+    // calls made, eagain of which found nothing to do
+    void AddSyscalls(Syscall call, uint64_t calls, uint64_t eagain = 0)
+    {
+        Bump(syscalls_[call], calls);
+        if(eagain > 0)
+        {
+            Bump(eagain_[call], eagain);
+        }
+    }
+
+    // counts holds PerfCounters::kEventCount, units are handshakes or bytes
+    void AddPerf(PerfRegion region, const uint64_t* counts, uint64_t units)
+    {
+        for(size_t i = 0; i < PerfCounters::kEventCount; i++)
+        {
+            Bump(perf_[region][i], counts[i]);
+        }
+        Bump(perf_units_[region], units);
+    }
+
+    // Any thread
+    uint64_t Get(Counter counter) const { return counters_[counter].load(std::memory_order_relaxed); }
+    uint64_t HandshakeFailures(uint8_t reason) const { return handshake_failures_[reason].load(std::memory_order_relaxed); }
+    int64_t Sessions(uint8_t state) const { return sessions_[state].load(std::memory_order_relaxed); }
+    int64_t Buffered() const { return buffered_.load(std::memory_order_relaxed); }
+    const Histogram& Latencies(Latency stage) const { return latencies_[stage]; }
+    const Histogram& LoopLag() const { return loop_lag_; }
+    uint64_t Syscalls(uint8_t call) const { return syscalls_[call].load(std::memory_order_relaxed); }
+    uint64_t Eagain(uint8_t call) const { return eagain_[call].load(std::memory_order_relaxed); }
+    uint64_t Perf(uint8_t region, uint8_t event) const { return perf_[region][event].load(std::memory_order_relaxed); }
+    uint64_t PerfUnits(uint8_t region) const { return perf_units_[region].load(std::memory_order_relaxed); }
+    uint64_t TotalSyscalls() const
+    {
+        uint64_t total = 0;
+        for(uint8_t i = 0; i < kSyscallCount; i++)
+        {
+            total += Syscalls(i);
+        }
+        return total;
+    }
+
+    // Relayed bytes per syscall and loop wakeups per relayed MB, what a
+    // change to the data path is judged by. 0 before any traffic
+    static double BytesPerSyscall(uint64_t bytes, uint64_t syscalls) { return syscalls > 0 ? (double)bytes / syscalls : 0; }
+    static double WakeupsPerMB(uint64_t wakeups, uint64_t bytes) { return bytes > 0 ? wakeups * 1048576.0 / bytes : 0; }
+
+    static const char* LatencyName(uint8_t stage)
+    {
+        static const char* const kNames[kLatencyCount] = {"handshake", "resolve", "connect", "first_byte", "lifetime"};
+        return stage < kLatencyCount ? kNames[stage] : "unknown";
+    }
+    static const char* PerfRegionName(uint8_t region)
+    {
+        static const char* const kNames[kPerfRegionCount] = {"handshake", "relay"};
+        return region < kPerfRegionCount ? kNames[region] : "unknown";
+    }
+    static const char* SyscallName(uint8_t call)
+    {
+        static const char* const kNames[kSyscallCount] = {"read", "write", "recv", "send", "accept", "connect", "epoll_ctl"};
+        return call < kSyscallCount ? kNames[call] : "unknown";
+    }
+    // After the workers stopped: the merged latencies of all of them, as
+    // percentiles followed by every non-empty bucket. False when path
+    // can't be written
+    static bool WriteLatencies(const std::vector<const Metrics*>& sources, const std::string& path);
+private:
+    template<typename T>
+    static void Bump(std::atomic<T>& value, typename std::atomic<T>::value_type n)
+    {
+        value.store(value.load(std::memory_order_relaxed) + n, std::memory_order_relaxed);
+    }
+private:
+    std::atomic<uint64_t> counters_[kCounterCount];
+    std::atomic<uint64_t> handshake_failures_[AccessLog::kReasonCount];
+    std::atomic<int64_t> sessions_[kSessionStates];
+    std::atomic<int64_t> buffered_;
+    std::atomic<uint64_t> syscalls_[kSyscallCount];
+    std::atomic<uint64_t> eagain_[kSyscallCount];
+    std::atomic<uint64_t> perf_[kPerfRegionCount][PerfCounters::kEventCount];
+    std::atomic<uint64_t> perf_units_[kPerfRegionCount];
+    Histogram latencies_[kLatencyCount];
+    Histogram loop_lag_;
+};
+
+// Serves the metrics of all workers in the Prometheus text format over
+// HTTP, on a local TCP port or a unix socket. Runs on one worker's loop,
+// a scrape is a handful of relaxed loads per worker and one write.
+class MetricsExporter
+{
+    // Request bytes read before answering anyway
+    static const size_t kMaxRequest = 4096;
+
+    struct Client
+    {
+        explicit Client(struct ev_loop* loop) : fd_(-1), watcher_(loop) {}
+        int fd_;
+        ev::io watcher_;
+        std::string request_;
+        std::string response_;
+    };
+public:
+    explicit MetricsExporter(struct ev_loop* loop);
+    ~MetricsExporter();
+
+    // HOST:PORT, or a path for a unix socket. False when it can't listen
+    bool Listen(const std::string& addr);
+    void Close();
+    // One per worker, in worker order
+    void AddSource(const Metrics* metrics);
+private:
+    void OnAccept();
+    void OnClientEvent(ev::io& watcher, int revents);
+    void CloseClient(int fd);
+    std::string Render();
+private:
+    ev::loop_ref loop_;
+    int listen_fd_;
+    ev::io io_;
+    std::vector<const Metrics*> sources_;
+    std::unordered_map<int, std::unique_ptr<Client>> clients_;
+};
@@ -0,0 +1,128 @@
+#include <cerrno>
+#include <cstring>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <linux/perf_event.h>
+#include "PerfCounters.h"
+#include "AsyncLog.h"
+
+static const uint64_t kConfigs[PerfCounters::kEventCount] = {
+    PERF_COUNT_HW_CPU_CYCLES,
+    PERF_COUNT_HW_INSTRUCTIONS,
+    PERF_COUNT_HW_CACHE_MISSES,
+    PERF_COUNT_HW_BRANCH_MISSES,
+};
+
+static int OpenEvent(uint64_t config, bool exclude_kernel, int group)
+{
+    struct perf_event_attr attr;
+    memset(&attr, 0, sizeof(attr));
+    attr.size = sizeof(attr);
+    attr.type = PERF_TYPE_HARDWARE;
+    attr.config = config;
+    attr.exclude_kernel = exclude_kernel;
+    attr.exclude_hv = 1;
+    attr.read_format = PERF_FORMAT_GROUP | PERF_FORMAT_TOTAL_TIME_ENABLED | PERF_FORMAT_TOTAL_TIME_RUNNING;
+    // This thread only, on whatever CPU it runs
+    return syscall(SYS_perf_event_open, &attr, 0, -1, group, PERF_FLAG_FD_CLOEXEC);
+}
+
+PerfCounters::PerfCounters() :
+    leader_(-1),
+    opened_(0)
+{
+    for(int i = 0; i < kEventCount; i++)
+    {
+        fds_[i] = -1;
+        slots_[i] = -1;
+    }
+}
+
+PerfCounters::~PerfCounters()
+{
+    Close();
+}
+
+bool PerfCounters::Open()
+{
+    // Counting the kernel as well needs perf_event_paranoid < 2 or
+    // CAP_PERFMON, fall back to user space only
+    bool exclude_kernel = false;
+    for(int i = 0; i < kEventCount; i++)
+    {
+        int fd = OpenEvent(kConfigs[i], exclude_kernel, leader_);
+        if(fd == -1 && leader_ == -1 && (errno == EACCES || errno == EPERM))
+        {
+            exclude_kernel = true;
+            fd = OpenEvent(kConfigs[i], exclude_kernel, leader_);
+        }
+        if(fd == -1)
+        {
+            LOG(INFO) << "Perf counter " << EventName(i) << " unavailable, error=" << strerror(errno);
+            continue;
+        }
+        if(leader_ == -1)
+        {
+            leader_ = fd;
+        }
+        fds_[i] = fd;
+        slots_[i] = opened_++;
+    }
+    if(leader_ == -1)
+    {
+        return false;
+    }
+    ioctl(leader_, PERF_EVENT_IOC_RESET, PERF_IOC_FLAG_GROUP);
+    ioctl(leader_, PERF_EVENT_IOC_ENABLE, PERF_IOC_FLAG_GROUP);
+    LOG(INFO) << "Perf counters open, events=" << opened_ << (exclude_kernel ? ", user space only" : "");
+    return true;
+}
+
+void PerfCounters::Close()
+{
+    for(int i = 0; i < kEventCount; i++)
+    {
+        if(fds_[i] != -1)
+        {
+            close(fds_[i]);
+            fds_[i] = -1;
+        }
+        slots_[i] = -1;
+    }
+    leader_ = -1;
+    opened_ = 0;
+}
+
+bool PerfCounters::Read(Values& values)
+{
+    // nr, time enabled, time running, then one count per event in the
+    // order they joined the group
+    uint64_t buf[3 + kEventCount];
+    if(leader_ == -1 || read(leader_, buf, sizeof(buf)) < (ssize_t)((3 + opened_) * sizeof(uint64_t)))
+    {
+        return false;
+    }
+    values.enabled_ = buf[1];
+    values.running_ = buf[2];
+    for(int i = 0; i < kEventCount; i++)
+    {
+        values.counts_[i] = slots_[i] == -1 ? 0 : buf[3 + slots_[i]];
+    }
+    return true;
+}
+
+bool PerfCounters::Delta(const Values& start, const Values& end, uint64_t* counts)
+{
+    uint64_t running = end.running_ - start.running_;
+    if(running == 0)
+    {
+        return false;
+    }
+    double scale = (double)(end.enabled_ - start.enabled_) / running;
+    for(int i = 0; i < kEventCount; i++)
+    {
+        counts[i] = (end.counts_[i] - start.counts_[i]) * scale;
+    }
+    return true;
+}
@@ -0,0 +1,61 @@
+#pragma once
+
+#include <cstdint>
+
+// Hardware counters of the calling thread through perf_event_open, no
+// external tools involved. The events form one group so the kernel puts
+// them on the PMU together, their ratios hold even while multiplexed, and
+// one read() returns all of them. Events the CPU or the hypervisor doesn't
+// offer are left out, none at all and Open() fails.
+//
+// Counting is not free: a read is a syscall, so sessions read them around
+// their callbacks only when sampled, see --perf-sample.
+class PerfCounters
+{
+public:
+    enum Event
+    {
+        kCycles,
+        kInstructions,
+        kCacheMisses,
+        kBranchMisses,
+        kEventCount,
+    };
+
+    // Counts since Open(), 0 for events not available
+    struct Values
+    {
+        uint64_t counts_[kEventCount];
+        // Nanoseconds the group was enabled, and actually on the PMU
+        uint64_t enabled_;
+        uint64_t running_;
+    };
+
+    PerfCounters();
+    ~PerfCounters();
+    PerfCounters(const PerfCounters&) = delete;
+    PerfCounters& operator=(const PerfCounters&) = delete;
+
+    // On the thread to count, user and kernel time alike so the syscalls
+    // of the relay are part of its cost. False, and logged, when the
+    // counters can't be had: no PMU in the VM, or perf_event_paranoid
+    bool Open();
+    void Close();
+    bool IsOpen() const { return leader_ != -1; }
+    bool Read(Values& values);
+    // Counts from start to end, scaled up for the time the group was off
+    // the PMU. False when it never ran in between
+    static bool Delta(const Values& start, const Values& end, uint64_t* counts);
+
+    static const char* EventName(uint8_t event)
+    {
+        static const char* const kNames[kEventCount] = {"cycles", "instructions", "cache_misses", "branch_misses"};
+        return event < kEventCount ? kNames[event] : "unknown";
+    }
+private:
+    int leader_;
+    int fds_[kEventCount];
+    // Position of each open event in what the group read returns
+    int slots_[kEventCount];
+    int opened_;
+};
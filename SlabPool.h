@@ -0,0 +1,143 @@
+#pragma once
+
+#include <cstdint>
+#include <memory>
+#include <new>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+// Object pool handing out T from fixed-size slabs, so creating and
+// destroying objects costs no heap allocation once the pool has warmed up.
+// Every slot carries a generation that is bumped on Destroy(): a Handle
+// stays safe to hold after its object is gone, Get() then returns nullptr.
+template<class T, size_t kSlabSize = 256>
+class SlabPool
+{
+    static const uint32_t kNoSlot = 0xFFFFFFFF;
+
+    struct Slot
+    {
+        // Must stay the first member, see SlotOf()
+        typename std::aligned_storage<sizeof(T), alignof(T)>::type storage_;
+        uint32_t index_;
+        uint32_t generation_;
+        uint32_t next_free_;
+        bool live_;
+    };
+public:
+    typedef uint64_t Handle;
+    static const Handle kInvalidHandle = 0;
+
+    SlabPool() :
+        free_(kNoSlot),
+        live_(0)
+    {
+    }
+
+    ~SlabPool()
+    {
+        for(size_t i = 0; i < slabs_.size() * kSlabSize; i++)
+        {
+            Slot& slot = SlotAt(i);
+            if(slot.live_)
+            {
+                Destroy(reinterpret_cast<T*>(&slot.storage_));
+            }
+        }
+    }
+
+    SlabPool(const SlabPool&) = delete;
+    SlabPool& operator=(const SlabPool&) = delete;
+
+    template<class... Args>
+    T* Create(Args&&... args)
+    {
+        if(free_ == kNoSlot)
+        {
+            Grow();
+        }
+        Slot& slot = SlotAt(free_);
+        free_ = slot.next_free_;
+
+        T* object = new (&slot.storage_) T(std::forward<Args>(args)...);
+        slot.live_ = true;
+        live_ ++;
+        return object;
+    }
+
+    void Destroy(T* object)
+    {
+        Slot& slot = SlotOf(object);
+        object->~T();
+        slot.live_ = false;
+        // Never hand out generation 0, so no handle equals kInvalidHandle
+        if(++slot.generation_ == 0)
+        {
+            slot.generation_ = 1;
+        }
+        slot.next_free_ = free_;
+        free_ = slot.index_;
+        live_ --;
+    }
+
+    Handle HandleOf(const T* object) const
+    {
+        const Slot& slot = SlotOf(object);
+        return ((Handle)slot.generation_ << 32) | slot.index_;
+    }
+
+    T* Get(Handle handle)
+    {
+        uint32_t index = handle & 0xFFFFFFFF;
+        if(index >= slabs_.size() * kSlabSize)
+        {
+            return nullptr;
+        }
+        Slot& slot = SlotAt(index);
+        if(!slot.live_ || slot.generation_ != (uint32_t)(handle >> 32))
+        {
+            return nullptr;
+        }
+        return reinterpret_cast<T*>(&slot.storage_);
+    }
+
+    size_t Size() const { return live_; }
+    size_t Capacity() const { return slabs_.size() * kSlabSize; }
+    size_t Slabs() const { return slabs_.size(); }
+private:
+    Slot& SlotAt(uint32_t index)
+    {
+        return slabs_[index / kSlabSize][index % kSlabSize];
+    }
+
+    static Slot& SlotOf(T* object)
+    {
+        return *reinterpret_cast<Slot*>(object);
+    }
+
+    static const Slot& SlotOf(const T* object)
+    {
+        return *reinterpret_cast<const Slot*>(object);
+    }
+
+    void Grow()
+    {
+        uint32_t base = slabs_.size() * kSlabSize;
+        slabs_.emplace_back(new Slot[kSlabSize]);
+        // Chain the new slots in index order, lowest handed out first
+        for(size_t i = kSlabSize; i > 0; i--)
+        {
+            Slot& slot = slabs_.back()[i - 1];
+            slot.index_ = base + i - 1;
+            slot.generation_ = 1;
+            slot.live_ = false;
+            slot.next_free_ = free_;
+            free_ = slot.index_;
+        }
+    }
+private:
+    std::vector<std::unique_ptr<Slot[]>> slabs_;
+    uint32_t free_;
+    size_t live_;
+};
@@ -0,0 +1,321 @@
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <getopt.h>
+#include <netdb.h>
+#include <arpa/inet.h>
+#include <sys/socket.h>
+#include "Socks5Config.h"
+
+Socks5Config::Socks5Config() :
+    stats_interval_(60.0),
+    trace_sample_(0),
+    perf_sample_(0),
+    stall_threshold_ms_(100),
+    flight_recorder_(true),
+    handshake_timeout_(10.0),
+    connect_timeout_(10.0),
+    idle_timeout_(300.0),
+    optimistic_reply_(false),
+    tcp_fastopen_(false),
+    source_policy_(SourceAddressPool::kRoundRobin),
+    upstream_pool_size_(4),
+    upstream_pool_idle_timeout_(30.0),
+    workers_(1),
+    rebalance_interval_(5.0),
+    max_sessions_(0),
+    max_handshakes_(0),
+    max_buffered_(0),
+    upgrade_sessions_(false),
+    access_log_segment_size_(64 << 20),
+    access_log_segments_(16)
+{
+    memset(&listen_addr_, 0, sizeof(listen_addr_));
+    listen_addr_.sin_family = AF_INET;
+    listen_addr_.sin_port = htons(9981);
+    listen_addr_.sin_addr.s_addr = INADDR_ANY;
+}
+
+void Socks5Config::Usage(const char* prog)
+{
+    fprintf(stderr,
+        "Usage: %s [options]\n"
+        "  -l, --listen ADDR:PORT        listen address (default 0.0.0.0:9981)\n"
+        "  -s, --stats-interval SEC      seconds between stats reports, 0 to disable (default 60)\n"
+        "      --trace-sample N          log per-event detail for every Nth session, 0 for none (default 0)\n"
+        "      --stall-threshold MS      log loop iterations and callbacks blocking the loop this long, 0 for never (default 100)\n"
+        "      --perf-sample N           count cycles, instructions and misses of every Nth session, 0 for none (default 0)\n"
+        "      --no-flight-recorder      don't keep each session's last events for fatal errors and SIGUSR2\n"
+        "      --handshake-timeout SEC   deadline from accept to a complete request (default 10)\n"
+        "  -c, --connect-timeout SEC     deadline of one upstream connect attempt (default 10)\n"
+        "  -i, --idle-timeout SEC        close established tunnels idle for SEC (default 300)\n"
+        "  -o, --optimistic-reply        reply success to CONNECT before the upstream connect completes\n"
+        "  -f, --tfo                     enable TCP Fast Open for clients and upstream connects\n"
+        "  -b, --source ADDR             source address for upstream connects, repeatable\n"
+        "      --source-policy rr|hash   round-robin over sources, or hash of the client address (default rr)\n"
+        "  -p, --pool-dest HOST:PORT     keep warm upstream connections to HOST:PORT, repeatable\n"
+        "      --pool-size N             idle connections kept per pooled destination (default 4)\n"
+        "      --pool-idle-timeout SEC   close pooled connections idle longer than SEC (default 30)\n"
+        "  -w, --workers N               event loop threads sharing the listen port (default 1)\n"
+        "      --rebalance-interval SEC  move hot tunnels off the busiest worker every SEC, 0 to disable (default 5)\n"
+        "      --max-sessions N          reject new clients while N sessions are open, per worker (default unlimited)\n"
+        "      --max-handshakes N        ... while N sessions are negotiating or connecting, per worker (default unlimited)\n"
+        "      --max-buffered BYTES      ... while session buffers hold BYTES of memory (default unlimited)\n"
+        "  -u, --upgrade-socket PATH     take over from the process on PATH, then serve upgrades on it (SIGHUP)\n"
+        "      --upgrade-sessions        hand established tunnels to the new process instead of draining them\n"
+        "      --access-log DIR          write one binary record per session to segment files in DIR\n"
+        "      --access-log-segment MB   size of one access log segment (default 64)\n"
+        "      --access-log-segments N   access log segments kept, the oldest is deleted (default 16)\n"
+        "      --metrics ADDR            serve Prometheus metrics on HOST:PORT, or on a unix socket path with a /\n"
+        "      --latency-file PATH       write the latency histograms of session stages to PATH on shutdown\n"
+        "      --admin-socket PATH       take admin commands on a unix socket, try: echo help | nc -U PATH\n"
+        "  -h, --help                    show this message\n",
+        prog);
+}
+
+bool Socks5Config::ParseAddress(const std::string& str, struct sockaddr_in& addr)
+{
+    size_t colon = str.rfind(':');
+    if(colon == std::string::npos || colon + 1 == str.size())
+    {
+        return false;
+    }
+    std::string host = str.substr(0, colon);
+    std::string port = str.substr(colon + 1);
+
+    struct addrinfo hints;
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_INET;
+    hints.ai_socktype = SOCK_STREAM;
+    hints.ai_flags = AI_PASSIVE;
+
+    struct addrinfo* res = nullptr;
+    if(getaddrinfo(host.empty() ? nullptr : host.c_str(), port.c_str(), &hints, &res) != 0 || res == nullptr)
+    {
+        return false;
+    }
+    memcpy(&addr, res->ai_addr, sizeof(addr));
+    freeaddrinfo(res);
+    return true;
+}
+
+bool Socks5Config::ParseArgs(int argc, char* argv[])
+{
+    enum
+    {
+        kOptPoolSize = 256,
+        kOptSourcePolicy,
+        kOptHandshakeTimeout,
+        kOptPoolIdleTimeout,
+        kOptUpgradeSessions,
+        kOptMaxSessions,
+        kOptMaxHandshakes,
+        kOptMaxBuffered,
+        kOptRebalanceInterval,
+        kOptTraceSample,
+        kOptPerfSample,
+        kOptStallThreshold,
+        kOptNoFlightRecorder,
+        kOptAccessLog,
+        kOptAccessLogSegment,
+        kOptAccessLogSegments,
+        kOptMetrics,
+        kOptLatencyFile,
+        kOptAdminSocket,
+    };
+
+    static const struct option options[] = {
+        {"listen", required_argument, nullptr, 'l'},
+        {"stats-interval", required_argument, nullptr, 's'},
+        {"trace-sample", required_argument, nullptr, kOptTraceSample},
+        {"perf-sample", required_argument, nullptr, kOptPerfSample},
+        {"stall-threshold", required_argument, nullptr, kOptStallThreshold},
+        {"no-flight-recorder", no_argument, nullptr, kOptNoFlightRecorder},
+        {"handshake-timeout", required_argument, nullptr, kOptHandshakeTimeout},
+        {"connect-timeout", required_argument, nullptr, 'c'},
+        {"idle-timeout", required_argument, nullptr, 'i'},
+        {"optimistic-reply", no_argument, nullptr, 'o'},
+        {"tfo", no_argument, nullptr, 'f'},
+        {"source", required_argument, nullptr, 'b'},
+        {"source-policy", required_argument, nullptr, kOptSourcePolicy},
+        {"pool-dest", required_argument, nullptr, 'p'},
+        {"pool-size", required_argument, nullptr, kOptPoolSize},
+        {"pool-idle-timeout", required_argument, nullptr, kOptPoolIdleTimeout},
+        {"workers", required_argument, nullptr, 'w'},
+        {"rebalance-interval", required_argument, nullptr, kOptRebalanceInterval},
+        {"max-sessions", required_argument, nullptr, kOptMaxSessions},
+        {"max-handshakes", required_argument, nullptr, kOptMaxHandshakes},
+        {"max-buffered", required_argument, nullptr, kOptMaxBuffered},
+        {"upgrade-socket", required_argument, nullptr, 'u'},
+        {"upgrade-sessions", no_argument, nullptr, kOptUpgradeSessions},
+        {"access-log", required_argument, nullptr, kOptAccessLog},
+        {"access-log-segment", required_argument, nullptr, kOptAccessLogSegment},
+        {"access-log-segments", required_argument, nullptr, kOptAccessLogSegments},
+        {"metrics", required_argument, nullptr, kOptMetrics},
+        {"latency-file", required_argument, nullptr, kOptLatencyFile},
+        {"admin-socket", required_argument, nullptr, kOptAdminSocket},
+        {"help", no_argument, nullptr, 'h'},
+        {nullptr, 0, nullptr, 0},
+    };
+
+    argv_.assign(argv, argv + argc);
+
+    int opt;
+    while((opt = getopt_long(argc, argv, "l:s:c:i:ofb:p:w:u:h", options, nullptr)) != -1)
+    {
+        struct sockaddr_in addr;
+        switch(opt)
+        {
+            case 'l':
+                if(!ParseAddress(optarg, listen_addr_))
+                {
+                    fprintf(stderr, "Invalid listen address: %s\n", optarg);
+                    return false;
+                }
+                break;
+            case 's':
+                stats_interval_ = atof(optarg);
+                break;
+            case kOptTraceSample:
+                trace_sample_ = strtoul(optarg, nullptr, 10);
+                break;
+            case kOptPerfSample:
+                perf_sample_ = strtoul(optarg, nullptr, 10);
+                break;
+            case kOptStallThreshold:
+                stall_threshold_ms_ = strtoul(optarg, nullptr, 10);
+                break;
+            case kOptNoFlightRecorder:
+                flight_recorder_ = false;
+                break;
+            case kOptHandshakeTimeout:
+                handshake_timeout_ = atof(optarg);
+                break;
+            case 'c':
+                connect_timeout_ = atof(optarg);
+                break;
+            case 'i':
+                idle_timeout_ = atof(optarg);
+                break;
+            case 'o':
+                optimistic_reply_ = true;
+                break;
+            case 'f':
+                tcp_fastopen_ = true;
+                break;
+            case 'b':
+            {
+                struct in_addr in;
+                if(inet_pton(AF_INET, optarg, &in) != 1)
+                {
+                    fprintf(stderr, "Invalid source address: %s\n", optarg);
+                    return false;
+                }
+                source_addrs_.push_back(in);
+                break;
+            }
+            case kOptSourcePolicy:
+                if(strcmp(optarg, "rr") == 0)
+                {
+                    source_policy_ = SourceAddressPool::kRoundRobin;
+                }
+                else if(strcmp(optarg, "hash") == 0)
+                {
+                    source_policy_ = SourceAddressPool::kHash;
+                }
+                else
+                {
+                    fprintf(stderr, "Invalid source policy: %s\n", optarg);
+                    return false;
+                }
+                break;
+            case 'p':
+                if(!ParseAddress(optarg, addr))
+                {
+                    fprintf(stderr, "Invalid pool destination: %s\n", optarg);
+                    return false;
+                }
+                upstream_pool_dests_.push_back(addr);
+                break;
+            case kOptPoolSize:
+                upstream_pool_size_ = strtoul(optarg, nullptr, 10);
+                break;
+            case kOptPoolIdleTimeout:
+                upstream_pool_idle_timeout_ = atof(optarg);
+                break;
+            case 'w':
+                workers_ = strtoul(optarg, nullptr, 10);
+                if(workers_ == 0)
+                {
+                    fprintf(stderr, "Invalid worker count: %s\n", optarg);
+                    return false;
+                }
+                break;
+            case kOptRebalanceInterval:
+                rebalance_interval_ = atof(optarg);
+                break;
+            case kOptMaxSessions:
+                max_sessions_ = strtoul(optarg, nullptr, 10);
+                break;
+            case kOptMaxHandshakes:
+                max_handshakes_ = strtoul(optarg, nullptr, 10);
+                break;
+            case kOptMaxBuffered:
+                max_buffered_ = strtoull(optarg, nullptr, 10);
+                break;
+            case 'u':
+                upgrade_path_ = optarg;
+                break;
+            case kOptUpgradeSessions:
+                upgrade_sessions_ = true;
+                break;
+            case kOptAccessLog:
+                access_log_dir_ = optarg;
+                break;
+            case kOptAccessLogSegment:
+                access_log_segment_size_ = strtoul(optarg, nullptr, 10) << 20;
+                if(access_log_segment_size_ == 0)
+                {
+                    fprintf(stderr, "Invalid access log segment size: %s\n", optarg);
+                    return false;
+                }
+                break;
+            case kOptAccessLogSegments:
+                access_log_segments_ = strtoul(optarg, nullptr, 10);
+                if(access_log_segments_ == 0)
+                {
+                    fprintf(stderr, "Invalid access log segment count: %s\n", optarg);
+                    return false;
+                }
+                break;
+            case kOptMetrics:
+            {
+                struct sockaddr_in addr;
+                metrics_listen_ = optarg;
+                if(metrics_listen_.find('/') == std::string::npos && !ParseAddress(metrics_listen_, addr))
+                {
+                    fprintf(stderr, "Invalid metrics address: %s\n", optarg);
+                    return false;
+                }
+                break;
+            }
+            case kOptLatencyFile:
+                latency_file_ = optarg;
+                break;
+            case kOptAdminSocket:
+                admin_socket_ = optarg;
+                break;
+            case 'h':
+            default:
+                Usage(argv[0]);
+                return false;
+        }
+    }
+    if(workers_ > 1 && !upgrade_path_.empty())
+    {
+        // Each worker would have to hand over its own tunnels and listen socket
+        fprintf(stderr, "Hot upgrades are not supported with more than one worker\n");
+        return false;
+    }
+    return true;
+}
@@ -0,0 +1,94 @@
+#pragma once
+
+#include <cstdint>
+#include <string>
+#include <vector>
+#include <netinet/in.h>
+#include "SourceAddressPool.h"
+
+struct Socks5Config
+{
+    Socks5Config();
+
+    bool ParseArgs(int argc, char* argv[]);
+    static void Usage(const char* prog);
+    static bool ParseAddress(const std::string& str, struct sockaddr_in& addr);
+
+    struct sockaddr_in listen_addr_;
+
+    // Seconds between two stats reports, 0 disables reporting
+    double stats_interval_;
+    // Every Nth session logs its TRACE and DEBUG detail, 0 traces none
+    size_t trace_sample_;
+    // Every Nth session reads the hardware counters around its callbacks,
+    // 0 samples none
+    size_t perf_sample_;
+    // Loop iterations and callbacks running this long are logged, 0 turns
+    // the watchdog off
+    uint32_t stall_threshold_ms_;
+    // Sessions keep their last events in memory, logged on fatal errors
+    // and SIGUSR2
+    bool flight_recorder_;
+
+    // Session deadlines in seconds, 0 disables the handshake and idle ones
+    double handshake_timeout_;
+    // ... for a single upstream connect attempt
+    double connect_timeout_;
+    double idle_timeout_;
+
+    // Answer CONNECT with success before the upstream connect completes,
+    // so the client sends its first bytes one round trip earlier
+    bool optimistic_reply_;
+
+    // TCP Fast Open on the listening socket and for upstream connects
+    bool tcp_fastopen_;
+
+    // Local addresses upstream connects are spread over, empty lets the
+    // kernel pick the source address
+    std::vector<struct in_addr> source_addrs_;
+    SourceAddressPool::Policy source_policy_;
+
+    // Warm pool of pre-connected upstream sockets for hot destinations
+    std::vector<struct sockaddr_in> upstream_pool_dests_;
+    size_t upstream_pool_size_;
+    double upstream_pool_idle_timeout_;
+
+    // Event loops, one thread each, sharing the listen port
+    size_t workers_;
+    // Seconds between two rebalancing rounds moving hot tunnels from the
+    // busiest worker to the idlest, 0 disables it
+    double rebalance_interval_;
+
+    // Admission limits, 0 means unlimited. Connections over a limit get an
+    // immediate general-failure reply instead of a session. The session and
+    // handshake limits apply to each worker loop
+    size_t max_sessions_;
+    // ... counting only sessions still negotiating or connecting
+    size_t max_handshakes_;
+    // ... on the memory held by all session buffers together
+    size_t max_buffered_;
+
+    // Unix socket a newer process takes the listening socket over through,
+    // empty disables hot upgrades
+    std::string upgrade_path_;
+    // ... along with the established tunnels, instead of draining them here
+    bool upgrade_sessions_;
+
+    // Directory of the binary per-session access log, empty disables it
+    std::string access_log_dir_;
+    // ... bytes per segment file, and segments kept before the oldest goes
+    size_t access_log_segment_size_;
+    size_t access_log_segments_;
+
+    // HOST:PORT, or a unix socket path, serving Prometheus metrics. Empty
+    // disables the listener, the counters are kept regardless
+    std::string metrics_listen_;
+    // Where the latency histograms of all workers are written on shutdown,
+    // empty for nowhere
+    std::string latency_file_;
+    // Unix socket taking admin commands, empty disables it
+    std::string admin_socket_;
+
+    // Command line, started again on SIGHUP for an upgrade
+    std::vector<std::string> argv_;
+};
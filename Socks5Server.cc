@@ -1,65 +1,871 @@
 #include <iostream>
 #include <functional>
+#include <algorithm>
 #include <cassert>
+#include <cstring>
+#include <sstream>
+#include <csignal>
+#include <ctime>
+#include <malloc.h>
 #include <unistd.h>
 #include <fcntl.h>
 #include <sys/types.h>
 #include <sys/socket.h>
 #include <netinet/in.h>
+#include <netinet/tcp.h>
 #include <arpa/inet.h>
 #include <ev++.h>
-#include "easylogging++.h"
+#include "AsyncLog.h"
 
 #include "Socks5Server.h"
 #include "Socks5Session.h"
 
 
-Socks5Server::Socks5Server()
-{
-    listen_fd_ = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
-
-    int enabled = 1;
-    setsockopt(listen_fd_, SOL_SOCKET, SO_REUSEADDR, &enabled, sizeof(int));
+const ev::tstamp Socks5Server::kAcceptBackoff = 0.1;
+const ev::tstamp Socks5Server::kRejectLinger = 1.0;
+const ev::tstamp Socks5Server::kLoadInterval = 1.0;
+const ev::tstamp Socks5Server::kTrimDelay = 1.0;
 
-    listen_addr_.sin_family = AF_INET;
-    listen_addr_.sin_port = htons(9981);
-    listen_addr_.sin_addr.s_addr = INADDR_ANY;
+static double ThreadCpuTime()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
 
+Socks5Server::Socks5Server(const Socks5Config& config, struct ev_loop* loop, int worker) :
+    config_(config),
+    worker_(worker),
+    loop_(loop),
+    timer_wheel_(loop),
+    admin_inbox_(kAdminQueueLen),
+    migrate_to_(-1),
+    stopping_(false),
+    dump_requested_(false),
+    migrate_fraction_(0),
+    cpu_load_(0),
+    byte_rate_(0),
+    session_count_(0),
+    last_cpu_time_(0),
+    last_bytes_relayed_(0),
+    released_bytes_(0),
+    trace_counter_(0),
+    perf_counter_(0),
+    listen_fd_(-1),
+    upgrade_(config.upgrade_path_),
+    draining_(false),
+    listen_addr_(config.listen_addr_),
+    upstream_pool_(loop, config.upstream_pool_size_, config.upstream_pool_idle_timeout_, metrics_),
+    source_pool_(config.source_addrs_, config.source_policy_),
+    metrics_exporter_(loop),
+    admin_(loop),
+    io_(loop),
+    stats_timer_(loop),
+    wakeup_check_(loop),
+    lag_prepare_(loop),
+    iteration_start_us_(0),
+    ready_check_(loop),
+    ready_idle_(loop),
+    flush_prepare_(loop),
+    accept_backoff_timer_(loop),
+    linger_timer_(loop),
+    trim_timer_(loop),
+    upgrade_io_(loop),
+    upgrade_signal_(loop),
+    dump_signal_(loop),
+    term_signal_(loop),
+    interrupt_signal_(loop),
+    migrate_async_(loop),
+    load_timer_(loop)
+{
+    wakeup_check_.set<Socks5Server, &Socks5Server::OnWakeupCheck>(this);
+    // First after epoll_wait, last before it
+    ev_set_priority(static_cast<ev_check*>(&wakeup_check_), EV_MAXPRI);
+    wakeup_check_.start();
+    lag_prepare_.set<Socks5Server, &Socks5Server::OnLagPrepare>(this);
+    ev_set_priority(static_cast<ev_prepare*>(&lag_prepare_), EV_MINPRI);
+    lag_prepare_.start();
+    accept_backoff_timer_.set<Socks5Server, &Socks5Server::OnAcceptBackoff>(this);
+    linger_timer_.set<Socks5Server, &Socks5Server::OnLingerTimer>(this);
+    trim_timer_.set<Socks5Server, &Socks5Server::OnTrimTimer>(this);
+    ready_check_.set<Socks5Server, &Socks5Server::OnReadyCheck>(this);
+    ready_idle_.set<Socks5Server, &Socks5Server::OnReadyIdle>(this);
+    flush_prepare_.set<Socks5Server, &Socks5Server::OnFlushPrepare>(this);
 
-    bind(listen_fd_, (struct sockaddr*)&listen_addr_, sizeof(listen_addr_));
-    listen(listen_fd_, 1024);
+    std::vector<Socks5HandoffRecord> handoff;
+    if(!config_.upgrade_path_.empty())
+    {
+        listen_fd_ = upgrade_.TakeOver(handoff);
+    }
+    if(listen_fd_ == -1)
+    {
+        CreateListenSocket();
+    }
 
     io_.set<Socks5Server, &Socks5Server::OnConnectRequest>(this);
     io_.start(listen_fd_, ev::READ);
+
+    // Worker 0's sessions, on the thread it runs on
+    StreamBuffer::AccountTo(&metrics_);
+    for(auto& record : handoff)
+    {
+        AddSession(record.peer_fd_, session_pool_.Create(*this, record));
+    }
+
+    int upgrade_fd = config_.upgrade_path_.empty() ? -1 : upgrade_.Listen();
+    if(upgrade_fd != -1)
+    {
+        upgrade_io_.set<Socks5Server, &Socks5Server::OnUpgradeRequest>(this);
+        upgrade_io_.start(upgrade_fd, ev::READ);
+        upgrade_signal_.set<Socks5Server, &Socks5Server::OnUpgradeSignal>(this);
+        upgrade_signal_.start(SIGHUP);
+    }
+
+    for(auto& addr : config_.upstream_pool_dests_)
+    {
+        upstream_pool_.AddDestination(addr);
+    }
+
+    if(config_.stats_interval_ > 0)
+    {
+        stats_timer_.set<Socks5Server, &Socks5Server::OnStatsTimer>(this);
+        stats_timer_.start(config_.stats_interval_, config_.stats_interval_);
+    }
+
+    // Signals can only be watched on the default loop, worker 0's
+    if(worker_ == 0 && config_.flight_recorder_)
+    {
+        dump_signal_.set<Socks5Server, &Socks5Server::OnDumpSignal>(this);
+        dump_signal_.start(SIGUSR2);
+    }
+    if(worker_ == 0)
+    {
+        term_signal_.set<Socks5Server, &Socks5Server::OnStopSignal>(this);
+        term_signal_.start(SIGTERM);
+        interrupt_signal_.set<Socks5Server, &Socks5Server::OnStopSignal>(this);
+        interrupt_signal_.start(SIGINT);
+    }
+
+    if(config_.workers_ > 1)
+    {
+        for(size_t i = 0; i < config_.workers_; i++)
+        {
+            inbox_.emplace_back(new SpscQueue<Socks5HandoffRecord>(kMigrateQueueLen));
+        }
+        migrate_async_.set<Socks5Server, &Socks5Server::OnMigrateAsync>(this);
+        migrate_async_.start();
+        load_timer_.set<Socks5Server, &Socks5Server::OnLoadTimer>(this);
+        load_timer_.start(kLoadInterval, kLoadInterval);
+    }
 }
 
 Socks5Server::~Socks5Server()
 {
-    close(listen_fd_);
+    // Torn down on the main thread once every loop stopped
+    StreamBuffer::AccountTo(&metrics_);
+    for(auto session : sessions_)
+    {
+        if(session != nullptr)
+        {
+            session_pool_.Destroy(session);
+        }
+    }
+    for(auto& lingering : lingering_)
+    {
+        close(lingering.second);
+    }
+    if(listen_fd_ != -1)
+    {
+        close(listen_fd_);
+    }
+}
+
+void Socks5Server::CreateListenSocket()
+{
+    listen_fd_ = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
+
+    int enabled = 1;
+    setsockopt(listen_fd_, SOL_SOCKET, SO_REUSEADDR, &enabled, sizeof(int));
+    if(config_.workers_ > 1)
+    {
+        // Every worker listens on its own socket, the kernel spreads new
+        // connections over them
+        setsockopt(listen_fd_, SOL_SOCKET, SO_REUSEPORT, &enabled, sizeof(int));
+    }
+
+
+    bind(listen_fd_, (struct sockaddr*)&listen_addr_, sizeof(listen_addr_));
+
+    if(config_.tcp_fastopen_)
+    {
+        int qlen = kFastOpenQueueLen;
+        if(setsockopt(listen_fd_, IPPROTO_TCP, TCP_FASTOPEN, &qlen, sizeof(qlen)) == -1)
+        {
+            LOG(INFO) << "TCP_FASTOPEN on listen socket failed, error=" << strerror(errno);
+        }
+    }
+    listen(listen_fd_, 1024);
 }
 
 void Socks5Server::Run()
 {
-    LOG(INFO) << "Socks5Server Started...";
+    LOG(INFO) << "Socks5Server Started, worker " << worker_ << "...";
     LOG(INFO) << "Listen on " << inet_ntoa(listen_addr_.sin_addr) << ":" << ntohs(listen_addr_.sin_port);
+    last_cpu_time_ = ThreadCpuTime();
+    // The counters follow the thread that opens them
+    if(config_.perf_sample_ > 0 && !perf_.Open())
+    {
+        LOG(INFO) << "Worker " << worker_ << ": no hardware counters, --perf-sample off";
+        config_.perf_sample_ = 0;
+    }
+    StreamBuffer::AccountTo(&metrics_);
     loop_.run();
 }
 
+void Socks5Server::SetPeers(const std::vector<Socks5Server*>& peers)
+{
+    peers_ = peers;
+    if(worker_ == 0 && !config_.metrics_listen_.empty() && metrics_exporter_.Listen(config_.metrics_listen_))
+    {
+        for(Socks5Server* peer : peers_)
+        {
+            metrics_exporter_.AddSource(&peer->metrics_);
+        }
+    }
+    if(worker_ == 0 && !config_.admin_socket_.empty() && admin_.Listen(config_.admin_socket_))
+    {
+        admin_.SetWorkers(peers_);
+    }
+}
+
+void Socks5Server::RequestMigration(int target, double fraction)
+{
+    migrate_fraction_.store(fraction, std::memory_order_relaxed);
+    migrate_to_.store(target, std::memory_order_release);
+    migrate_async_.send();
+}
+
+void Socks5Server::Stop()
+{
+    stopping_.store(true, std::memory_order_release);
+    migrate_async_.send();
+}
+
+void Socks5Server::RequestDump()
+{
+    dump_requested_.store(true, std::memory_order_release);
+    migrate_async_.send();
+}
+
+void Socks5Server::OnDumpSignal()
+{
+    DumpFlightRecorders("SIGUSR2");
+    for(Socks5Server* peer : peers_)
+    {
+        if(peer != this)
+        {
+            peer->RequestDump();
+        }
+    }
+}
+
+void Socks5Server::RequestAdminJob(const std::shared_ptr<AdminJob>& job)
+{
+    if(!admin_inbox_.Push(job))
+    {
+        job->Done(worker_, "worker " + std::to_string(worker_) + " busy\n");
+        return;
+    }
+    migrate_async_.send();
+}
+
+void Socks5Server::RunAdminJob(AdminJob& job)
+{
+    std::ostringstream out;
+    switch(job.type_)
+    {
+        case AdminJob::kList:
+        {
+            uint64_t now = Histogram::Now();
+            for(auto session : sessions_)
+            {
+                if(session != nullptr)
+                {
+                    session->Describe(out, now);
+                    out << "\n";
+                }
+            }
+            break;
+        }
+        case AdminJob::kKill:
+            if((size_t)job.fd_ < sessions_.size() && sessions_[job.fd_] != nullptr)
+            {
+                sessions_[job.fd_]->Kill();
+                out << "killed " << worker_ << ":" << job.fd_ << "\n";
+            }
+            else
+            {
+                out << "no session " << worker_ << ":" << job.fd_ << "\n";
+            }
+            break;
+        case AdminJob::kKillDestination:
+        {
+            // Kill() only queues the session for destruction, sessions_
+            // stays as it is while we walk it
+            size_t killed = 0;
+            for(auto session : sessions_)
+            {
+                if(session != nullptr && session->MatchesDestination(job.destination_))
+                {
+                    session->Kill();
+                    killed ++;
+                }
+            }
+            out << "worker " << worker_ << " killed " << killed << "\n";
+            break;
+        }
+        case AdminJob::kTraceSample:
+            config_.trace_sample_ = job.sample_;
+            trace_counter_ = 0;
+            out << "worker " << worker_ << " trace-sample " << job.sample_ << "\n";
+            break;
+    }
+    job.Done(worker_, out.str());
+}
+
+void Socks5Server::DumpFlightRecorders(const char* why)
+{
+    LOG(WARNING) << "Worker " << worker_ << " dumping flight recorders of " << session_pool_.Size() << " sessions";
+    for(auto session : sessions_)
+    {
+        if(session != nullptr)
+        {
+            session->DumpFlightRecorder(why);
+        }
+    }
+}
+
+void Socks5Server::OnMigrateAsync()
+{
+    activity_.Mark(LoopActivity::kAsync);
+    if(stopping_.load(std::memory_order_acquire))
+    {
+        loop_.break_loop(ev::ALL);
+        return;
+    }
+    if(dump_requested_.exchange(false, std::memory_order_acquire))
+    {
+        DumpFlightRecorders("SIGUSR2");
+    }
+    int target = migrate_to_.exchange(-1, std::memory_order_acquire);
+    if(target >= 0 && (size_t)target < peers_.size() && target != worker_)
+    {
+        MigrateTo(*peers_[target], migrate_fraction_.load(std::memory_order_relaxed));
+    }
+
+    std::shared_ptr<AdminJob> job;
+    while(admin_inbox_.Pop(job))
+    {
+        RunAdminJob(*job);
+        job.reset();
+    }
+
+    Socks5HandoffRecord record;
+    for(auto& queue : inbox_)
+    {
+        while(queue->Pop(record))
+        {
+            AddSession(record.peer_fd_, session_pool_.Create(*this, record));
+            stats_.migrated_in_ ++;
+        }
+    }
+}
+
+void Socks5Server::MigrateTo(Socks5Server& target, double fraction)
+{
+    // Heat is what each tunnel read since the last round on this worker,
+    // or since it arrived here
+    std::vector<std::pair<uint64_t, int>> candidates;
+    uint64_t total = 0;
+    for(size_t peerfd = 0; peerfd < sessions_.size(); peerfd++)
+    {
+        if(sessions_[peerfd] != nullptr)
+        {
+            uint64_t bytes = sessions_[peerfd]->BytesRelayed();
+            uint64_t relayed = bytes - relayed_marks_[peerfd];
+            relayed_marks_[peerfd] = bytes;
+            total += relayed;
+            if(relayed > 0)
+            {
+                candidates.emplace_back(relayed, peerfd);
+            }
+        }
+    }
+    std::sort(candidates.begin(), candidates.end(), std::greater<std::pair<uint64_t, int>>());
+
+    SpscQueue<Socks5HandoffRecord>& queue = *target.inbox_[worker_];
+    uint64_t remaining = total * fraction;
+    size_t moved = 0;
+    for(auto& candidate : candidates)
+    {
+        if(remaining == 0 || queue.Full())
+        {
+            break;
+        }
+        // A tunnel well over the remaining share would only move the
+        // imbalance to the other side
+        if(candidate.first > remaining * 3 / 2)
+        {
+            continue;
+        }
+        Socks5HandoffRecord record;
+        if(!sessions_[candidate.second]->Detach(record))
+        {
+            continue;
+        }
+        // Not on the stack of any of its callbacks, destroyed right away
+        // so the fd slot is free before the target can close the fd
+        OnSessionDestroy(candidate.second);
+        record.access_.flags_ |= AccessLog::kFlagMigrated;
+        queue.Push(std::move(record));
+        remaining -= std::min(remaining, candidate.first);
+        moved ++;
+    }
+    stats_.migrated_out_ += moved;
+    if(moved > 0)
+    {
+        target.migrate_async_.send();
+    }
+    LOG(INFO) << "Worker " << worker_ << " migrated " << moved << " of " << candidates.size()
+              << " active tunnels to worker " << target.worker_;
+}
+
+void Socks5Server::OnLoadTimer()
+{
+    double cpu_time = ThreadCpuTime();
+    cpu_load_.store((cpu_time - last_cpu_time_) / kLoadInterval, std::memory_order_relaxed);
+    uint64_t bytes_relayed = metrics_.Get(Metrics::kBytesUp) + metrics_.Get(Metrics::kBytesDown);
+    byte_rate_.store((bytes_relayed - last_bytes_relayed_) / kLoadInterval, std::memory_order_relaxed);
+    session_count_.store(session_pool_.Size(), std::memory_order_relaxed);
+    last_cpu_time_ = cpu_time;
+    last_bytes_relayed_ = bytes_relayed;
+}
+
 void Socks5Server::OnConnectRequest()
 {
-    std::cout << "New Connection in!" << std::endl;
-    struct sockaddr peer_addr;
+    activity_.Mark(LoopActivity::kAccept);
+    struct sockaddr_in peer_addr;
     socklen_t peer_len = sizeof(peer_addr);
-    int peerfd = accept(listen_fd_, &peer_addr, &peer_len);
-    assert(peerfd > 0);
+    int peerfd = accept4(listen_fd_, (struct sockaddr*)&peer_addr, &peer_len, SOCK_NONBLOCK);
+    metrics_.AddSyscalls(Metrics::kAcceptCall, 1, peerfd == -1 && (errno == EAGAIN || errno == EWOULDBLOCK));
+    if(peerfd == -1)
+    {
+        if(errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR || errno == ECONNABORTED)
+        {
+            return;
+        }
+        // Out of fds or kernel memory. The pending connection keeps the
+        // listener readable, retrying right away would only spin
+        LOG(INFO) << "Accept failed, backing off " << kAcceptBackoff << "s, error=" << strerror(errno);
+        stats_.accept_backoffs_ ++;
+        io_.stop();
+        accept_backoff_timer_.start(kAcceptBackoff);
+        return;
+    }
+
+    const char* limit = OverLimit();
+    if(limit != nullptr)
+    {
+        LOG(INFO) << "Rejecting peerfd=" << peerfd << ", " << limit << " limit reached";
+        Reject(peerfd);
+        return;
+    }
+    metrics_.Add(Metrics::kAccepted);
+    AddSession(peerfd, session_pool_.Create(*this, peerfd, peer_addr));
+}
+
+void Socks5Server::OnAcceptBackoff()
+{
+    if(!draining_)
+    {
+        io_.start();
+    }
+}
+
+int64_t Socks5Server::BufferedBytes()
+{
+    // Each worker counts its own, the limit is on all of them together
+    int64_t total = 0;
+    for(Socks5Server* peer : peers_)
+    {
+        total += peer->metrics_.Buffered();
+    }
+    return total;
+}
+
+const char* Socks5Server::OverLimit()
+{
+    if(config_.max_sessions_ > 0 && session_pool_.Size() >= config_.max_sessions_)
+    {
+        return "session";
+    }
+    if(config_.max_handshakes_ > 0 && handshake_pool_.Size() >= config_.max_handshakes_)
+    {
+        return "handshake";
+    }
+    if(config_.max_buffered_ > 0 && BufferedBytes() >= (int64_t)config_.max_buffered_)
+    {
+        return "buffer";
+    }
+    return nullptr;
+}
+
+void Socks5Server::Reject(int peerfd)
+{
+    // Greeting answered with no authentication, immediately followed by
+    // a general-failure reply to the request the client is about to send.
+    // The client fails fast instead of timing out, at the cost of one
+    // write and an fd held for the linger time, but no session
+    static const uint8_t kRejectReply[] = {
+        0x05, 0x00,
+        0x05, Socks5ReplyField::kGeneralFailure, 0x00, Socks5AddressingMode::kIpv4, 0, 0, 0, 0, 0, 0,
+    };
+    metrics_.Add(Metrics::kRejected);
+    send(peerfd, kRejectReply, sizeof(kRejectReply), MSG_DONTWAIT | MSG_NOSIGNAL);
+    metrics_.AddSyscalls(Metrics::kSendCall, 1);
+    // Closing now would reset the connection under the request the client
+    // still sends, before it got to read the reply
+    shutdown(peerfd, SHUT_WR);
+    if(lingering_.size() >= kMaxLingering)
+    {
+        close(lingering_.front().second);
+        lingering_.pop_front();
+    }
+    lingering_.emplace_back(ev::now(loop_) + kRejectLinger, peerfd);
+    if(!linger_timer_.is_active())
+    {
+        linger_timer_.start(kRejectLinger);
+    }
+}
 
-    int ret = fcntl(peerfd, F_SETFL, (fcntl(peerfd, F_GETFL) | O_NONBLOCK));
-    assert(ret == 0);
-    std::shared_ptr<Socks5Session> session = std::make_shared<Socks5Session>(*this, peerfd);
+void Socks5Server::OnLingerTimer()
+{
+    ev::tstamp now = ev::now(loop_);
+    while(!lingering_.empty() && lingering_.front().first <= now)
+    {
+        close(lingering_.front().second);
+        lingering_.pop_front();
+    }
+    if(!lingering_.empty())
+    {
+        linger_timer_.start(lingering_.front().first - now);
+    }
+}
+
+void Socks5Server::OnBuffersReleased(size_t bytes)
+{
+    released_bytes_ += bytes;
+    if(released_bytes_ >= kTrimThreshold && !trim_timer_.is_active())
+    {
+        trim_timer_.start(kTrimDelay);
+    }
+}
+
+void Socks5Server::OnTrimTimer()
+{
+    // Freed buffers sit between live allocations, where free() keeps their
+    // pages resident. This walks the whole heap, hence the batching
+    LOG(INFO) << "Worker " << worker_ << " trimming the heap after " << released_bytes_ << "B freed";
+    released_bytes_ = 0;
+    malloc_trim(0);
+}
+
+void Socks5Server::AddSession(int peerfd, Socks5Session* session)
+{
+    if((size_t)peerfd >= sessions_.size())
+    {
+        sessions_.resize(std::max((size_t)peerfd + 1, sessions_.size() * 2), nullptr);
+        relayed_marks_.resize(sessions_.size(), 0);
+    }
     sessions_[peerfd] = session;
+    relayed_marks_[peerfd] = session->BytesRelayed();
 }
 
 void Socks5Server::OnSessionDestroy(int peerfd)
 {
-    sessions_.erase(peerfd);
+    if((size_t)peerfd >= sessions_.size() || sessions_[peerfd] == nullptr)
+    {
+        return;
+    }
+    session_pool_.Destroy(sessions_[peerfd]);
+    sessions_[peerfd] = nullptr;
+}
+
+void Socks5Server::DeferDestroy(int peerfd)
+{
+    closed_sessions_.push_back(peerfd);
+    if(!flush_prepare_.is_active())
+    {
+        flush_prepare_.start();
+    }
+}
+
+void Socks5Server::OnWakeupCheck()
+{
+    metrics_.Add(Metrics::kWakeups);
+    iteration_start_us_ = Histogram::Now();
+    activity_.Mark(LoopActivity::kLoop);
+}
+
+void Socks5Server::OnLagPrepare()
+{
+    activity_.Mark(LoopActivity::kIdle);
+    if(iteration_start_us_ == 0)
+    {
+        return;
+    }
+    uint64_t lag = Histogram::Now() - iteration_start_us_;
+    metrics_.AddLoopLag(lag);
+    if(config_.stall_threshold_ms_ > 0 && lag >= config_.stall_threshold_ms_ * 1000ull)
+    {
+        // The watchdog has named the callback by now, unless the time was
+        // spread over many
+        LOG(WARNING) << "Worker " << worker_ << " loop iteration took " << lag / 1000 << "ms";
+    }
+}
+
+void Socks5Server::Reap()
+{
+    activity_.Mark(LoopActivity::kReap);
+    for(int peerfd : closed_sessions_)
+    {
+        OnSessionDestroy(peerfd);
+        stats_.sessions_reaped_ ++;
+    }
+    closed_sessions_.clear();
+    CheckDrained();
+}
+
+void Socks5Server::ScheduleResume(Socks5Session* session)
+{
+    ready_sessions_.push_back(session_pool_.HandleOf(session));
+    if(!ready_check_.is_active())
+    {
+        ready_check_.start();
+        ready_idle_.start();
+    }
+}
+
+void Socks5Server::OnReadyCheck()
+{
+    // Sessions yielding again while resumed queue up for the next iteration,
+    // after the callbacks that became ready in between
+    resuming_sessions_.swap(ready_sessions_);
+    for(auto handle : resuming_sessions_)
+    {
+        Socks5Session* session = session_pool_.Get(handle);
+        if(session != nullptr)
+        {
+            session->OnResume();
+        }
+    }
+    resuming_sessions_.clear();
+    if(ready_sessions_.empty())
+    {
+        ready_check_.stop();
+        ready_idle_.stop();
+    }
+}
+
+void Socks5Server::OnReadyIdle()
+{
+}
+
+void Socks5Server::ScheduleFlush(Socks5Session* session)
+{
+    dirty_sessions_.push_back(session_pool_.HandleOf(session));
+    if(!flush_prepare_.is_active())
+    {
+        flush_prepare_.start();
+    }
+}
+
+void Socks5Server::OnFlushPrepare()
+{
+    // Prepare watchers run right before the loop blocks, once every
+    // callback of this iteration has returned, resumed sessions included.
+    // Each session has appended what it had and now writes once per
+    // direction
+    flushing_sessions_.swap(dirty_sessions_);
+    for(auto handle : flushing_sessions_)
+    {
+        Socks5Session* session = session_pool_.Get(handle);
+        if(session != nullptr)
+        {
+            session->Flush();
+        }
+    }
+    flushing_sessions_.clear();
+    // No session on the list is on the stack anymore, those a failed write
+    // just closed included
+    if(!closed_sessions_.empty())
+    {
+        Reap();
+    }
+    if(dirty_sessions_.empty())
+    {
+        flush_prepare_.stop();
+    }
+}
+
+void Socks5Server::OnUpgradeSignal()
+{
+    LOG(INFO) << "Upgrade requested, starting " << config_.argv_[0];
+    upgrade_.Exec(config_.argv_);
+}
+
+void Socks5Server::OnUpgradeRequest()
+{
+    int fd = upgrade_.Accept();
+    if(fd == -1)
+    {
+        return;
+    }
+    // Both processes accept from the shared queue until we stop below, no
+    // connection waiting in it is lost
+    if(!HotUpgrade::SendListenFd(fd, listen_fd_))
+    {
+        LOG(INFO) << "Upgrade handoff failed, error=" << strerror(errno);
+        close(fd);
+        return;
+    }
+    size_t handed = 0;
+    if(config_.upgrade_sessions_)
+    {
+        for(size_t peerfd = 0; peerfd < sessions_.size(); peerfd++)
+        {
+            Socks5HandoffRecord record;
+            if(sessions_[peerfd] == nullptr || !sessions_[peerfd]->Detach(record))
+            {
+                continue;
+            }
+            OnSessionDestroy(peerfd);
+            record.access_.flags_ |= AccessLog::kFlagUpgraded;
+            if(!HotUpgrade::SendSession(fd, record))
+            {
+                // The new process drops fds that came without their
+                // session, ours still carry the tunnel. It stays here to
+                // drain, and so do all the ones not sent yet
+                LOG(INFO) << "Upgrade handoff of peerfd=" << record.peer_fd_ << " failed, error=" << strerror(errno)
+                          << ", keeping the remaining tunnels";
+                record.access_.flags_ &= ~AccessLog::kFlagUpgraded;
+                AddSession(record.peer_fd_, session_pool_.Create(*this, record));
+                break;
+            }
+            handed ++;
+            // Our copies only, the connections live on in the new process
+            close(record.peer_fd_);
+            close(record.remote_fd_);
+        }
+    }
+    HotUpgrade::SendDone(fd);
+    close(fd);
+    // Handshakes in progress stay as well, with any tunnel the handoff failed on
+    LOG(INFO) << "Upgrade handoff done, sessions handed over=" << handed << ", kept to drain=" << session_pool_.Size();
+    upgrade_.HandedOver();
+    StartDraining();
+}
+
+void Socks5Server::OnStopSignal()
+{
+    LOG(INFO) << "Stopping, sessions=" << session_pool_.Size();
+    loop_.break_loop(ev::ALL);
+}
+
+void Socks5Server::StartDraining()
+{
+    draining_ = true;
+    io_.stop();
+    accept_backoff_timer_.stop();
+    close(listen_fd_);
+    listen_fd_ = -1;
+    upgrade_io_.stop();
+    upgrade_signal_.stop();
+    metrics_exporter_.Close();
+    admin_.Close();
+    LOG(INFO) << "Draining, sessions=" << session_pool_.Size();
+    CheckDrained();
+}
+
+void Socks5Server::CheckDrained()
+{
+    if(draining_ && session_pool_.Size() == 0)
+    {
+        LOG(INFO) << "Drained, exiting";
+        loop_.break_loop(ev::ALL);
+    }
+}
+
+void Socks5Server::LogPerf()
+{
+    uint64_t bytes = metrics_.PerfUnits(Metrics::kPerfRelay);
+    uint64_t handshakes = metrics_.PerfUnits(Metrics::kPerfHandshake);
+    auto per = [](uint64_t count, uint64_t units, double scale) { return units > 0 ? count * scale / units : 0; };
+    auto ipc = [](uint64_t instructions, uint64_t cycles) { return cycles > 0 ? (double)instructions / cycles : 0; };
+    LOG(INFO) << "Worker " << worker_ << " perf relay: bytes=" << bytes
+              << ", cycles/byte=" << per(metrics_.Perf(Metrics::kPerfRelay, PerfCounters::kCycles), bytes, 1)
+              << ", IPC=" << ipc(metrics_.Perf(Metrics::kPerfRelay, PerfCounters::kInstructions), metrics_.Perf(Metrics::kPerfRelay, PerfCounters::kCycles))
+              << ", cache misses/KB=" << per(metrics_.Perf(Metrics::kPerfRelay, PerfCounters::kCacheMisses), bytes, 1024)
+              << ", branch misses/KB=" << per(metrics_.Perf(Metrics::kPerfRelay, PerfCounters::kBranchMisses), bytes, 1024);
+    LOG(INFO) << "Worker " << worker_ << " perf handshake: handshakes=" << handshakes
+              << ", cycles/handshake=" << per(metrics_.Perf(Metrics::kPerfHandshake, PerfCounters::kCycles), handshakes, 1)
+              << ", IPC=" << ipc(metrics_.Perf(Metrics::kPerfHandshake, PerfCounters::kInstructions), metrics_.Perf(Metrics::kPerfHandshake, PerfCounters::kCycles))
+              << ", cache misses/handshake=" << per(metrics_.Perf(Metrics::kPerfHandshake, PerfCounters::kCacheMisses), handshakes, 1)
+              << ", branch misses/handshake=" << per(metrics_.Perf(Metrics::kPerfHandshake, PerfCounters::kBranchMisses), handshakes, 1);
+}
+
+void Socks5Server::OnStatsTimer(ev::timer& watcher, int revents)
+{
+    activity_.Mark(LoopActivity::kStats);
+    LOG(INFO) << "Sessions: " << session_pool_.Size() << ", pool capacity=" << session_pool_.Capacity()
+              << ", slabs=" << session_pool_.Slabs() << ", handshaking=" << handshake_pool_.Size()
+              << ", session size=" << sizeof(Socks5Session) << "B, reaped=" << stats_.sessions_reaped_;
+    LOG(INFO) << "Admission: admitted=" << metrics_.Get(Metrics::kAccepted) << ", rejected=" << metrics_.Get(Metrics::kRejected)
+              << ", accept backoffs=" << stats_.accept_backoffs_ << ", buffered=" << BufferedBytes() << "B";
+    LOG(INFO) << "Log records dropped=" << AsyncLog::Dropped();
+    if(AccessLog::Enabled())
+    {
+        LOG(INFO) << "Access log: records=" << AccessLog::Appended() << ", dropped=" << AccessLog::Dropped();
+    }
+    std::ostringstream syscalls;
+    uint64_t eagain = 0;
+    for(uint8_t i = 0; i < Metrics::kSyscallCount; i++)
+    {
+        syscalls << Metrics::SyscallName(i) << "=" << metrics_.Syscalls(i) << ", ";
+        eagain += metrics_.Eagain(i);
+    }
+    uint64_t relayed = metrics_.Get(Metrics::kBytesUp) + metrics_.Get(Metrics::kBytesDown);
+    LOG(INFO) << "Worker " << worker_ << " syscalls: " << syscalls.str() << "eagain=" << eagain
+              << ", wakeups=" << metrics_.Get(Metrics::kWakeups)
+              << ", bytes/syscall=" << Metrics::BytesPerSyscall(relayed, metrics_.TotalSyscalls())
+              << ", wakeups/MB=" << Metrics::WakeupsPerMB(metrics_.Get(Metrics::kWakeups), relayed);
+    if(config_.workers_ > 1)
+    {
+        LOG(INFO) << "Worker " << worker_ << ": relayed up=" << metrics_.Get(Metrics::kBytesUp) << "B, down="
+                  << metrics_.Get(Metrics::kBytesDown) << "B, migrated in="
+                  << stats_.migrated_in_ << ", out=" << stats_.migrated_out_;
+    }
+    if(perf_.IsOpen())
+    {
+        LogPerf();
+    }
+    LOG(INFO) << "Time to first byte (" << (config_.optimistic_reply_ ? "optimistic" : "regular") << " reply): sessions="
+              << stats_.ttfb_count_ << ", avg=" << (stats_.ttfb_count_ ? stats_.ttfb_sum_ * 1000 / stats_.ttfb_count_ : 0) << "ms";
+    if(config_.tcp_fastopen_)
+    {
+        LOG(INFO) << "TCP Fast Open: attempts=" << stats_.tfo_attempts_ << ", accepted=" << stats_.tfo_accepted_
+                  << ", fallbacks=" << stats_.tfo_fallbacks_;
+    }
+    upstream_pool_.LogStats();
+    source_pool_.LogStats();
 }
@@ -1,32 +1,255 @@
+#pragma once
+
+#include <atomic>
 #include <cstdint>
+#include <deque>
 #include <memory>
+#include <vector>
 #include <ev++.h>
-#include <unordered_map>
-#include <unordered_set>
 #include <netinet/in.h>
-
-class Socks5Session;
+#include "Socks5Config.h"
+#include "Socks5Session.h"
+#include "SlabPool.h"
+#include "UpstreamPool.h"
+#include "SourceAddressPool.h"
+#include "TimerWheel.h"
+#include "HotUpgrade.h"
+#include "Metrics.h"
+#include "SpscQueue.h"
+#include "Admin.h"
+#include "Watchdog.h"
 
 class TcpConnection
 {
 };
 
+struct Socks5ServerStats
+{
+    Socks5ServerStats()
+        : tfo_attempts_(0), tfo_accepted_(0), tfo_fallbacks_(0), sessions_reaped_(0), accept_backoffs_(0),
+          migrated_in_(0), migrated_out_(0), ttfb_count_(0), ttfb_sum_(0)
+    {}
+    // Upstream connects that put data in the SYN
+    uint64_t tfo_attempts_;
+    // ... and whose SYN data was acknowledged by the destination
+    uint64_t tfo_accepted_;
+    // ... and fell back to a regular handshake (no cookie yet, or refused)
+    uint64_t tfo_fallbacks_;
+
+    // Sessions torn down and returned to the pool
+    uint64_t sessions_reaped_;
+
+    // accept() failures that paused accepting, mostly fd exhaustion
+    uint64_t accept_backoffs_;
+
+    // Established tunnels moved in from, and out to, other worker loops
+    uint64_t migrated_in_;
+    uint64_t migrated_out_;
+
+    // Time from a parsed CONNECT request to the first upstream byte
+    uint64_t ttfb_count_;
+    double ttfb_sum_;
+};
+
 class Socks5Server
 {
+    static const int kFastOpenQueueLen = 1024;
+    static const ev::tstamp kAcceptBackoff;
+    // How long a rejected client gets to read its reply, and how many may
+    // do so at once before the oldest is closed right away
+    static const ev::tstamp kRejectLinger;
+    static const size_t kMaxLingering = 1024;
+    // Tunnels one worker may have in flight to another
+    static const size_t kMigrateQueueLen = 1024;
+    // Admin commands waiting for this worker, see --admin-socket
+    static const size_t kAdminQueueLen = 16;
+    static const ev::tstamp kLoadInterval;
+    // Idle tunnels free their buffers, once this much was freed the heap
+    // is trimmed so the pages go back to the kernel, batched over a delay
+    static const size_t kTrimThreshold = 16 << 20;
+    static const ev::tstamp kTrimDelay;
 public:
-    Socks5Server();
+    // One per worker loop, worker 0 runs on the default loop
+    Socks5Server(const Socks5Config& config, struct ev_loop* loop, int worker = 0);
     ~Socks5Server();
 
     void Run();
+    // All worker loops by index, set before any of them runs
+    void SetPeers(const std::vector<Socks5Server*>& peers);
+    // Any thread: move about fraction of this worker's traffic to worker target
+    void RequestMigration(int target, double fraction);
+    // Any thread: make Run() return
+    void Stop();
+    // Any thread: log the flight recorder of every session on this worker
+    void RequestDump();
+    void DumpFlightRecorders(const char* why);
+    void OnDumpSignal();
+    // Worker 0's loop: have job run on this worker, answered busy when
+    // too many are queued already
+    void RequestAdminJob(const std::shared_ptr<AdminJob>& job);
+    // Runs job for this worker's sessions and reports to it
+    void RunAdminJob(AdminJob& job);
+    // Last load sample, readable from any thread: share of one core spent
+    // in this loop, bytes relayed per second, open sessions
+    double CpuLoad() const { return cpu_load_.load(std::memory_order_relaxed); }
+    double ByteRate() const { return byte_rate_.load(std::memory_order_relaxed); }
+    size_t SessionCount() const { return session_count_.load(std::memory_order_relaxed); }
+    void OnMigrateAsync();
+    void OnLoadTimer();
     void OnConnectRequest();
+    void OnAcceptBackoff();
+    void OnLingerTimer();
+    // Buffer memory an idle session gave back, see kTrimThreshold
+    void OnBuffersReleased(size_t bytes);
+    void OnTrimTimer();
     void OnSessionDestroy(int peerfd);
+    // Queue a closed session for destruction at the end of this loop iteration
+    void DeferDestroy(int peerfd);
+    void OnWakeupCheck();
+    void OnLagPrepare();
+    // Queue a session that used up its budget to be resumed after this iteration
+    void ScheduleResume(Socks5Session* session);
+    void OnReadyCheck();
+    void OnReadyIdle();
+    // Queue a session with buffered output to be written right before the loop blocks
+    void ScheduleFlush(Socks5Session* session);
+    void OnFlushPrepare();
+    void OnStatsTimer(ev::timer& watcher, int revents);
+    void OnUpgradeSignal();
+    void OnStopSignal();
+    void OnUpgradeRequest();
+
+    const Socks5Config& Config() { return config_; }
+    int Worker() const { return worker_; }
+    ev::loop_ref Loop() { return loop_; }
+    UpstreamPool& GetUpstreamPool() { return upstream_pool_; }
+    SourceAddressPool& GetSourceAddressPool() { return source_pool_; }
+    TimerWheel& GetTimerWheel() { return timer_wheel_; }
+    SlabPool<Socks5HandshakeState>& GetHandshakePool() { return handshake_pool_; }
+    SlabPool<AccessLog::Record>& GetAccessPool() { return access_pool_; }
+    SlabPool<FlightRecorder>& GetFlightPool() { return flight_pool_; }
+    Socks5ServerStats& Stats() { return stats_; }
+    Metrics& GetMetrics() { return metrics_; }
+    // Whether the next session is one of the sampled ones, see --trace-sample
+    bool TraceNext() { return config_.trace_sample_ > 0 && trace_counter_++ % config_.trace_sample_ == 0; }
+    // ... and whether it reads the hardware counters, see --perf-sample
+    bool PerfNext() { return config_.perf_sample_ > 0 && perf_counter_++ % config_.perf_sample_ == 0; }
+    PerfCounters& GetPerfCounters() { return perf_; }
+    // What this loop is running, for the watchdog
+    LoopActivity& Activity() { return activity_; }
+private:
+    void CreateListenSocket();
+    // Heap bytes held by the session buffers of all workers
+    int64_t BufferedBytes();
+    // Which admission limit a new client would exceed, nullptr if none
+    const char* OverLimit();
+    void Reject(int peerfd);
+    void AddSession(int peerfd, Socks5Session* session);
+    // Stop accepting and exit once the remaining sessions are gone
+    void StartDraining();
+    void CheckDrained();
+    // Destroys the sessions DeferDestroy() queued, from OnFlushPrepare()
+    void Reap();
+    void LogPerf();
+    // Detaches the hottest tunnels, about fraction of the recent traffic,
+    // and queues them to target
+    void MigrateTo(Socks5Server& target, double fraction);
 private:
-    std::unordered_map<int, std::shared_ptr<Socks5Session>> sessions_;
+    Socks5Config config_;
+    int worker_;
+    ev::loop_ref loop_;
+    // Declared before the sessions so it outlives the timers they own
+    TimerWheel timer_wheel_;
+    // Only sessions still negotiating or connecting hold one
+    SlabPool<Socks5HandshakeState> handshake_pool_;
+    // One per session while the access log is on
+    SlabPool<AccessLog::Record> access_pool_;
+    SlabPool<FlightRecorder> flight_pool_;
+    SlabPool<Socks5Session> session_pool_;
+    // Indexed by peer fd, fds are small and dense so a flat array beats hashing
+    std::vector<Socks5Session*> sessions_;
+    // By peer fd as well: BytesRelayed() of the session at the last
+    // migration round, kept here rather than in every session
+    std::vector<uint64_t> relayed_marks_;
+    // Peer fds of sessions closed during this loop iteration
+    std::vector<int> closed_sessions_;
+    // Sessions that yielded, by handle as they may close while queued
+    std::vector<SlabPool<Socks5Session>::Handle> ready_sessions_;
+    std::vector<SlabPool<Socks5Session>::Handle> resuming_sessions_;
+    // Sessions with output queued during this iteration
+    std::vector<SlabPool<Socks5Session>::Handle> dirty_sessions_;
+    std::vector<SlabPool<Socks5Session>::Handle> flushing_sessions_;
+    // Rejected clients with their close deadline, oldest first
+    std::deque<std::pair<ev::tstamp, int>> lingering_;
+
+    std::vector<Socks5Server*> peers_;
+    // Tunnels migrating here, one queue per source worker
+    std::vector<std::unique_ptr<SpscQueue<Socks5HandoffRecord>>> inbox_;
+    // Filled by worker 0 only
+    SpscQueue<std::shared_ptr<AdminJob>> admin_inbox_;
+    // Pending migration request, -1 when none
+    std::atomic<int> migrate_to_;
+    std::atomic<bool> stopping_;
+    std::atomic<bool> dump_requested_;
+    std::atomic<double> migrate_fraction_;
+    std::atomic<double> cpu_load_;
+    std::atomic<double> byte_rate_;
+    std::atomic<size_t> session_count_;
+    double last_cpu_time_;
+    uint64_t last_bytes_relayed_;
+    // Buffer bytes freed since the last trim
+    size_t released_bytes_;
+
+    size_t trace_counter_;
+    size_t perf_counter_;
+    // This loop's thread, opened once it runs
+    PerfCounters perf_;
 
     int listen_fd_;
+    HotUpgrade upgrade_;
+    bool draining_;
 
     struct sockaddr_in listen_addr_;
 
+    UpstreamPool upstream_pool_;
+    SourceAddressPool source_pool_;
+    Socks5ServerStats stats_;
+    // Scraped from any thread, on cache lines of its own
+    Metrics metrics_;
+    // Worker 0 serves the metrics of all workers, see --metrics
+    MetricsExporter metrics_exporter_;
+    // Worker 0 also takes the admin commands, see --admin-socket
+    AdminServer admin_;
+
     ev::io io_;
-    ev::default_loop loop_;
+    ev::timer stats_timer_;
+    // Counts loop iterations, each one a return from epoll_wait, and
+    // times them until the lag prepare, the last thing before the next
+    ev::check wakeup_check_;
+    ev::prepare lag_prepare_;
+    uint64_t iteration_start_us_;
+    LoopActivity activity_;
+    // Check watchers are invoked first after epoll_wait, ahead of the I/O
+    // callbacks of the same iteration, so yielded sessions resume before
+    // the fds that became ready in the meantime
+    ev::check ready_check_;
+    // Keeps the loop from blocking in poll while sessions wait to resume
+    ev::idle ready_idle_;
+    // Runs after the last callback of the iteration: flushes, then reaps
+    ev::prepare flush_prepare_;
+    ev::timer accept_backoff_timer_;
+    ev::timer linger_timer_;
+    ev::timer trim_timer_;
+    ev::io upgrade_io_;
+    ev::sig upgrade_signal_;
+    // SIGUSR2, watched by worker 0 for all of them
+    ev::sig dump_signal_;
+    // SIGTERM and SIGINT, worker 0 returns from Run() and the WorkerGroup
+    // stops the others
+    ev::sig term_signal_;
+    ev::sig interrupt_signal_;
+    // Wakes this loop for migration requests, incoming tunnels, dumps and
+    // admin jobs
+    ev::async migrate_async_;
+    ev::timer load_timer_;
 };
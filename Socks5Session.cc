@@ -1,217 +1,631 @@
+#include <algorithm>
 #include <cassert>
 #include <unistd.h>
 #include <cstring>
+#include <sstream>
 #include <arpa/inet.h>
 #include <netinet/in.h>
+#include <netinet/tcp.h>
 #include <netdb.h>
 #include <fcntl.h>
 #include <sys/socket.h>
 #include "Socks5Session.h"
 #include "Socks5Server.h"
-#include "easylogging++.h"
+#include "AsyncLog.h"
 
-Socks5Session::Socks5Session(Socks5Server& server, int peer_fd) :
-    server_(server),
-    state_(Socks5SessionState::kIdle),
-    domain_len_(0),
-    domain_(),
+// Hot fields, the two watchers and the timer link. Anything only needed
+// before the tunnel is up belongs in Socks5HandshakeState instead
+static_assert(sizeof(Socks5Session) <= 320, "Socks5Session grew past its per-connection budget");
+
+const ev::tstamp Socks5Session::kBufferLinger = 1.0;
+
+const char* Socks5Session::StateName(uint8_t state)
+{
+    static const char* const kNames[] = {"idle", "handshaking", "connecting", "established", "closing", "closed"};
+    static_assert(sizeof(kNames) / sizeof(kNames[0]) == Metrics::kSessionStates, "Metrics must count every session state");
+    static_assert(Socks5SessionState::kClosed + 1 == Metrics::kSessionStates, "Metrics must count every session state");
+    return state < sizeof(kNames) / sizeof(kNames[0]) ? kNames[state] : "unknown";
+}
+
+Socks5Session::Socks5Session(Socks5Server& server, int peer_fd, const struct sockaddr_in& peer_addr) :
     peer_fd_(peer_fd),
-    peer_watcher_(std::make_shared<ev::io>()),
-    peer_closing_(false),
-    peer_watch_flag_(ev::READ | ev::WRITE),
     remote_fd_(-1),
-    remote_watcher_(std::make_shared<ev::io>()),
+    state_(Socks5SessionState::kIdle),
+    peer_watch_flag_(ev::READ),
+    remote_watch_flag_(ev::READ | ev::WRITE),
+    peer_closing_(false),
     remote_closing_(false),
-    remote_watch_flag_(ev::READ | ev::WRITE)
+    peer_write_shut_(false),
+    remote_write_shut_(false),
+    yielded_(0),
+    dirty_(0),
+    traced_(server.TraceNext()),
+    close_reason_(AccessLog::kShutdown),
+    perf_sampled_(server.PerfNext()),
+    request_us_(0),
+    last_active_(0),
+    bytes_up_(0),
+    bytes_down_(0),
+    server_(server),
+    peer_watcher_(server.Loop()),
+    remote_watcher_(server.Loop()),
+    flight_(nullptr),
+    handshake_(server.GetHandshakePool().Create()),
+    start_us_(Histogram::Now()),
+    peer_addr_(peer_addr),
+    remote_source_(-1),
+    reply_us_(0),
+    access_(nullptr)
+{
+    if(AccessLog::Enabled())
+    {
+        access_ = server_.GetAccessPool().Create();
+        access_->start_us_ = ev::now(server_.Loop()) * 1e6;
+        access_->client_addr_ = peer_addr_.sin_addr.s_addr;
+        access_->client_port_ = peer_addr_.sin_port;
+        access_->reply_ = Socks5ReplyField::kUndefined;
+    }
+    server_.GetMetrics().AddSessions(state_, 1);
+    if(server_.Config().flight_recorder_)
+    {
+        flight_ = server_.GetFlightPool().Create(ev::now(server_.Loop()));
+        Record(FlightRecorder::kAccept);
+    }
+    peer_watcher_.set<Socks5Session, &Socks5Session::OnPeerEvent>(this);
+    peer_watcher_.start(peer_fd_, ev::READ);
+    timer_.set<Socks5Session, &Socks5Session::OnTimer>(this);
+    ArmTimer(server_.Config().handshake_timeout_);
+}
 
+Socks5Session::Socks5Session(Socks5Server& server, Socks5HandoffRecord& record) :
+    peer_fd_(record.peer_fd_),
+    remote_fd_(record.remote_fd_),
+    state_(Socks5SessionState::kEstablished),
+    peer_watch_flag_(0),
+    remote_watch_flag_(0),
+    peer_closing_(record.flags_ & Socks5HandoffRecord::kPeerClosing),
+    remote_closing_(record.flags_ & Socks5HandoffRecord::kRemoteClosing),
+    peer_write_shut_(record.flags_ & Socks5HandoffRecord::kPeerWriteShut),
+    remote_write_shut_(record.flags_ & Socks5HandoffRecord::kRemoteWriteShut),
+    yielded_(0),
+    dirty_(0),
+    traced_(server.TraceNext()),
+    close_reason_(AccessLog::kShutdown),
+    perf_sampled_(server.PerfNext()),
+    request_us_(0),
+    last_active_(0),
+    bytes_up_(record.bytes_up_),
+    bytes_down_(record.bytes_down_),
+    server_(server),
+    peer_watcher_(server.Loop()),
+    remote_watcher_(server.Loop()),
+    flight_(nullptr),
+    handshake_(nullptr),
+    start_us_(record.start_us_ != 0 ? record.start_us_ : Histogram::Now()),
+    peer_addr_(record.peer_addr_),
+    remote_source_(-1),
+    reply_us_(0),
+    access_(nullptr)
 {
-    memset(&remote_addr_, 0, sizeof(remote_addr_));
-    peer_watcher_->set<Socks5Session, &Socks5Session::OnPeerEvent>(this);
-    peer_watcher_->start(peer_fd_, ev::READ);
+    last_active_ = ev::now(server_.Loop());
+    if(AccessLog::Enabled())
+    {
+        access_ = server_.GetAccessPool().Create(record.access_);
+        if(access_->start_us_ == 0)
+        {
+            // Handed over by a process that did not log, the tunnel's
+            // history before now is lost
+            access_->start_us_ = last_active_ * 1e6;
+            access_->client_addr_ = peer_addr_.sin_addr.s_addr;
+            access_->client_port_ = peer_addr_.sin_port;
+            access_->reply_ = Socks5ReplyField::kSucceeded;
+        }
+    }
+    server_.GetMetrics().AddSessions(state_, 1);
+    if(server_.Config().flight_recorder_)
+    {
+        flight_ = server_.GetFlightPool().Create(last_active_);
+        Record(FlightRecorder::kResumed, record.peer_data_.size() + record.remote_data_.size());
+    }
+    peer_buffer_.Append(record.peer_data_);
+    remote_buffer_.Append(record.remote_data_);
+
+    // Anything that arrived during the handoff is still queued in the
+    // sockets, so every live direction starts out readable and writable
+    if(!peer_closing_)
+    {
+        peer_watch_flag_ |= ev::READ;
+    }
+    if(!peer_write_shut_)
+    {
+        peer_watch_flag_ |= ev::WRITE;
+    }
+    if(!remote_closing_)
+    {
+        remote_watch_flag_ |= ev::READ;
+    }
+    if(!remote_write_shut_)
+    {
+        remote_watch_flag_ |= ev::WRITE;
+    }
+    peer_watcher_.set<Socks5Session, &Socks5Session::OnPeerEvent>(this);
+    peer_watcher_.start(peer_fd_, peer_watch_flag_);
+    remote_watcher_.set<Socks5Session, &Socks5Session::OnRemoteEvent>(this);
+    remote_watcher_.start(remote_fd_, remote_watch_flag_);
+    timer_.set<Socks5Session, &Socks5Session::OnTimer>(this);
+    ArmTimer(NextIdleCheck(0));
 }
 
 Socks5Session::~Socks5Session()
 {
-    close(peer_fd_);
-    peer_watcher_->stop();
+    peer_watcher_.stop();
+    // Detached tunnels live on elsewhere
+    if(peer_fd_ != -1)
+    {
+        server_.GetMetrics().AddLatency(Metrics::kLifetime, Histogram::Now() - start_us_);
+        close(peer_fd_);
+    }
+    CloseRemote();
+    ReleaseHandshake();
+    WriteAccessRecord();
+    server_.GetMetrics().AddSessions(state_, -1);
+    if(flight_ != nullptr)
+    {
+        server_.GetFlightPool().Destroy(flight_);
+    }
 }
 
+// Hardware counters around one callback of a session sampled by
+// --perf-sample. Charged to the relay when the tunnel was up as it
+// started, per byte read, otherwise to the handshake, per tunnel it
+// brought up
+class Socks5Session::PerfScope
+{
+public:
+    explicit PerfScope(Socks5Session& session) :
+        session_(session),
+        state_(session.state_),
+        bytes_(0),
+        active_(false)
+    {
+        if(session_.perf_sampled_)
+        {
+            bytes_ = session_.BytesRelayed();
+            active_ = session_.server_.GetPerfCounters().Read(start_);
+        }
+    }
+
+    ~PerfScope()
+    {
+        PerfCounters::Values end;
+        uint64_t counts[PerfCounters::kEventCount];
+        if(!active_ || !session_.server_.GetPerfCounters().Read(end) || !PerfCounters::Delta(start_, end, counts))
+        {
+            return;
+        }
+        if(state_ == Socks5SessionState::kEstablished)
+        {
+            session_.server_.GetMetrics().AddPerf(Metrics::kPerfRelay, counts, session_.BytesRelayed() - bytes_);
+        }
+        else
+        {
+            session_.server_.GetMetrics().AddPerf(Metrics::kPerfHandshake, counts, session_.state_ == Socks5SessionState::kEstablished);
+        }
+    }
+private:
+    Socks5Session& session_;
+    Socks5SessionState state_;
+    uint64_t bytes_;
+    bool active_;
+    PerfCounters::Values start_;
+};
+
 void Socks5Session::OnPeerEvent(ev::io &watcher, int revents)
 {
-    LOG(INFO) << __func__ << ", peerfd=" << peer_fd_ << ", remotefd=" << remote_fd_;
+    AsyncLog::TraceScope trace(traced_);
+    server_.Activity().Mark(LoopActivity::kPeerEvent, peer_fd_, state_);
+    PerfScope perf(*this);
+    CountWakeup();
+    LOG(TRACE) << __func__ << ", peerfd=" << peer_fd_ << ", remotefd=" << remote_fd_;
+    last_active_ = ev::now(server_.Loop());
+    bool held = HoldsBuffers();
     if(revents & EV_READ)
     {
         OnPeerCanRead();
     }
-    if(revents & EV_WRITE)
+    if((revents & EV_WRITE) && state_ != Socks5SessionState::kClosed)
     {
         OnPeerCanWrite();
     }
-    if(revents & EV_ERROR)
+    if((revents & EV_ERROR) && state_ != Socks5SessionState::kClosed)
     {
-        LOG(INFO) << "fd=" << peer_fd_ << " OnError";
+        LOG(DEBUG) << "fd=" << peer_fd_ << " OnError";
         OnPeerError();
     }
-    peer_watcher_->set(peer_watch_flag_);
-    remote_watcher_->set(remote_watch_flag_);
+    if(state_ == Socks5SessionState::kClosed)
+    {
+        return;
+    }
+    WatchBuffers(held);
+    UpdateWatchers();
 }
 
 void Socks5Session::OnPeerCanRead()
 {
-    LOG(INFO) << __func__ << ", peerfd=" << peer_fd_ << ", remotefd=" << remote_fd_;
+    LOG(TRACE) << __func__ << ", peerfd=" << peer_fd_ << ", remotefd=" << remote_fd_;
     peer_watch_flag_ &= (~ev::READ);
-    int ret = peer_buffer_.AppendFromSocket(peer_fd_, kMaxTrunk);
-    if(ret < 0)
+    if(state_ == Socks5SessionState::kEstablished)
     {
-        if(errno != EINTR && errno != EAGAIN && errno != EWOULDBLOCK)
-        {
-            LOG(INFO) << "Read Error, error=" << strerror(errno);
-            peer_closing_ = true;
-            state_ = Socks5SessionState::kClosing;
-        }
-        peer_watch_flag_ |= ev::READ;
+        // Every relay read goes through ReadPeerData, charged to the
+        // wakeup budget
+        ReadPeerData();
+        return;
     }
-
-    else if(ret == 0)
+    size_t before = peer_buffer_.Size();
+    StreamBuffer::SocketCalls calls;
+    int ret = peer_buffer_.AppendFromSocket(peer_fd_, kMaxTrunk, calls);
+    int err = errno;
+    CountSyscalls(Metrics::kReadCall, calls.calls_, calls.eagain_);
+    OnRelayed(peer_buffer_.Size() - before, true, ret < 0 ? err : 0);
+    if(ret < 0 && (err == EINTR || err == EAGAIN || err == EWOULDBLOCK))
     {
-        LOG(INFO) << "Read Error, peer closed";
-        peer_closing_ = true;
-        peer_watcher_->stop();
-        state_ = Socks5SessionState::kClosing;
+        peer_watch_flag_ |= ev::READ;
     }
 
+    // Whatever arrived ahead of an EOF or error is still processed
     switch(state_)
     {
         case Socks5SessionState::kIdle:
-            LOG(INFO) << "fd=" << peer_fd_ << " Read Handshaking request";
-            state_ = Socks5SessionState::kHandshaking;
-            if(peer_buffer_.Size() >= sizeof(Socks5HandshakeRequest))
+            LOG(DEBUG) << "fd=" << peer_fd_ << " Read Handshaking request";
+            // -1 for an incomplete greeting, or a rejected one
+            if(OnHandshakeRequest() == -1)
             {
-                OnHandshakeRequest();
+                break;
+            }
+            SetState(Socks5SessionState::kHandshaking);
+            // Clients may pipeline the request right behind the greeting,
+            // the greeting reply then waits to share a write with the
+            // request's reply
+            if(peer_buffer_.Size() > 0)
+            {
+                ReadRequest();
+            }
+            if(state_ == Socks5SessionState::kHandshaking)
+            {
+                SendRemoteDataToPeer();
             }
             break;
         case Socks5SessionState::kHandshaking:
             ReadRequest();
             break;
-        case Socks5SessionState::kEstablished:
-            ReadPeerData();
+        case Socks5SessionState::kConnecting:
+            // Early data, held in peer_buffer_ until the connect completes
             break;
+        case Socks5SessionState::kEstablished:
         case Socks5SessionState::kClosing:
+        case Socks5SessionState::kClosed:
         default:
             break;
     }
-    peer_watcher_->set(peer_watch_flag_);
+    if(state_ < Socks5SessionState::kEstablished)
+    {
+        // A handshake is a few bytes, don't hold a read-sized buffer for it
+        // through the connect
+        peer_buffer_.Release();
+    }
+
+    if(ret == 0)
+    {
+        OnPeerClose();
+    }
+    else if(ret < 0 && err != EINTR && err != EAGAIN && err != EWOULDBLOCK)
+    {
+        LOG(INFO) << "Read Error, peerfd=" << peer_fd_ << ", error=" << strerror(err);
+        SetCloseReason(AccessLog::kPeerError);
+        Close();
+    }
 }
 
 void Socks5Session::OnPeerCanWrite()
 {
-    LOG(INFO) << __func__ << ", peerfd=" << peer_fd_ << ", remotefd=" << remote_fd_;
+    LOG(TRACE) << __func__ << ", peerfd=" << peer_fd_ << ", remotefd=" << remote_fd_;
     peer_watch_flag_ &= (~ev::WRITE);
-    int ret = remote_buffer_.ExtractToSocket(peer_fd_);
-
-    if(ret <= 0)
+    FlushRemoteDataToPeer();
+    // Reading from the upstream stopped at kHighWater, see OnRemoteCanRead
+    if(state_ == Socks5SessionState::kEstablished && remote_buffer_.Size() < kLowWater && !remote_closing_
+       && !(yielded_ & kYieldRemoteRead))
     {
-        if(errno != EINTR && errno != EAGAIN && errno != EWOULDBLOCK)
-        {
-            peer_closing_ = true;
-            state_ = Socks5SessionState::kClosing;
-        }
-        peer_watch_flag_ |= ev::WRITE;
+        remote_watch_flag_ |= ev::READ;
     }
 }
 
 void Socks5Session::OnPeerError()
 {
-    LOG(INFO) << __func__ << ", peerfd=" << peer_fd_ << ", remotefd=" << remote_fd_;
+    LOG(TRACE) << __func__ << ", peerfd=" << peer_fd_ << ", remotefd=" << remote_fd_;
 }
 
 void Socks5Session::OnRemoteEvent(ev::io &watcher, int revents)
 {
-    LOG(INFO) << __func__ << ", peerfd=" << peer_fd_ << ", remotefd=" << remote_fd_;
+    AsyncLog::TraceScope trace(traced_);
+    server_.Activity().Mark(LoopActivity::kRemoteEvent, peer_fd_, state_);
+    PerfScope perf(*this);
+    CountWakeup();
+    LOG(TRACE) << __func__ << ", peerfd=" << peer_fd_ << ", remotefd=" << remote_fd_;
+    last_active_ = ev::now(server_.Loop());
+    bool held = HoldsBuffers();
     if(revents & EV_READ)
     {
         OnRemoteCanRead();
     }
-    if(revents & EV_WRITE)
+    if((revents & EV_WRITE) && state_ != Socks5SessionState::kClosed)
     {
         OnRemoteCanWrite();
     }
-    if(revents & EV_ERROR)
+    if((revents & EV_ERROR) && state_ != Socks5SessionState::kClosed)
     {
-        LOG(INFO) << "fd=" << peer_fd_ << " OnError";
+        LOG(DEBUG) << "fd=" << peer_fd_ << " OnError";
         OnRemoteError();
     }
-    peer_watcher_->set(peer_watch_flag_);
-    remote_watcher_->set(remote_watch_flag_);
+    if(state_ == Socks5SessionState::kClosed)
+    {
+        return;
+    }
+    WatchBuffers(held);
+    UpdateWatchers();
 }
 
 void Socks5Session::OnRemoteCanRead()
 {
-    LOG(INFO) << __func__ << ", peerfd=" << peer_fd_ << ", remotefd=" << remote_fd_;
+    LOG(TRACE) << __func__ << ", peerfd=" << peer_fd_ << ", remotefd=" << remote_fd_;
     remote_watch_flag_ &= (~ev::READ);
     SendRemoteDataToPeer();
     int ret = 0;
-    while((ret = remote_buffer_.AppendFromSocket(remote_fd_, kMaxTrunk)) > 0)
+    size_t budget = kWakeupBudget;
+    // ret is the last read() only, what was read is what the buffer grew by
+    size_t before = remote_buffer_.Size();
+    StreamBuffer::SocketCalls calls;
+    while(state_ != Socks5SessionState::kClosed && (ret = remote_buffer_.AppendFromSocket(remote_fd_, kMaxTrunk, calls)) > 0)
     {
-        ret = remote_buffer_.ExtractToSocket(peer_fd_);
-        if(ret == -1 )
+        OnRelayed(remote_buffer_.Size() - before, false, 0);
+        OnFirstRemoteByte();
+        // A full read, ret > 0, is always kMaxTrunk bytes
+        SendRemoteDataToPeer();
+        if(remote_buffer_.Size() >= kHighWater && state_ != Socks5SessionState::kClosed)
         {
-            if(errno == EINTR || errno == EAGAIN || errno == EWOULDBLOCK)
-            {
-                peer_watch_flag_ |= ev::WRITE;
-            }
-            else
-            {
-                LOG(FATAL) << "Unexcpected error on peerfd=" << peer_fd_ << ", error=" << strerror(errno);
-                assert(0);
-            }
+            // The client is not keeping up, leave READ off until
+            // OnPeerCanWrite drained the buffer
+            CountSyscalls(Metrics::kReadCall, calls.calls_, calls.eagain_);
+            Record(FlightRecorder::kBackpressure, remote_buffer_.Size());
+            return;
+        }
+        if(budget <= kMaxTrunk)
+        {
+            CountSyscalls(Metrics::kReadCall, calls.calls_, calls.eagain_);
+            Yield(kYieldRemoteRead);
+            return;
         }
+        budget -= kMaxTrunk;
+        before = remote_buffer_.Size();
+    }
+    int err = errno;
+    CountSyscalls(Metrics::kReadCall, calls.calls_, calls.eagain_);
+    if(state_ == Socks5SessionState::kClosed)
+    {
+        return;
+    }
+    OnRelayed(remote_buffer_.Size() - before, false, ret < 0 ? err : 0);
+    if(remote_buffer_.Size() > 0)
+    {
+        OnFirstRemoteByte();
     }
     SendRemoteDataToPeer();
+    if(state_ == Socks5SessionState::kClosed)
+    {
+        return;
+    }
 
     if(ret == -1 )
     {
-        if(errno == EINTR || errno == EAGAIN || errno == EWOULDBLOCK)
+        if(err == EINTR || err == EAGAIN || err == EWOULDBLOCK)
         {
             remote_watch_flag_ |= ev::READ;
         }
         else
         {
-            LOG(FATAL) << "Unexcpected error on remotefd=" << remote_fd_ << ", error=" << strerror(errno);
-            assert(0);
+            LOG(INFO) << "Read Error, remotefd=" << remote_fd_ << ", error=" << strerror(err);
+            SetCloseReason(AccessLog::kRemoteError);
+            Close();
         }
     }
     else if(ret == 0)
     {
-        LOG(INFO) << "Remote Close, peerfd=" << peer_fd_ << ", remotefd=" << remote_fd_;
-        // TODO: OnRemoteClose
+        OnRemoteClose();
+    }
+}
+
+void Socks5Session::Yield(uint8_t direction)
+{
+    if(state_ == Socks5SessionState::kClosed)
+    {
+        return;
+    }
+    // The fd stays out of the poll set for READ, the server calls
+    // OnResume() once every other ready callback had its turn
+    if(yielded_ == 0)
+    {
+        server_.ScheduleResume(this);
+    }
+    Record(FlightRecorder::kYield, direction);
+    yielded_ |= direction;
+}
+
+void Socks5Session::OnRelayed(size_t bytes, bool from_peer, int err)
+{
+    Record(from_peer ? FlightRecorder::kPeerRead : FlightRecorder::kRemoteRead, bytes, err);
+    server_.GetMetrics().Add(from_peer ? Metrics::kBytesUp : Metrics::kBytesDown, bytes);
+    (from_peer ? bytes_up_ : bytes_down_) += bytes;
+}
+
+void Socks5Session::CountSyscalls(Metrics::Syscall call, uint32_t calls, uint32_t eagain)
+{
+    server_.GetMetrics().AddSyscalls(call, calls, eagain);
+    if(access_ != nullptr)
+    {
+        access_->syscalls_ += calls;
+    }
+}
+
+void Socks5Session::CountWakeup()
+{
+    if(access_ != nullptr)
+    {
+        access_->wakeups_ ++;
+    }
+}
+
+void Socks5Session::UpdateWatcher(ev::io& watcher, uint8_t flag)
+{
+    if((watcher.events & (ev::READ | ev::WRITE)) == flag)
+    {
+        return;
+    }
+    watcher.set(flag);
+    if(watcher.is_active())
+    {
+        CountSyscalls(Metrics::kEpollCtl, 1);
+    }
+}
+
+void Socks5Session::UpdateWatchers()
+{
+    UpdateWatcher(peer_watcher_, peer_watch_flag_);
+    UpdateWatcher(remote_watcher_, remote_watch_flag_);
+}
+
+void Socks5Session::Record(FlightRecorder::Event event, size_t bytes, int err)
+{
+    if(flight_ != nullptr)
+    {
+        flight_->Add(ev::now(server_.Loop()), event, state_, bytes, err);
+    }
+}
+
+void Socks5Session::SetState(Socks5SessionState state)
+{
+    server_.GetMetrics().AddSessions(state_, -1);
+    server_.GetMetrics().AddSessions(state, 1);
+    state_ = state;
+}
+
+void Socks5Session::SetCloseReason(AccessLog::CloseReason reason)
+{
+    if(close_reason_ != AccessLog::kShutdown)
+    {
+        return;
+    }
+    close_reason_ = reason;
+    if(state_ < Socks5SessionState::kEstablished)
+    {
+        server_.GetMetrics().AddHandshakeFailure(reason);
+    }
+    if(access_ != nullptr)
+    {
+        access_->close_reason_ = reason;
+    }
+}
+
+void Socks5Session::WriteAccessRecord()
+{
+    if(access_ == nullptr)
+    {
+        return;
+    }
+    access_->lifetime_ms_ = (ev::now(server_.Loop()) * 1e6 - access_->start_us_) / 1000;
+    access_->bytes_up_ = bytes_up_;
+    access_->bytes_down_ = bytes_down_;
+    access_->worker_ = server_.Worker();
+    AccessLog::Append(*access_);
+    server_.GetAccessPool().Destroy(access_);
+    access_ = nullptr;
+}
+
+void Socks5Session::OnResume()
+{
+    AsyncLog::TraceScope trace(traced_);
+    server_.Activity().Mark(LoopActivity::kResume, peer_fd_, state_);
+    PerfScope perf(*this);
+    CountWakeup();
+    uint8_t yielded = yielded_;
+    yielded_ = 0;
+    if(state_ != Socks5SessionState::kEstablished)
+    {
+        return;
+    }
+    LOG(TRACE) << __func__ << ", peerfd=" << peer_fd_ << ", remotefd=" << remote_fd_;
+    last_active_ = ev::now(server_.Loop());
+    bool held = HoldsBuffers();
+    if(yielded & kYieldRemoteRead)
+    {
+        OnRemoteCanRead();
+    }
+    if((yielded & kYieldPeerRead) && state_ == Socks5SessionState::kEstablished)
+    {
+        peer_watch_flag_ &= (~ev::READ);
+        ReadPeerData();
+    }
+    if(state_ == Socks5SessionState::kClosed)
+    {
+        return;
+    }
+    WatchBuffers(held);
+    UpdateWatchers();
+}
+
+void Socks5Session::OnFirstRemoteByte()
+{
+    if(request_us_ > 0)
+    {
+        uint64_t elapsed = Histogram::Now() - start_us_;
+        server_.Stats().ttfb_count_ ++;
+        server_.Stats().ttfb_sum_ += (elapsed - request_us_) / 1e6;
+        server_.GetMetrics().AddLatency(Metrics::kFirstByte, elapsed - reply_us_);
+        request_us_ = 0;
     }
 }
 
 void Socks5Session::OnRemoteCanWrite()
 {
-    LOG(INFO) << __func__ << ", peerfd=" << peer_fd_ << ", remotefd=" << remote_fd_;
+    LOG(TRACE) << __func__ << ", peerfd=" << peer_fd_ << ", remotefd=" << remote_fd_;
     remote_watch_flag_ &= (~ev::WRITE);
     switch(state_)
     {
-        case Socks5SessionState::kHandshaking:
-            if(IsRemoteConnected())
+        case Socks5SessionState::kConnecting:
+        {
+            int err = GetRemoteConnectError();
+            if(err == 0)
             {
                 OnRemoteConnected();
             }
             else
             {
-                remote_watch_flag_ |= ev::WRITE;
-                // OnRemoteConnectFailed();
+                OnRemoteConnectFailed(err);
             }
             break;
+        }
         case Socks5SessionState::kEstablished:
-            SendPeerDataToRemote();
+            FlushPeerDataToRemote();
+            // Reading from the client stopped at kHighWater, see ReadPeerData
+            if(state_ == Socks5SessionState::kEstablished && peer_buffer_.Size() < kLowWater && !peer_closing_
+               && !(yielded_ & kYieldPeerRead))
+            {
+                peer_watch_flag_ |= ev::READ;
+            }
             break;
         case Socks5SessionState::kClosing:
+        case Socks5SessionState::kClosed:
             break;
         default:
-            assert(0);
+            DumpAndAbort("remote writable before connecting");
     }
 }
 
@@ -219,43 +633,77 @@ void Socks5Session::OnRemoteError()
 {
 }
 
-void Socks5Session::OnHandshakeRequest()
+int Socks5Session::OnHandshakeRequest()
 {
     Socks5HandshakeRequest req;
-    peer_buffer_.Extract(&req, sizeof(req));
-
+    if(peer_buffer_.Size() < 2)
+    {
+        return -1;
+    }
+    peer_buffer_.Peek(&req, 2);
+    if(peer_buffer_.Size() < (size_t)(2 + req.nmethods_))
+    {
+        return -1;
+    }
+    peer_buffer_.Extract(&req, 2);
 
     Socks5HandshakeReply resp;
     memset(&resp, 0, sizeof(resp));
     resp.ver_ = 5;
+    resp.method_ = kMethodNoAcceptable;
 
-    if(req.ver_ != 5)
+    // Currently not support authentication method
+    for(uint8_t i = 0; i < req.nmethods_; i++)
     {
-        LOG(INFO) << "Request version mismatch, req.ver_=" << req.ver_;
-        resp.method_ = 0xFF;
+        uint8_t method;
+        peer_buffer_.Extract(&method, sizeof(method));
+        if(method == kMethodNoAuth)
+        {
+            resp.method_ = kMethodNoAuth;
+        }
     }
-    else
+
+    if(req.ver_ != 5)
     {
-        // Currently not support authentication method
-        resp.method_ = 0x00;
+        LOG(INFO) << "Request version mismatch, req.ver_=" << req.ver_;
+        resp.method_ = kMethodNoAcceptable;
     }
 
-    LOG(INFO) << "HandShake Done";
+    handshake_->greeting_us_ = Histogram::Now();
+    Record(FlightRecorder::kGreeting, req.nmethods_);
     remote_buffer_.Append(&resp, sizeof(resp));
-    peer_watcher_->set(ev::WRITE);
+    if(resp.method_ == kMethodNoAcceptable)
+    {
+        // Whatever the client pipelined behind the greeting is not a
+        // request we may act on
+        server_.GetMetrics().Add(Metrics::kGreetingsRejected);
+        SetCloseReason(AccessLog::kUnsupported);
+        CloseAfterReply();
+        return -1;
+    }
+    LOG(DEBUG) << "HandShake Done";
+    return 0;
 }
 
 void Socks5Session::ReadRequest()
 {
-    LOG(INFO) << __func__;
-    if(request_.atype_ == Socks5AddressingMode::kAtypeUnknown)
+    LOG(TRACE) << __func__;
+    if(handshake_->request_.atype_ == Socks5AddressingMode::kAtypeUnknown)
     {
-        if(peer_buffer_.Size() < sizeof(Socks5HandshakeRequest))
+        if(peer_buffer_.Size() < sizeof(handshake_->request_))
         {
             return;
         }
 
-        peer_buffer_.Extract(&request_, sizeof(request_));
+        peer_buffer_.Extract(&handshake_->request_, sizeof(handshake_->request_));
+        Record(FlightRecorder::kRequest, handshake_->request_.cmd_);
+        // Checked before the address, a domain would be resolved for nothing
+        if(handshake_->request_.cmd_ != Socks5Command::kConnect)
+        {
+            LOG(INFO) << "Command " << (int)handshake_->request_.cmd_ << " not supported, peerfd=" << peer_fd_;
+            ReplayCmdNotSupport();
+            return;
+        }
         ReadDstAddr();
     }
     else
@@ -266,171 +714,640 @@ void Socks5Session::ReadRequest()
 
 void Socks5Session::ReadDstAddr()
 {
-    LOG(INFO) << __func__;
-    if(request_.atype_ == Socks5AddressingMode::kDomain)
-    {
-        if(ReadRequestDomain() != -1)
-        {
-            OnRequestReceived();
-        }
-    }
-    else if(request_.atype_ == Socks5AddressingMode::kIpv4)
-    {
-        LOG(INFO) << "IPV4 is not supported";
-        assert(0);
-    }
-    else if(request_.atype_ == Socks5AddressingMode::kIpv6)
+    LOG(TRACE) << __func__;
+    switch(handshake_->request_.atype_)
     {
-        LOG(INFO) << "IPV6 is not supported";
-        assert(0);
-    }
-    else
-    {
-        LOG(FATAL) << "atype " << request_.atype_ << " not supported";
-        assert(0);
+        case Socks5AddressingMode::kDomain:
+            if(ReadRequestDomain() != -1)
+            {
+                OnRequestReceived();
+            }
+            break;
+        case Socks5AddressingMode::kIpv4:
+        case Socks5AddressingMode::kIpv6:
+        default:
+            LOG(INFO) << "Address type " << (int)handshake_->request_.atype_ << " not supported, peerfd=" << peer_fd_;
+            ReplyAtypeNotSupport();
+            break;
     }
 }
 
 int Socks5Session::ReadRequestDomain()
 {
-    LOG(INFO) << __func__;
-    if(domain_len_ == 0)
+    LOG(TRACE) << __func__;
+    if(handshake_->domain_len_ == 0)
     {
-        if(peer_buffer_.Size() < sizeof(domain_len_))
+        if(peer_buffer_.Size() < sizeof(handshake_->domain_len_))
         {
             return -1;
         }
         // Process Domain Len
-        peer_buffer_.Extract(&domain_len_, sizeof(domain_len_));
-        LOG(INFO) << "DOMAIN len="  << (int)domain_len_;
+        peer_buffer_.Extract(&handshake_->domain_len_, sizeof(handshake_->domain_len_));
+        LOG(DEBUG) << "DOMAIN len="  << (int)handshake_->domain_len_;
     }
 
-    if(peer_buffer_.Size() < (size_t)(domain_len_ + 2))
+    if(peer_buffer_.Size() < (size_t)(handshake_->domain_len_ + 2))
     {
         return -1;
     }
     // Process Domain
-    peer_buffer_.Extract(domain_, domain_len_);
+    peer_buffer_.Extract(handshake_->domain_, handshake_->domain_len_);
 
     // Read port
-    peer_buffer_.Extract(&remote_addr_.sin_port, 2);
+    peer_buffer_.Extract(&handshake_->remote_addr_.sin_port, 2);
+    if(access_ != nullptr)
+    {
+        access_->dst_len_ = std::min(handshake_->domain_.size(), sizeof(access_->dst_));
+        memcpy(access_->dst_, handshake_->domain_.data(), access_->dst_len_);
+        access_->dst_port_ = handshake_->remote_addr_.sin_port;
+    }
 
+    Metrics& metrics = server_.GetMetrics();
+    uint64_t resolve_start = Histogram::Now();
+    metrics.AddLatency(Metrics::kHandshake, resolve_start - handshake_->greeting_us_);
     // TODO: Use Async DNS
-    struct hostent* ret = gethostbyname(std::string(domain_.c_str(), domain_len_).c_str());
-    assert(ret != nullptr);
-    memcpy(&remote_addr_.sin_addr.s_addr, ret->h_addr_list[0], 4);
-    remote_addr_.sin_family = AF_INET;
+    server_.Activity().Mark(LoopActivity::kResolve, peer_fd_, state_);
+    struct hostent* ret = gethostbyname(std::string(handshake_->domain_.c_str(), handshake_->domain_len_).c_str());
+    server_.Activity().Mark(LoopActivity::kPeerEvent, peer_fd_, state_);
+    metrics.AddLatency(Metrics::kResolve, Histogram::Now() - resolve_start);
+    if(ret == nullptr || ret->h_addrtype != AF_INET || ret->h_addr_list[0] == nullptr)
+    {
+        metrics.Add(Metrics::kResolveFailures);
+        LOG(INFO) << "Resolve " << handshake_->domain_ << " failed, error=" << hstrerror(h_errno);
+        Record(FlightRecorder::kResolved, 0, h_errno);
+        SetCloseReason(AccessLog::kResolveFailed);
+        ReplyConnectFailed(Socks5ReplyField::kHostUnreachable);
+        return -1;
+    }
+    // Keep every address, connect attempts walk the list in order
+    for(char** addr = ret->h_addr_list; *addr != nullptr; ++addr)
+    {
+        struct in_addr in;
+        memcpy(&in, *addr, sizeof(in));
+        handshake_->remote_addrs_.push_back(in);
+    }
+    handshake_->remote_addr_.sin_addr = handshake_->remote_addrs_[0];
+    handshake_->remote_addr_.sin_family = AF_INET;
+    Record(FlightRecorder::kResolved, handshake_->remote_addrs_.size());
 
-    LOG(INFO) << "DOMAIN = " << domain_ << ", ADDRESS = " << inet_ntoa(remote_addr_.sin_addr) << ":" << ntohs(remote_addr_.sin_port);
+    LOG(DEBUG) << "DOMAIN = " << handshake_->domain_ << ", ADDRESS = " << inet_ntoa(handshake_->remote_addr_.sin_addr) << ":" << ntohs(handshake_->remote_addr_.sin_port);
     return 0;
 }
 
 void Socks5Session::OnRequestReceived()
 {
-    LOG(INFO) << __func__;
-    if(request_.ver_ != kSocks5Version)
+    LOG(TRACE) << __func__;
+    if(handshake_->request_.ver_ != kSocks5Version)
     {
     }
 
-    switch(request_.cmd_)
+    // Only CONNECT gets this far, see ReadRequest()
+    // Never 0, that means no first byte to wait for
+    request_us_ = std::max<uint64_t>(Histogram::Now() - start_us_, 1);
+    if(access_ != nullptr)
     {
-        case Socks5Command::kConnect:
-            ConnectRemote();
-            return;
-        case Socks5Command::kBind:
-            LOG(FATAL) << "SOCKS5 BIND NOT SUPPORTED";
-        case Socks5Command::kUdpAssociate:
-            LOG(FATAL) << "SOCKS5 UDP ASSOCIATE NOT SUPPORTED";
-        default:
-            LOG(FATAL) << "Unexpected request cmd, cmd=" << request_.cmd_;
-            return ReplayCmdNotSupport();
+        access_->handshake_us_ = request_us_;
     }
-
-    switch(request_.atype_)
+    SetState(Socks5SessionState::kConnecting);
+    if(server_.Config().optimistic_reply_)
     {
-        case Socks5AddressingMode::kDomain:
-            break;
-        case Socks5AddressingMode::kIpv4:
-        case Socks5AddressingMode::kIpv6:
-        default:
-            return ReplyAtypeNotSupport();
+        // Let the client start talking while we connect, a late
+        // failure can then only be reported by closing the tunnel
+        ReplyConnectSucceeded();
     }
+    ConnectRemote();
 }
 
+// A client asking for what we don't serve gets the error reply and EOF,
+// see ReplyFailed()
 void Socks5Session::ReplayCmdNotSupport()
 {
-    Socks5Reply resp;
-    resp.ver_ = kSocks5Version;
-    resp.rep_ = Socks5ReplyField::kCmdNotSupported;
-    resp.rsv_ = kReservedField;
-    resp.atype_ = request_.atype_;
-    remote_buffer_.Append(&resp, sizeof(resp));
-
-    // TODO: not only domain is supported
-    remote_buffer_.AppendBYTE(domain_.size());
-    remote_buffer_.Append(domain_);
-    remote_buffer_.AppendWORD(remote_addr_.sin_port);
+    SetCloseReason(AccessLog::kUnsupported);
+    ReplyFailed(Socks5ReplyField::kCmdNotSupported);
 }
 
 void Socks5Session::ReplyAtypeNotSupport()
 {
-    Socks5Reply resp;
-    resp.ver_ = kSocks5Version;
-    resp.rep_ = Socks5ReplyField::kAtypeNotSupported;
-    resp.rsv_ = kReservedField;
-    resp.atype_ = request_.atype_;
-    remote_buffer_.Append(&resp, sizeof(resp));
-
-    // TODO: not only domain is supported
-    remote_buffer_.AppendBYTE(domain_.size());
-    remote_buffer_.Append(domain_);
-    remote_buffer_.AppendWORD(remote_addr_.sin_port);
+    SetCloseReason(AccessLog::kUnsupported);
+    ReplyFailed(Socks5ReplyField::kAtypeNotSupported);
 }
 
 void Socks5Session::ConnectRemote()
 {
-    LOG(INFO) << __func__;
-    remote_fd_ = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
-    auto ret = fcntl(remote_fd_, F_SETFL, fcntl(remote_fd_, F_GETFL) | O_NONBLOCK);
-    assert(ret == 0);
+    LOG(TRACE) << __func__;
+    remote_watcher_.set<Socks5Session, &Socks5Session::OnRemoteEvent>(this);
 
-    LOG(INFO) << "CONNECTING " << inet_ntoa(remote_addr_.sin_addr) << ":" << ntohs(remote_addr_.sin_port) << " on fd=" << remote_fd_;
-    ret = ::connect(remote_fd_, (struct sockaddr*)&remote_addr_, sizeof(remote_addr_));
-    assert(ret == -1 && (errno == EINPROGRESS));
+    remote_fd_ = server_.GetUpstreamPool().Acquire(handshake_->remote_addr_);
+    if(remote_fd_ != -1)
+    {
+        LOG(DEBUG) << "POOLED " << inet_ntoa(handshake_->remote_addr_.sin_addr) << ":" << ntohs(handshake_->remote_addr_.sin_port) << " on fd=" << remote_fd_;
+        Record(FlightRecorder::kPooled);
+        remote_watcher_.start(remote_fd_, remote_watch_flag_);
+        OnRemoteConnected();
+        return;
+    }
 
-    remote_watcher_->set<Socks5Session, &Socks5Session::OnRemoteEvent>(this);
-    remote_watcher_->start(remote_fd_, ev::WRITE);
+    handshake_->connect_us_ = Histogram::Now();
+    ConnectNextAddress();
 }
 
-bool Socks5Session::IsRemoteConnected()
+void Socks5Session::ConnectNextAddress()
 {
-    LOG(INFO) << __func__;
-    static int cnt = 1;
-    cnt ++;
-    //assert(cnt < 10);
-    char c;
-
-    int rv = recv(remote_fd_, &c, 1, MSG_PEEK);
-    if(rv == 0)
+    while(handshake_->remote_addr_index_ < handshake_->remote_addrs_.size())
     {
-        LOG(INFO) << __func__ << " rv=0, errno=" << errno << " (" << strerror(errno) << " ) fd=" << remote_fd_;
-        return false;
+        handshake_->remote_addr_.sin_addr = handshake_->remote_addrs_[handshake_->remote_addr_index_++];
+        int err = StartConnect();
+        Record(FlightRecorder::kConnect, handshake_->remote_addr_index_, err);
+        if(err == 0)
+        {
+            ArmTimer(server_.Config().connect_timeout_);
+            remote_watch_flag_ = ev::WRITE;
+            remote_watcher_.start(remote_fd_, remote_watch_flag_);
+            return;
+        }
+        LOG(INFO) << "CONNECT " << inet_ntoa(handshake_->remote_addr_.sin_addr) << ":" << ntohs(handshake_->remote_addr_.sin_port) << " failed, error=" << strerror(err);
+        handshake_->connect_error_ = err;
+        CloseRemote();
     }
-    if(rv == -1 && errno != EAGAIN)
+
+    switch(handshake_->connect_error_)
     {
-        LOG(INFO) << __func__ << " rv=-1, errno=" << errno << " (" << strerror(errno) << " ) fd=" << remote_fd_;
-        return false;
+        case ECONNREFUSED:
+            ReplyConnectFailed(Socks5ReplyField::kConnectionRefused);
+            break;
+        case ENETUNREACH:
+            ReplyConnectFailed(Socks5ReplyField::kNetworkUnreachable);
+            break;
+        case EHOSTUNREACH:
+        case EHOSTDOWN:
+            ReplyConnectFailed(Socks5ReplyField::kHostUnreachable);
+            break;
+        case ETIMEDOUT:
+            ReplyConnectFailed(Socks5ReplyField::kTTLExpired);
+            break;
+        default:
+            ReplyConnectFailed(Socks5ReplyField::kGeneralFailure);
+            break;
     }
-    LOG(INFO) << __func__ << ", remote_connected, fd=" << remote_fd_;
-    return true;
 }
 
-void Socks5Session::OnRemoteConnected()
+int Socks5Session::StartConnect()
 {
-    LOG(INFO) << __func__ << ", peerfd=" << peer_fd_ << ", remotefd=" << remote_fd_;
-    Socks5Reply resp;
-    memset(&resp, 0, sizeof(resp));
-
+    SourceAddressPool& sources = server_.GetSourceAddressPool();
+    if(sources.Empty())
+    {
+        return BindSourceAndConnect();
+    }
+
+    // A source out of ports for this destination fails the connect with
+    // EADDRNOTAVAIL, move on to the next one
+    size_t first = sources.Pick(peer_addr_);
+    int err = EADDRNOTAVAIL;
+    for(size_t i = 0; i < sources.Size() && err == EADDRNOTAVAIL; i++)
+    {
+        remote_source_ = (first + i) % sources.Size();
+        err = BindSourceAndConnect();
+        if(err == EADDRNOTAVAIL)
+        {
+            sources.OnExhausted(remote_source_);
+            close(remote_fd_);
+            remote_fd_ = -1;
+        }
+    }
+    if(err == 0)
+    {
+        sources.Acquire(remote_source_);
+    }
+    else
+    {
+        remote_source_ = -1;
+    }
+    return err;
+}
+
+int Socks5Session::BindSourceAndConnect()
+{
+    remote_fd_ = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK, IPPROTO_TCP);
+    if(remote_fd_ == -1)
+    {
+        return errno;
+    }
+
+    if(remote_source_ != -1 && server_.GetSourceAddressPool().Bind(remote_fd_, remote_source_) == -1)
+    {
+        return errno;
+    }
+
+    LOG(DEBUG) << "CONNECTING " << inet_ntoa(handshake_->remote_addr_.sin_addr) << ":" << ntohs(handshake_->remote_addr_.sin_port) << " on fd=" << remote_fd_;
+    if(server_.Config().tcp_fastopen_ && peer_buffer_.Size() > 0)
+    {
+        // Bytes the client pipelined behind the request ride in the SYN
+        server_.Stats().tfo_attempts_ ++;
+        int ret = peer_buffer_.PeekToSocketFastOpen(remote_fd_, (struct sockaddr*)&handshake_->remote_addr_, sizeof(handshake_->remote_addr_));
+        CountSyscalls(Metrics::kSendCall, 1);
+        if(ret > 0)
+        {
+            handshake_->remote_fastopen_len_ = ret;
+            return 0;
+        }
+        // No cookie for this destination yet (EINPROGRESS, a plain SYN
+        // asking for one is on its way), or TFO is disabled by sysctl
+        server_.Stats().tfo_fallbacks_ ++;
+        if(errno == EINPROGRESS)
+        {
+            return 0;
+        }
+    }
+
+    int ret = ::connect(remote_fd_, (struct sockaddr*)&handshake_->remote_addr_, sizeof(handshake_->remote_addr_));
+    CountSyscalls(Metrics::kConnectCall, 1);
+    if(ret == -1 && errno != EINPROGRESS)
+    {
+        return errno;
+    }
+    return 0;
+}
+
+int Socks5Session::GetRemoteConnectError()
+{
+    int err = 0;
+    socklen_t len = sizeof(err);
+    if(getsockopt(remote_fd_, SOL_SOCKET, SO_ERROR, &err, &len) == -1)
+    {
+        err = errno;
+    }
+    LOG(TRACE) << __func__ << ", fd=" << remote_fd_ << ", error=" << err;
+    return err;
+}
+
+void Socks5Session::OnRemoteConnectFailed(int err)
+{
+    Record(FlightRecorder::kConnectFailed, 0, err);
+    LOG(INFO) << "CONNECT " << inet_ntoa(handshake_->remote_addr_.sin_addr) << ":" << ntohs(handshake_->remote_addr_.sin_port) << " failed, error=" << strerror(err);
+    handshake_->connect_error_ = err;
+    handshake_->remote_fastopen_len_ = 0;
+    timer_.Cancel();
+    CloseRemote();
+    ConnectNextAddress();
+}
+
+void Socks5Session::ArmTimer(ev::tstamp after)
+{
+    if(after > 0)
+    {
+        server_.GetTimerWheel().Arm(timer_, after);
+    }
+    else
+    {
+        timer_.Cancel();
+    }
+}
+
+// When the established timer should look at the tunnel next: at its idle
+// deadline, or sooner while it holds buffers that may have to be released
+ev::tstamp Socks5Session::NextIdleCheck(ev::tstamp idle)
+{
+    ev::tstamp after = server_.Config().idle_timeout_ > 0 ? server_.Config().idle_timeout_ - idle : 0;
+    if(HoldsBuffers())
+    {
+        ev::tstamp linger = idle < kBufferLinger ? kBufferLinger - idle : kBufferLinger;
+        if(after == 0 || linger < after)
+        {
+            after = linger;
+        }
+    }
+    return after;
+}
+
+// Reads allocate again after the timer released the buffers, have it come
+// back for them. held is HoldsBuffers() from before the callback's reads
+void Socks5Session::WatchBuffers(bool held)
+{
+    if(!held && state_ == Socks5SessionState::kEstablished && HoldsBuffers())
+    {
+        ArmTimer(NextIdleCheck(0));
+    }
+}
+
+void Socks5Session::OnTimer()
+{
+    AsyncLog::TraceScope trace(traced_);
+    server_.Activity().Mark(LoopActivity::kTimer, peer_fd_, state_);
+    CountWakeup();
+    LOG(TRACE) << __func__ << ", peerfd=" << peer_fd_ << ", remotefd=" << remote_fd_ << ", state=" << state_;
+    Record(FlightRecorder::kTimeout);
+    switch(state_)
+    {
+        case Socks5SessionState::kIdle:
+        case Socks5SessionState::kHandshaking:
+            LOG(INFO) << "Handshake timeout, peerfd=" << peer_fd_;
+            SetCloseReason(AccessLog::kHandshakeTimeout);
+            Close();
+            break;
+        case Socks5SessionState::kConnecting:
+            OnRemoteConnectFailed(ETIMEDOUT);
+            break;
+        case Socks5SessionState::kEstablished:
+        {
+            // last_active_ is bumped on every event instead of re-arming the
+            // timer each time, so only check how long we have really been idle
+            ev::tstamp idle = ev::now(server_.Loop()) - last_active_;
+            if(server_.Config().idle_timeout_ == 0 || idle < server_.Config().idle_timeout_)
+            {
+                if(idle >= kBufferLinger)
+                {
+                    // Gone quiet, the next read allocates again. A buffer
+                    // still holding bytes stays until they are written
+                    size_t freed = peer_buffer_.Release() + remote_buffer_.Release();
+                    if(freed > 0)
+                    {
+                        server_.OnBuffersReleased(freed);
+                    }
+                }
+                ArmTimer(NextIdleCheck(idle));
+                return;
+            }
+            LOG(INFO) << "Idle timeout, peerfd=" << peer_fd_ << ", remotefd=" << remote_fd_;
+            SetCloseReason(AccessLog::kIdleTimeout);
+            Close();
+            break;
+        }
+        case Socks5SessionState::kClosing:
+            // The client never read the error reply
+            Close();
+            break;
+        case Socks5SessionState::kClosed:
+        default:
+            break;
+    }
+    if(state_ == Socks5SessionState::kClosed)
+    {
+        return;
+    }
+    UpdateWatcher(peer_watcher_, peer_watch_flag_);
+}
+
+void Socks5Session::OnPeerClose()
+{
+    LOG(TRACE) << __func__ << ", peerfd=" << peer_fd_ << ", remotefd=" << remote_fd_;
+    Record(FlightRecorder::kPeerEof);
+    peer_closing_ = true;
+    peer_watch_flag_ &= (~ev::READ);
+    if(state_ == Socks5SessionState::kConnecting)
+    {
+        // Request and early data may be followed by an immediate FIN, it
+        // is passed on behind them once connected
+        return;
+    }
+    if(state_ != Socks5SessionState::kEstablished)
+    {
+        SetCloseReason(AccessLog::kPeerAborted);
+        Close();
+        return;
+    }
+    // The other direction keeps flowing, the FIN is passed on once what is
+    // left for the remote has been written
+    SendPeerDataToRemote();
+}
+
+void Socks5Session::OnRemoteClose()
+{
+    LOG(TRACE) << __func__ << ", peerfd=" << peer_fd_ << ", remotefd=" << remote_fd_;
+    Record(FlightRecorder::kRemoteEof);
+    remote_closing_ = true;
+    remote_watch_flag_ &= (~ev::READ);
+    SendRemoteDataToPeer();
+}
+
+bool Socks5Session::Detach(Socks5HandoffRecord& record)
+{
+    AsyncLog::TraceScope trace(traced_);
+    if(state_ != Socks5SessionState::kEstablished)
+    {
+        return false;
+    }
+    LOG(TRACE) << __func__ << ", peerfd=" << peer_fd_ << ", remotefd=" << remote_fd_;
+    Record(FlightRecorder::kDetach, peer_buffer_.Size() + remote_buffer_.Size());
+    SetState(Socks5SessionState::kClosed);
+    timer_.Cancel();
+    peer_watcher_.stop();
+    remote_watcher_.stop();
+
+    record.peer_fd_ = peer_fd_;
+    record.remote_fd_ = remote_fd_;
+    record.peer_addr_ = peer_addr_;
+    record.start_us_ = start_us_;
+    record.bytes_up_ = bytes_up_;
+    record.bytes_down_ = bytes_down_;
+    record.flags_ = (peer_closing_ ? Socks5HandoffRecord::kPeerClosing : 0)
+                  | (remote_closing_ ? Socks5HandoffRecord::kRemoteClosing : 0)
+                  | (peer_write_shut_ ? Socks5HandoffRecord::kPeerWriteShut : 0)
+                  | (remote_write_shut_ ? Socks5HandoffRecord::kRemoteWriteShut : 0);
+    peer_buffer_.Extract(record.peer_data_, peer_buffer_.Size());
+    remote_buffer_.Extract(record.remote_data_, remote_buffer_.Size());
+    if(access_ != nullptr)
+    {
+        // The record follows the tunnel, it is written once it really closes
+        record.access_ = *access_;
+        server_.GetAccessPool().Destroy(access_);
+        access_ = nullptr;
+    }
+
+    // The fds belong to the record now, destroying the session neither
+    // closes nor shuts them down
+    peer_fd_ = -1;
+    remote_fd_ = -1;
+    return true;
+}
+
+void Socks5Session::ShutdownRemoteWrite()
+{
+    if(!remote_write_shut_)
+    {
+        LOG(TRACE) << __func__ << ", peerfd=" << peer_fd_ << ", remotefd=" << remote_fd_;
+        Record(FlightRecorder::kShutdownRemote);
+        if(remote_fd_ != -1)
+        {
+            shutdown(remote_fd_, SHUT_WR);
+        }
+        remote_write_shut_ = true;
+        remote_watch_flag_ &= (~ev::WRITE);
+    }
+    if(peer_write_shut_)
+    {
+        SetCloseReason(AccessLog::kFinished);
+        Close();
+    }
+}
+
+void Socks5Session::ShutdownPeerWrite()
+{
+    if(!peer_write_shut_)
+    {
+        LOG(TRACE) << __func__ << ", peerfd=" << peer_fd_ << ", remotefd=" << remote_fd_;
+        Record(FlightRecorder::kShutdownPeer);
+        shutdown(peer_fd_, SHUT_WR);
+        peer_write_shut_ = true;
+        peer_watch_flag_ &= (~ev::WRITE);
+    }
+    if(remote_write_shut_)
+    {
+        SetCloseReason(AccessLog::kFinished);
+        Close();
+    }
+}
+
+void Socks5Session::Close()
+{
+    if(state_ == Socks5SessionState::kClosed)
+    {
+        return;
+    }
+    LOG(TRACE) << __func__ << ", peerfd=" << peer_fd_ << ", remotefd=" << remote_fd_;
+    Record(FlightRecorder::kClose, peer_buffer_.Size() + remote_buffer_.Size());
+    SetState(Socks5SessionState::kClosed);
+    timer_.Cancel();
+    peer_watcher_.stop();
+    CloseRemote();
+    // The client sees EOF now. The peer fd itself stays open, and its slot
+    // in the server taken, until the session is reaped after this loop
+    // iteration, we may well be deep inside one of its callbacks
+    shutdown(peer_fd_, SHUT_RDWR);
+    server_.DeferDestroy(peer_fd_);
+}
+
+void Socks5Session::CloseRemote()
+{
+    remote_watcher_.stop();
+    if(remote_fd_ != -1)
+    {
+        close(remote_fd_);
+        remote_fd_ = -1;
+    }
+    if(remote_source_ != -1)
+    {
+        server_.GetSourceAddressPool().Release(remote_source_);
+        remote_source_ = -1;
+    }
+}
+
+void Socks5Session::ReleaseHandshake()
+{
+    if(handshake_ != nullptr)
+    {
+        server_.GetHandshakePool().Destroy(handshake_);
+        handshake_ = nullptr;
+    }
+}
+
+void Socks5Session::ReplyConnectFailed(uint8_t rep)
+{
+    SetCloseReason(AccessLog::kConnectFailed);
+    ReplyFailed(rep);
+}
+
+void Socks5Session::ReplyFailed(uint8_t rep)
+{
+    LOG(DEBUG) << __func__ << ", peerfd=" << peer_fd_ << ", rep=" << (int)rep;
+    Record(FlightRecorder::kReplyFailed, rep);
+    if(!handshake_->reply_sent_)
+    {
+        if(access_ != nullptr)
+        {
+            access_->reply_ = rep;
+        }
+        Socks5Reply resp;
+        resp.ver_ = kSocks5Version;
+        resp.rep_ = rep;
+        resp.rsv_ = kReservedField;
+        resp.atype_ = Socks5AddressingMode::kIpv4;
+        remote_buffer_.Append(&resp, sizeof(resp));
+        remote_buffer_.AppendDWORD(0);
+        remote_buffer_.AppendWORD(0);
+        handshake_->reply_sent_ = true;
+    }
+    CloseAfterReply();
+}
+
+void Socks5Session::CloseAfterReply()
+{
+    // Let the client fail fast, it sees the reply followed by EOF. Nothing
+    // will come from the remote side and nothing the client sends is
+    // looked at anymore, there is no upstream to half-close either: the
+    // session closes as soon as the reply is flushed, or when the client
+    // doesn't take it within the handshake timeout
+    peer_watch_flag_ &= (~ev::READ);
+    SetState(Socks5SessionState::kClosing);
+    ArmTimer(server_.Config().handshake_timeout_);
+    remote_closing_ = true;
+    remote_write_shut_ = true;
+    SendRemoteDataToPeer();
+}
+
+void Socks5Session::CheckFastOpenResult()
+{
+    struct tcp_info info;
+    socklen_t len = sizeof(info);
+    memset(&info, 0, sizeof(info));
+    getsockopt(remote_fd_, IPPROTO_TCP, TCP_INFO, &info, &len);
+    if(info.tcpi_options & TCPI_OPT_SYN_DATA)
+    {
+        server_.Stats().tfo_accepted_ ++;
+    }
+    else
+    {
+        // The destination ignored the SYN data, the kernel resent it after the handshake
+        server_.Stats().tfo_fallbacks_ ++;
+    }
+}
+
+void Socks5Session::OnRemoteConnected()
+{
+    LOG(TRACE) << __func__ << ", peerfd=" << peer_fd_ << ", remotefd=" << remote_fd_;
+    last_active_ = ev::now(server_.Loop());
+    Record(FlightRecorder::kConnected);
+    if(handshake_->connect_us_ != 0)
+    {
+        server_.GetMetrics().AddLatency(Metrics::kConnect, Histogram::Now() - handshake_->connect_us_);
+    }
+    ArmTimer(NextIdleCheck(0));
+    if(handshake_->remote_fastopen_len_ > 0)
+    {
+        CheckFastOpenResult();
+        // The kernel owns these bytes now, whether the SYN carried them or not
+        peer_buffer_.Discard(handshake_->remote_fastopen_len_);
+        handshake_->remote_fastopen_len_ = 0;
+    }
+
+    if(!handshake_->reply_sent_)
+    {
+        ReplyConnectSucceeded();
+    }
+    if(access_ != nullptr)
+    {
+        access_->connect_us_ = Histogram::Now() - start_us_ - request_us_;
+        access_->dst_addr_ = handshake_->remote_addr_.sin_addr.s_addr;
+    }
+
+    SetState(Socks5SessionState::kEstablished);
+    if(!peer_closing_)
+    {
+        peer_watch_flag_ |= ev::READ;
+    }
+    remote_watch_flag_ |= ev::READ;
+
+    ReleaseHandshake();
+
+    // Early data the client sent while we were connecting goes out now
+    // instead of waiting for the next READ event on the peer
+    SendPeerDataToRemote();
+}
+
+void Socks5Session::ReplyConnectSucceeded()
+{
+    Socks5Reply resp;
+    memset(&resp, 0, sizeof(resp));
+
     resp.ver_ = kSocks5Version;
     resp.rep_ = Socks5ReplyField::kSucceeded;
     resp.rsv_ = kReservedField;
@@ -438,116 +1355,314 @@ void Socks5Session::OnRemoteConnected()
     resp.atype_ = Socks5AddressingMode::kIpv4;
     remote_buffer_.Append(&resp, sizeof(resp));
 
-    // remote_buffer_.Append(domain_);
-    remote_buffer_.AppendDWORD(remote_addr_.sin_addr.s_addr);
-    remote_buffer_.AppendWORD(remote_addr_.sin_port);
-
-    state_ = Socks5SessionState::kEstablished;
-    peer_watch_flag_ |= (ev::WRITE | ev::READ);
+    // remote_buffer_.Append(handshake_->domain_);
+    remote_buffer_.AppendDWORD(handshake_->remote_addr_.sin_addr.s_addr);
+    remote_buffer_.AppendWORD(handshake_->remote_addr_.sin_port);
+    handshake_->reply_sent_ = true;
+    reply_us_ = Histogram::Now() - start_us_;
+    if(access_ != nullptr)
+    {
+        access_->reply_ = Socks5ReplyField::kSucceeded;
+    }
+    SendRemoteDataToPeer();
 }
 
 
 void Socks5Session::ReadPeerData()
 {
-    LOG(INFO) << __func__ << ", peerfd=" << peer_fd_ << ", remotefd=" << remote_fd_;
+    LOG(TRACE) << __func__ << ", peerfd=" << peer_fd_ << ", remotefd=" << remote_fd_;
     int ret = 0;
     SendPeerDataToRemote();
-    while((ret == peer_buffer_.AppendFromSocket(peer_fd_, kMaxTrunk)) > 0)
+    size_t budget = kWakeupBudget;
+    size_t before = peer_buffer_.Size();
+    StreamBuffer::SocketCalls calls;
+    while(state_ != Socks5SessionState::kClosed && (ret = peer_buffer_.AppendFromSocket(peer_fd_, kMaxTrunk, calls)) > 0)
     {
-        ret = peer_buffer_.ExtractToSocket(remote_fd_);
-        if(ret == -1 )
+        OnRelayed(peer_buffer_.Size() - before, true, 0);
+        SendPeerDataToRemote();
+        if(peer_buffer_.Size() >= kHighWater && state_ != Socks5SessionState::kClosed)
         {
-            if(errno == EINTR || errno == EAGAIN || errno == EWOULDBLOCK)
-            {
-                remote_watch_flag_ |= ev::WRITE;
-            }
-            else
-            {
-                LOG(FATAL) << "Unexcpected error on remotefd=" << remote_fd_ << ", error=" << strerror(errno);
-                assert(0);
-            }
+            // Same for the upstream, see OnRemoteCanRead
+            CountSyscalls(Metrics::kReadCall, calls.calls_, calls.eagain_);
+            Record(FlightRecorder::kBackpressure, peer_buffer_.Size());
+            return;
         }
+        if(budget <= kMaxTrunk)
+        {
+            CountSyscalls(Metrics::kReadCall, calls.calls_, calls.eagain_);
+            Yield(kYieldPeerRead);
+            return;
+        }
+        budget -= kMaxTrunk;
+        before = peer_buffer_.Size();
+    }
+    int err = errno;
+    CountSyscalls(Metrics::kReadCall, calls.calls_, calls.eagain_);
+    if(state_ == Socks5SessionState::kClosed)
+    {
+        return;
     }
+    OnRelayed(peer_buffer_.Size() - before, true, ret < 0 ? err : 0);
     SendPeerDataToRemote();
+    if(state_ == Socks5SessionState::kClosed)
+    {
+        return;
+    }
 
     if(ret == -1 )
     {
-        if(errno == EINTR || errno == EAGAIN || errno == EWOULDBLOCK)
+        if(err == EINTR || err == EAGAIN || err == EWOULDBLOCK)
         {
             peer_watch_flag_ |= ev::READ;
         }
         else
         {
-            LOG(FATAL) << "Unexcpected error on peerfd=" << peer_fd_ << ", error=" << strerror(errno);
-            assert(0);
+            LOG(INFO) << "Read Error, peerfd=" << peer_fd_ << ", error=" << strerror(err);
+            SetCloseReason(AccessLog::kPeerError);
+            Close();
         }
     }
     else if(ret == 0)
     {
-        // TODO: OnPeerClose
+        OnPeerClose();
     }
 }
 
-void Socks5Session::SendPeerDataToRemote()
+void Socks5Session::FlushPeerDataToRemote()
 {
-    LOG(INFO) << __func__ << ", peerfd=" << peer_fd_ << ", remotefd=" << remote_fd_;
+    LOG(TRACE) << __func__ << ", peerfd=" << peer_fd_ << ", remotefd=" << remote_fd_;
+    size_t before = peer_buffer_.Size();
     int ret = 0;
     do{
         if(peer_buffer_.Size() == 0)
         {
+            if(before > 0)
+            {
+                Record(FlightRecorder::kRemoteWrite, before);
+            }
+            if(peer_closing_)
+            {
+                ShutdownRemoteWrite();
+            }
             return;
         }
-        ret = peer_buffer_.ExtractToSocket(remote_fd_);
+        StreamBuffer::SocketCalls calls;
+        ret = peer_buffer_.ExtractToSocket(remote_fd_, calls);
+        CountSyscalls(Metrics::kWriteCall, calls.calls_, calls.eagain_);
     } while(ret > 0);
 
-    if(ret == -1)
+    Record(FlightRecorder::kRemoteWrite, before - peer_buffer_.Size(), errno);
+    if(ret == -1 && (errno == EINTR || errno == EAGAIN || errno == EWOULDBLOCK))
     {
-        if(errno == EINTR || errno == EAGAIN || errno == EWOULDBLOCK)
-        {
-            remote_watch_flag_ |= ev::WRITE;
-        }
-        else
-        {
-            LOG(FATAL) << "Unexcpected error on remotefd=" << remote_fd_ << ", error=" << strerror(errno);
-            assert(0);
-        }
-
+        remote_watch_flag_ |= ev::WRITE;
     }
-    else if(ret == 0)
+    else
     {
-        LOG(FATAL) << "Unexcpected error on remotefd=" << remote_fd_ << ", error=" << strerror(errno);
-        assert(0);
+        LOG(INFO) << "Write Error, remotefd=" << remote_fd_ << ", error=" << strerror(errno);
+        SetCloseReason(AccessLog::kRemoteError);
+        Close();
     }
 }
 
-void Socks5Session::SendRemoteDataToPeer()
+void Socks5Session::FlushRemoteDataToPeer()
 {
-    LOG(INFO) << __func__ << ", peerfd=" << peer_fd_ << ", remotefd=" << remote_fd_;
+    LOG(TRACE) << __func__ << ", peerfd=" << peer_fd_ << ", remotefd=" << remote_fd_;
+    size_t before = remote_buffer_.Size();
     int ret = 0;
     do{
         if(remote_buffer_.Size() == 0)
         {
+            if(before > 0)
+            {
+                Record(FlightRecorder::kPeerWrite, before);
+            }
+            if(remote_closing_)
+            {
+                ShutdownPeerWrite();
+            }
             return;
         }
-        ret = remote_buffer_.ExtractToSocket(peer_fd_);
+        StreamBuffer::SocketCalls calls;
+        ret = remote_buffer_.ExtractToSocket(peer_fd_, calls);
+        CountSyscalls(Metrics::kWriteCall, calls.calls_, calls.eagain_);
     } while(ret > 0);
 
-    if(ret == -1)
+    Record(FlightRecorder::kPeerWrite, before - remote_buffer_.Size(), errno);
+    if(ret == -1 && (errno == EINTR || errno == EAGAIN || errno == EWOULDBLOCK))
+    {
+        peer_watch_flag_ |= ev::WRITE;
+    }
+    else
     {
-        if(errno == EINTR || errno == EAGAIN || errno == EWOULDBLOCK)
+        LOG(INFO) << "Write Error, peerfd=" << peer_fd_ << ", error=" << strerror(errno);
+        SetCloseReason(AccessLog::kPeerError);
+        Close();
+    }
+}
+
+void Socks5Session::SendPeerDataToRemote()
+{
+    // A full read is moved right away, buffering it gains nothing
+    if(peer_buffer_.Size() >= kMaxTrunk)
+    {
+        FlushPeerDataToRemote();
+        return;
+    }
+    MarkDirty(kDirtyRemote);
+}
+
+void Socks5Session::SendRemoteDataToPeer()
+{
+    if(remote_buffer_.Size() >= kMaxTrunk)
+    {
+        FlushRemoteDataToPeer();
+        return;
+    }
+    MarkDirty(kDirtyPeer);
+}
+
+void Socks5Session::MarkDirty(uint8_t direction)
+{
+    if(state_ == Socks5SessionState::kClosed)
+    {
+        return;
+    }
+    // Whatever else this iteration appends goes out in the same write, the
+    // server calls Flush() right before the loop blocks again
+    if(dirty_ == 0)
+    {
+        server_.ScheduleFlush(this);
+    }
+    dirty_ |= direction;
+}
+
+void Socks5Session::Flush()
+{
+    AsyncLog::TraceScope trace(traced_);
+    server_.Activity().Mark(LoopActivity::kFlush, peer_fd_, state_);
+    PerfScope perf(*this);
+    uint8_t dirty = dirty_;
+    dirty_ = 0;
+    if(state_ == Socks5SessionState::kClosed)
+    {
+        return;
+    }
+    if(dirty & kDirtyPeer)
+    {
+        FlushRemoteDataToPeer();
+    }
+    if((dirty & kDirtyRemote) && state_ != Socks5SessionState::kClosed)
+    {
+        FlushPeerDataToRemote();
+    }
+    if(state_ == Socks5SessionState::kClosed)
+    {
+        return;
+    }
+    UpdateWatchers();
+}
+
+void Socks5Session::DumpFlightRecorder(const char* why)
+{
+    if(flight_ == nullptr)
+    {
+        return;
+    }
+    std::ostringstream out;
+    out << "Flight recorder (" << why << "), peerfd=" << peer_fd_ << ", remotefd=" << remote_fd_
+        << ", client=" << inet_ntoa(peer_addr_.sin_addr) << ":" << ntohs(peer_addr_.sin_port)
+        << ", state=" << StateName(state_) << ", events=" << flight_->Count();
+    for(size_t i = 0; i < flight_->Held(); i++)
+    {
+        const FlightRecorder::Entry& entry = flight_->At(i);
+        out << "\n    +" << entry.when_ms_ << "ms " << FlightRecorder::EventName(entry.event_)
+            << " state=" << StateName(entry.state_);
+        if(entry.bytes_ > 0)
         {
-            peer_watch_flag_ |= ev::WRITE;
+            out << " bytes=" << entry.bytes_;
         }
-        else
+        if(entry.error_ != 0)
         {
-            LOG(FATAL) << "Unexcpected error on peerfd=" << peer_fd_ << ", error=" << strerror(errno);
-            assert(0);
+            out << " error=" << (entry.event_ == FlightRecorder::kResolved ? hstrerror(entry.error_) : strerror(entry.error_));
         }
+    }
+    // Written synchronously, behind whatever was queued: the process may
+    // be about to abort
+    AsyncLog::Flush();
+    CLOG(WARNING, "default") << out.str();
+}
+
+void Socks5Session::DumpAndAbort(const char* why)
+{
+    DumpFlightRecorder(why);
+    assert(0);
+}
+
+static std::string AddressString(const struct sockaddr_in& addr)
+{
+    char buf[INET_ADDRSTRLEN];
+    inet_ntop(AF_INET, &addr.sin_addr, buf, sizeof(buf));
+    return std::string(buf) + ":" + std::to_string(ntohs(addr.sin_port));
+}
 
+std::string Socks5Session::DestinationDomain()
+{
+    if(handshake_ != nullptr)
+    {
+        return handshake_->domain_;
     }
-    else if(ret == 0)
+    if(access_ != nullptr)
+    {
+        return std::string(access_->dst_, access_->dst_len_);
+    }
+    return "";
+}
+
+bool Socks5Session::DestinationAddress(struct sockaddr_in& addr)
+{
+    if(handshake_ != nullptr && handshake_->remote_addr_.sin_family == AF_INET)
+    {
+        addr = handshake_->remote_addr_;
+        return true;
+    }
+    // Established tunnels no longer keep it, the socket does
+    socklen_t len = sizeof(addr);
+    return remote_fd_ != -1 && getpeername(remote_fd_, (struct sockaddr*)&addr, &len) == 0 && addr.sin_family == AF_INET;
+}
+
+void Socks5Session::Describe(std::ostream& out, uint64_t now_us)
+{
+    std::string domain = DestinationDomain();
+    struct sockaddr_in addr;
+    out << server_.Worker() << ":" << peer_fd_ << " " << StateName(state_)
+        << " client=" << AddressString(peer_addr_)
+        << " dst=" << (domain.empty() ? "-" : domain)
+        << " upstream=" << (DestinationAddress(addr) ? AddressString(addr) : "-")
+        << " fds=" << peer_fd_ << "/" << remote_fd_
+        << " up=" << bytes_up_ << " down=" << bytes_down_
+        << " buffered=" << peer_buffer_.Size() << "/" << remote_buffer_.Size()
+        << " age=" << (now_us - start_us_) / 1e6 << "s";
+}
+
+bool Socks5Session::MatchesDestination(const std::string& dst)
+{
+    struct sockaddr_in addr;
+    if(DestinationDomain() == dst)
     {
-        LOG(FATAL) << "Unexcpected error on peerfd=" << peer_fd_ << ", error=" << strerror(errno);
-        assert(0);
+        return true;
     }
+    if(!DestinationAddress(addr))
+    {
+        return false;
+    }
+    std::string upstream = AddressString(addr);
+    return upstream == dst || upstream.compare(0, upstream.rfind(':'), dst) == 0;
+}
+
+void Socks5Session::Kill()
+{
+    AsyncLog::TraceScope trace(traced_);
+    LOG(INFO) << "Killed from the admin socket, peerfd=" << peer_fd_ << ", remotefd=" << remote_fd_;
+    SetCloseReason(AccessLog::kKilled);
+    Close();
 }
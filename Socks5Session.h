@@ -1,6 +1,17 @@
+#pragma once
+
 #include <ev++.h>
+#include <cstring>
 #include <memory>
+#include <string>
+#include <vector>
+#include <netinet/in.h>
+#include "AccessLog.h"
+#include "FlightRecorder.h"
+#include "Histogram.h"
+#include "Metrics.h"
 #include "StreamBuffer.h"
+#include "TimerWheel.h"
 
 class Socks5Server;
 
@@ -70,23 +81,118 @@ struct Socks5Reply
     // bnd port
 };
 
+// Everything only needed until the tunnel is up. Kept out of line and
+// pooled by the server so established sessions, the vast majority at any
+// time, don't carry the request, the domain and the resolved addresses
+struct Socks5HandshakeState
+{
+    Socks5HandshakeState()
+        : domain_len_(0), reply_sent_(false), remote_addr_index_(0), connect_error_(0), remote_fastopen_len_(0),
+          greeting_us_(0), connect_us_(0)
+    {
+        memset(&remote_addr_, 0, sizeof(remote_addr_));
+    }
+    Socks5Request request_;
+    uint8_t domain_len_;
+    bool reply_sent_;
+    std::string domain_;
+
+    struct sockaddr_in remote_addr_;
+    std::vector<struct in_addr> remote_addrs_;
+    size_t remote_addr_index_;
+    int connect_error_;
+    size_t remote_fastopen_len_;
+    // Histogram::Now() at the greeting, and at the first upstream connect
+    // attempt, 0 for a pooled socket
+    uint64_t greeting_us_;
+    uint64_t connect_us_;
+};
+
+// An established tunnel in transit to another process, see HotUpgrade
+struct Socks5HandoffRecord
+{
+    enum Flags
+    {
+        kPeerClosing = 1 << 0,
+        kRemoteClosing = 1 << 1,
+        kPeerWriteShut = 1 << 2,
+        kRemoteWriteShut = 1 << 3,
+    };
+    int peer_fd_;
+    int remote_fd_;
+    struct sockaddr_in peer_addr_;
+    uint32_t flags_;
+    // Read from one side and not yet written to the other
+    std::string peer_data_;
+    std::string remote_data_;
+    // What the access log knows so far, zero when it is off
+    AccessLog::Record access_ = {};
+    // Histogram::Now() at accept
+    uint64_t start_us_ = 0;
+    // Read from the client and from the upstream so far
+    uint64_t bytes_up_ = 0;
+    uint64_t bytes_down_ = 0;
+};
+
 class Socks5Session
 {
-    enum Socks5SessionState
+    enum Socks5SessionState : uint8_t
     {
         kIdle,
         kHandshaking,
+        kConnecting,
         kEstablished,
         kClosing,
+        // Torn down, waiting to be reaped by the server
+        kClosed,
     };
 
     static const uint8_t kSocks5Version = 5;
     static const uint8_t kReservedField = 0;
     static const size_t kMaxTrunk = 65535;
+    // Bytes one readiness callback may move before the session yields to
+    // the rest of the loop, so a bulk transfer can't starve other tunnels
+    static const size_t kWakeupBudget = 4 * kMaxTrunk;
+    // A direction stops reading once this much waits for the other socket,
+    // and reads again when a write drained it below kLowWater
+    static const size_t kHighWater = 2 * kMaxTrunk;
+    static const size_t kLowWater = kMaxTrunk;
+    // How long a tunnel keeps its drained buffers without traffic, a busy
+    // one reads into the same memory instead of allocating per event
+    static const ev::tstamp kBufferLinger;
+    enum YieldDirection : uint8_t
+    {
+        kYieldPeerRead = 1 << 0,
+        kYieldRemoteRead = 1 << 1,
+    };
+    // Which socket has bytes queued for the end-of-iteration flush
+    enum DirtyDirection : uint8_t
+    {
+        kDirtyPeer = 1 << 0,
+        kDirtyRemote = 1 << 1,
+    };
+    static const uint8_t kMethodNoAuth = 0x00;
+    static const uint8_t kMethodNoAcceptable = 0xFF;
 public:
-    Socks5Session(Socks5Server& server, int peer_fd);
+    Socks5Session(Socks5Server& server, int peer_fd, const struct sockaddr_in& peer_addr);
+    // Resumes a tunnel handed over by the process we upgraded from
+    Socks5Session(Socks5Server& server, Socks5HandoffRecord& record);
     ~Socks5Session();
 
+    // Stops serving an established tunnel and fills record for another
+    // process or worker loop to resume it, false when the session is not
+    // established. The fds pass to the record, the caller destroys the
+    // session right away
+    bool Detach(Socks5HandoffRecord& record);
+    // Bytes read from either side so far
+    uint64_t BytesRelayed() const { return bytes_up_ + bytes_down_; }
+    // For the admin socket: one line about this session, and whether dst
+    // names its domain, upstream address or address:port
+    void Describe(std::ostream& out, uint64_t now_us);
+    bool MatchesDestination(const std::string& dst);
+    // Closes the session as if it failed, it is reaped after this iteration
+    void Kill();
+
     void OnPeerEvent(ev::io &watcher, int revents);
     void OnPeerCanRead();
     void OnPeerCanWrite();
@@ -94,10 +200,44 @@ public:
 
     void OnRemoteEvent(ev::io &watcher, int revents);
     void OnRemoteCanRead();
+    void OnFirstRemoteByte();
     void OnRemoteCanWrite();
     void OnRemoteError();
+
+    // Continues the reads that ran out of budget, see Yield()
+    void OnResume();
+    // Writes out what this loop iteration queued, see MarkDirty()
+    void Flush();
+    // Logs the flight recorder right away, on the calling thread
+    void DumpFlightRecorder(const char* why);
+    static const char* StateName(uint8_t state);
 private:
-    void OnHandshakeRequest();
+    class PerfScope;
+
+    // Moves the per-state session gauges along
+    void SetState(Socks5SessionState state);
+    void Yield(uint8_t direction);
+    // Counts bytes read from the client (from_peer) or the upstream, err is
+    // the errno the reads stopped at
+    void OnRelayed(size_t bytes, bool from_peer, int err);
+    // For the loop's metrics, and the access log record when there is one
+    void CountSyscalls(Metrics::Syscall call, uint32_t calls, uint32_t eagain = 0);
+    void CountWakeup();
+    // Applies the watch flags, leaving watchers whose mask is unchanged
+    // alone: set() restarts one and makes libev revisit its epoll entry
+    void UpdateWatcher(ev::io& watcher, uint8_t flag);
+    void UpdateWatchers();
+    void Record(FlightRecorder::Event event, size_t bytes = 0, int err = 0);
+    // Error paths that used to only assert, the recorder goes out first
+    void DumpAndAbort(const char* why);
+    // The first reason given is the one the access log keeps
+    void SetCloseReason(AccessLog::CloseReason reason);
+    // The requested domain and the upstream address, when known. Past the
+    // handshake only the access log record still holds the domain
+    std::string DestinationDomain();
+    bool DestinationAddress(struct sockaddr_in& addr);
+    void WriteAccessRecord();
+    int OnHandshakeRequest();
     void ReadRequest();
     void ReadDstAddr();
     int ReadRequestDomain();
@@ -106,36 +246,94 @@ private:
     void ReplyAtypeNotSupport();
 
     void ConnectRemote();
-    bool IsRemoteConnected();
+    void ConnectNextAddress();
+    int StartConnect();
+    int BindSourceAndConnect();
+    int GetRemoteConnectError();
+    void CheckFastOpenResult();
     void OnRemoteConnected();
+    void OnRemoteConnectFailed(int err);
+    void OnTimer();
+    void ArmTimer(ev::tstamp after);
+    ev::tstamp NextIdleCheck(ev::tstamp idle);
+    bool HoldsBuffers() const { return peer_buffer_.Capacity() > 0 || remote_buffer_.Capacity() > 0; }
+    void WatchBuffers(bool held);
+    void OnPeerClose();
+    void OnRemoteClose();
+    void ShutdownRemoteWrite();
+    void ShutdownPeerWrite();
+    void Close();
+    void CloseRemote();
+    void ReleaseHandshake();
+    void ReplyConnectFailed(uint8_t rep);
+    // Error reply rep, if none went out yet, then EOF and close
+    void ReplyFailed(uint8_t rep);
+    // Stops reading the client and closes once the reply queued for it is out
+    void CloseAfterReply();
+    void ReplyConnectSucceeded();
 
     void ReadPeerData();
-    void SendPeerDataToRemote();
     void ReadRemoteDate();
+    // Queue buffered bytes for the flush at the end of this loop iteration,
+    // small messages and replies arriving together then share one write
+    void SendPeerDataToRemote();
     void SendRemoteDataToPeer();
+    void MarkDirty(uint8_t direction);
+    // Write buffered bytes now
+    void FlushPeerDataToRemote();
+    void FlushRemoteDataToPeer();
 private:
-    Socks5Server& server_;
-    Socks5SessionState state_;
-
-    Socks5Request request_;
-    uint8_t domain_len_;
-    std::string domain_;
-
-    struct sockaddr_in remote_addr_;
-
+    // Hot: touched on every readiness event, kept together at the front
     int peer_fd_;
-    std::shared_ptr<ev::io> peer_watcher_;
-    bool peer_closing_;
-    int peer_watch_flag_;
-
     int remote_fd_;
-    std::shared_ptr<ev::io> remote_watcher_;
+    Socks5SessionState state_;
+    uint8_t peer_watch_flag_;
+    uint8_t remote_watch_flag_;
+    // EOF seen from that side, it is no longer read
+    bool peer_closing_;
     bool remote_closing_;
-    int remote_watch_flag_;
-
-    ev::default_loop loop_;
-
+    // FIN passed on to that side, it is no longer written
+    bool peer_write_shut_;
+    bool remote_write_shut_;
+    // YieldDirection bits waiting in the server's ready queue
+    uint8_t yielded_;
+    // DirtyDirection bits waiting in the server's flush queue
+    uint8_t dirty_;
+    // Sampled at accept, logs TRACE and DEBUG detail while handling events
+    bool traced_;
+    // AccessLog::CloseReason, the first one given wins
+    uint8_t close_reason_;
+    // Sampled at accept, reads the hardware counters around callbacks
+    bool perf_sampled_;
+    // Cold, but fits the padding here: microseconds from start_us_ to the
+    // CONNECT request, 0 once the first upstream byte was timed
+    uint32_t request_us_;
     StreamBuffer peer_buffer_;
     StreamBuffer remote_buffer_;
+    ev::tstamp last_active_;
+    // Read from the client and from the upstream, across migrations and
+    // upgrades
+    uint64_t bytes_up_;
+    uint64_t bytes_down_;
+    Socks5Server& server_;
+
+    ev::io peer_watcher_;
+    ev::io remote_watcher_;
+    // Handshake, connect or idle deadline, depending on state_
+    TimerWheel::Timer timer_;
+    // Recent events, nullptr when the flight recorder is off
+    FlightRecorder* flight_;
+
+    // Cold
+    Socks5HandshakeState* handshake_;
+    // Histogram::Now() at accept, the latencies of later stages are timed
+    // from it
+    uint64_t start_us_;
+    struct sockaddr_in peer_addr_;
+    int remote_source_;
+    // Microseconds from start_us_ to the success reply
+    uint32_t reply_us_;
+    // Filled in as the session goes, nullptr when the access log is off
+    AccessLog::Record* access_;
     // IConnection uladder_connection_;
 };
@@ -0,0 +1,77 @@
+#include <cstring>
+#include <arpa/inet.h>
+#include <sys/socket.h>
+#include "SourceAddressPool.h"
+
+#include "AsyncLog.h"
+
+#ifndef IP_BIND_ADDRESS_NO_PORT
+#define IP_BIND_ADDRESS_NO_PORT 24
+#endif
+
+SourceAddressPool::SourceAddressPool(const std::vector<struct in_addr>& addrs, Policy policy) :
+    policy_(policy),
+    next_(0)
+{
+    for(auto& addr : addrs)
+    {
+        Source source;
+        source.addr_ = addr;
+        source.active_ = 0;
+        source.total_ = 0;
+        source.exhausted_ = 0;
+        sources_.push_back(source);
+    }
+}
+
+size_t SourceAddressPool::Pick(const struct sockaddr_in& client)
+{
+    if(policy_ == kHash)
+    {
+        // Fibonacci hashing of the client address
+        uint32_t hash = ntohl(client.sin_addr.s_addr) * 2654435761u;
+        return hash % sources_.size();
+    }
+    return next_++ % sources_.size();
+}
+
+int SourceAddressPool::Bind(int fd, size_t index)
+{
+    // Defer the ephemeral port choice to connect(), where the kernel can
+    // reuse a port as long as the 4-tuple stays unique. A plain bind() would
+    // reserve the port for every destination at once.
+    int enabled = 1;
+    setsockopt(fd, IPPROTO_IP, IP_BIND_ADDRESS_NO_PORT, &enabled, sizeof(enabled));
+
+    struct sockaddr_in addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr = sources_[index].addr_;
+    addr.sin_port = 0;
+    return bind(fd, (struct sockaddr*)&addr, sizeof(addr));
+}
+
+void SourceAddressPool::Acquire(size_t index)
+{
+    sources_[index].active_ ++;
+    sources_[index].total_ ++;
+}
+
+void SourceAddressPool::OnExhausted(size_t index)
+{
+    sources_[index].exhausted_ ++;
+}
+
+void SourceAddressPool::Release(size_t index)
+{
+    sources_[index].active_ --;
+}
+
+void SourceAddressPool::LogStats()
+{
+    for(auto& source : sources_)
+    {
+        LOG(INFO) << "Source " << inet_ntoa(source.addr_) << ": active=" << source.active_
+                  << ", total=" << source.total_ << ", exhausted=" << source.exhausted_;
+    }
+}
@@ -0,0 +1,47 @@
+#pragma once
+
+#include <cstdint>
+#include <vector>
+#include <netinet/in.h>
+
+// Spreads upstream connects over several local source addresses. Every
+// source IP has its own ephemeral port range towards a given destination,
+// so N sources allow roughly N times more concurrent connections to one
+// backend ip:port.
+class SourceAddressPool
+{
+    struct Source
+    {
+        struct in_addr addr_;
+        uint64_t active_;
+        uint64_t total_;
+        uint64_t exhausted_;
+    };
+public:
+    enum Policy
+    {
+        kRoundRobin,
+        // Same client, same source address
+        kHash,
+    };
+
+    SourceAddressPool(const std::vector<struct in_addr>& addrs, Policy policy);
+
+    bool Empty() const { return sources_.empty(); }
+    size_t Size() const { return sources_.size(); }
+
+    // Index of the first source to try for a client
+    size_t Pick(const struct sockaddr_in& client);
+    // Binds fd to source index without reserving a port yet, returns -1 on error
+    int Bind(int fd, size_t index);
+    // Bookkeeping of the connections holding a port on a source
+    void Acquire(size_t index);
+    void Release(size_t index);
+    void OnExhausted(size_t index);
+
+    void LogStats();
+private:
+    std::vector<Source> sources_;
+    Policy policy_;
+    size_t next_;
+};
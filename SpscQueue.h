@@ -0,0 +1,90 @@
+#pragma once
+
+#include <atomic>
+#include <cstddef>
+#include <utility>
+#include <vector>
+
+// Bounded single-producer single-consumer ring. One thread pushes, one
+// other thread pops, neither ever blocks or takes a lock: each side owns
+// its index and only reads the other's, which sit on separate cache lines
+// so the two threads don't keep stealing each other's line.
+template<class T>
+class SpscQueue
+{
+    static const size_t kCacheLine = 64;
+public:
+    // capacity is rounded up to a power of two
+    explicit SpscQueue(size_t capacity) :
+        slots_(RoundUp(capacity)),
+        mask_(slots_.size() - 1),
+        head_(0),
+        tail_(0)
+    {
+    }
+
+    SpscQueue(const SpscQueue&) = delete;
+    SpscQueue& operator=(const SpscQueue&) = delete;
+
+    // Producer side, false when full and item is left untouched
+    bool Push(T&& item)
+    {
+        size_t tail = tail_.load(std::memory_order_relaxed);
+        if(tail - head_.load(std::memory_order_acquire) == slots_.size())
+        {
+            return false;
+        }
+        slots_[tail & mask_] = std::move(item);
+        tail_.store(tail + 1, std::memory_order_release);
+        return true;
+    }
+
+    bool Push(const T& item)
+    {
+        size_t tail = tail_.load(std::memory_order_relaxed);
+        if(tail - head_.load(std::memory_order_acquire) == slots_.size())
+        {
+            return false;
+        }
+        slots_[tail & mask_] = item;
+        tail_.store(tail + 1, std::memory_order_release);
+        return true;
+    }
+
+    bool Full() const
+    {
+        return tail_.load(std::memory_order_relaxed) - head_.load(std::memory_order_acquire) == slots_.size();
+    }
+
+    // Consumer side, false when empty
+    bool Pop(T& item)
+    {
+        size_t head = head_.load(std::memory_order_relaxed);
+        if(head == tail_.load(std::memory_order_acquire))
+        {
+            return false;
+        }
+        item = std::move(slots_[head & mask_]);
+        head_.store(head + 1, std::memory_order_release);
+        return true;
+    }
+
+    size_t Capacity() const { return slots_.size(); }
+private:
+    static size_t RoundUp(size_t n)
+    {
+        size_t size = 1;
+        while(size < n)
+        {
+            size <<= 1;
+        }
+        return size;
+    }
+private:
+    std::vector<T> slots_;
+    size_t mask_;
+    // Next slot to pop, written by the consumer only
+    alignas(kCacheLine) std::atomic<size_t> head_;
+    // Next slot to push, written by the producer only
+    alignas(kCacheLine) std::atomic<size_t> tail_;
+};
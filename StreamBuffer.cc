@@ -1,16 +1,20 @@
+#include <algorithm>
+#include <cerrno>
 #include <cstdlib>
 #include <cstring>
 #include <unistd.h>
 #include <cassert>
 #include <sys/socket.h>
 #include "StreamBuffer.h"
+#include "Metrics.h"
 
-#include "easylogging++.h"
+#include "AsyncLog.h"
+
+thread_local Metrics* StreamBuffer::metrics_ = nullptr;
 
 StreamBuffer::StreamBuffer() :
-    buffer_((char*)malloc(kInitSize)),
-    capacity_(kInitSize),
-    size_(0),
+    buffer_(nullptr),
+    capacity_(0),
     read_index_(0),
     write_index_(0)
 {
@@ -18,6 +22,10 @@ StreamBuffer::StreamBuffer() :
 
 StreamBuffer::~StreamBuffer()
 {
+    if(capacity_ > 0 && metrics_ != nullptr)
+    {
+        metrics_->AddBuffered(-(int64_t)capacity_);
+    }
     free(buffer_);
 }
 
@@ -26,8 +34,6 @@ int StreamBuffer::Append(const void* buf, size_t len)
     EnsureCapacity(len);
     memcpy(buffer_ + write_index_, buf, len);
     write_index_ += len;
-    size_ += len;
-    capacity_ -= len;
     return len;
 }
 
@@ -59,53 +65,53 @@ int StreamBuffer::AppendQWORD(uint64_t qword)
 int StreamBuffer::Extract(void* buf, size_t len)
 {
     memcpy(buf, buffer_ + read_index_, len);
-    size_ -= len;
     read_index_ += len;
+    Rewind();
     return len;
 }
 
 int StreamBuffer::Extract(std::string& buf, size_t len)
 {
-    void* tmp = malloc(len);
-    int ret = Extract(tmp, len);
-    buf = std::string((char*)tmp, len);
-    free(tmp);
-    return ret;
+    buf.assign(buffer_ + read_index_, len);
+    read_index_ += len;
+    Rewind();
+    return len;
+}
+
+int StreamBuffer::Peek(void* buf, size_t len)
+{
+    memcpy(buf, buffer_ + read_index_, len);
+    return len;
 }
 
-int StreamBuffer::AppendFromSocket(int fd)
+int StreamBuffer::AppendFromSocket(int fd, SocketCalls& calls)
 {
     // LOG(INFO) << __func__ << ", fd=" << fd;
     int totalread = 0;
     int nread = 1;
-    int leftspace = 0;
     while(nread > 0)
     {
-        leftspace = capacity_ - write_index_;
-        if(leftspace < 0)
+        if(capacity_ == write_index_)
         {
-            assert(0);
+            EnsureCapacity(capacity_ > 0 ? capacity_ : kInitSize);
         }
-        else if(leftspace == 0)
-        {
-            Expand(size_);
-        }
-        else
+        nread = read(fd, buffer_ + write_index_, capacity_ - write_index_);
+        calls.calls_ ++;
+        if(nread > 0)
         {
-            nread = read(fd, buffer_ + write_index_, leftspace);
-            if(nread > 0)
-            {
-                totalread += nread;
-                write_index_ += nread;
-                size_ = write_index_ - read_index_;
-            }
+            totalread += nread;
+            write_index_ += nread;
         }
     }
-    LOG(INFO) << __func__ << ", fd=" << fd << ", totalread=" << totalread << ", ret=" << nread;
+    int saved_errno = errno;
+    calls.eagain_ += nread < 0 && (saved_errno == EAGAIN || saved_errno == EWOULDBLOCK);
+    Rewind();
+    LOG(TRACE) << __func__ << ", fd=" << fd << ", totalread=" << totalread << ", ret=" << nread;
+    errno = saved_errno;
     return nread;
 }
 
-int StreamBuffer::AppendFromSocket(int fd, size_t limit)
+int StreamBuffer::AppendFromSocket(int fd, size_t limit, SocketCalls& calls)
 {
     EnsureCapacity(limit);
     int totalread = 0;
@@ -113,59 +119,131 @@ int StreamBuffer::AppendFromSocket(int fd, size_t limit)
     while(nread > 0 && limit > 0)
     {
         nread = read(fd, buffer_ + write_index_, limit);
+        calls.calls_ ++;
         if(nread > 0)
         {
             limit -= nread;
             totalread += nread;
             write_index_ += nread;
-            size_ = write_index_ - read_index_;
         }
     }
-    LOG(INFO) << __func__ << ", fd=" << fd << ", totalread=" << totalread << ", ret=" << nread;
+    int saved_errno = errno;
+    calls.eagain_ += nread < 0 && (saved_errno == EAGAIN || saved_errno == EWOULDBLOCK);
+    Rewind();
+    LOG(TRACE) << __func__ << ", fd=" << fd << ", totalread=" << totalread << ", ret=" << nread;
+    errno = saved_errno;
     return nread;
 }
 
-int StreamBuffer::ExtractToSocket(int fd)
+int StreamBuffer::ExtractToSocket(int fd, SocketCalls& calls)
 {
     int totalwrite = 0;
     int nwrite = 1;
-    while(nwrite > 0 && size_ > 0)
+    while(nwrite > 0 && Size() > 0)
     {
-        nwrite = write(fd, buffer_ + read_index_, size_);
+        nwrite = write(fd, buffer_ + read_index_, Size());
+        calls.calls_ ++;
         if(nwrite > 0)
         {
             totalwrite += nwrite;
             read_index_ += nwrite;
-            size_ = write_index_ - read_index_;
         }
     }
+    int saved_errno = errno;
+    calls.eagain_ += nwrite < 0 && (saved_errno == EAGAIN || saved_errno == EWOULDBLOCK);
+    Rewind();
+    LOG(TRACE) << __func__ << ", fd=" << fd << ", totalwrite=" << totalwrite<< ", ret=" << nwrite;
+    errno = saved_errno;
+    return nwrite;
+}
 
-    LOG(INFO) << __func__ << ", fd=" << fd << ", totalwrite=" << totalwrite<< ", ret=" << nwrite;
+int StreamBuffer::PeekToSocketFastOpen(int fd, const struct sockaddr* addr, socklen_t addrlen)
+{
+    // Connects fd and puts as much of the buffer as fits into the SYN, the
+    // kernel falls back to a plain SYN (EINPROGRESS) without a cookie.
+    // Nothing is consumed: the bytes belong to the connection only once it
+    // is established, see Discard()
+    int nwrite = sendto(fd, buffer_ + read_index_, Size(), MSG_FASTOPEN, addr, addrlen);
+    int saved_errno = errno;
+    LOG(TRACE) << __func__ << ", fd=" << fd << ", ret=" << nwrite;
+    errno = saved_errno;
     return nwrite;
 }
 
+void StreamBuffer::Discard(size_t len)
+{
+    read_index_ += len;
+    Rewind();
+}
+
 size_t StreamBuffer::Size()
 {
-    return size_;
+    return write_index_ - read_index_;
 }
 
 void StreamBuffer::EnsureCapacity(size_t len)
 {
-    if(capacity_ <= len)
+    if(capacity_ - write_index_ >= len)
     {
-        Expand(len);
+        return;
     }
+    if(capacity_ - Size() >= len)
+    {
+        // Enough room once the consumed prefix is dropped
+        size_t size = Size();
+        memmove(buffer_, buffer_ + read_index_, size);
+        read_index_ = 0;
+        write_index_ = size;
+        return;
+    }
+    Expand(len);
 }
 
 void StreamBuffer::Expand(size_t len)
 {
-    char* newbuf = (char*)malloc(size_ + capacity_ + len);
-    memcpy(newbuf, buffer_, size_);
+    size_t size = Size();
+    size_t capacity = std::max(std::max((size_t)kInitSize, (size_t)capacity_ * 2), size + len);
+    char* newbuf = (char*)malloc(capacity);
+    assert(newbuf != nullptr);
+    if(size > 0)
+    {
+        memcpy(newbuf, buffer_ + read_index_, size);
+    }
+    free(buffer_);
+    if(metrics_ != nullptr)
+    {
+        metrics_->AddBuffered(capacity - capacity_);
+    }
+    buffer_ = newbuf;
+    capacity_ = capacity;
     read_index_ = 0;
-    write_index_ = size_;
-    capacity_ = capacity_ + len;
+    write_index_ = size;
+}
+
+void StreamBuffer::Rewind()
+{
+    if(read_index_ == write_index_)
+    {
+        read_index_ = 0;
+        write_index_ = 0;
+    }
 }
 
-void StreamBuffer::Shrink()
+size_t StreamBuffer::Release()
 {
+    if(read_index_ != write_index_)
+    {
+        return 0;
+    }
+    size_t freed = capacity_;
+    free(buffer_);
+    if(metrics_ != nullptr)
+    {
+        metrics_->AddBuffered(-(int64_t)capacity_);
+    }
+    buffer_ = nullptr;
+    capacity_ = 0;
+    read_index_ = 0;
+    write_index_ = 0;
+    return freed;
 }
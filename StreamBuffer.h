@@ -1,9 +1,27 @@
+#pragma once
+
+#include <cstdint>
 #include <string>
+#include <sys/socket.h>
+
+class Metrics;
 
+// The buffer is allocated on the first append and kept when drained, so a
+// busy session reads into the same memory event after event. The owner
+// hands it back with Release() once the session has gone quiet, an idle
+// session then costs sizeof(StreamBuffer) and nothing on the heap
 class StreamBuffer
 {
-    static const size_t kInitSize = 102400;
+    static const size_t kInitSize = 4096;
 public:
+    // Syscalls one socket transfer made, and how many of them came back
+    // with EAGAIN
+    struct SocketCalls
+    {
+        uint32_t calls_ = 0;
+        uint32_t eagain_ = 0;
+    };
+
     StreamBuffer();
     ~StreamBuffer();
     int Append(const void* buf, size_t len);
@@ -15,19 +33,33 @@ public:
 
     int Extract(void* buf, size_t len);
     int Extract(std::string& buf, size_t len);
+    int Peek(void* buf, size_t len);
 
-    int AppendFromSocket(int fd);
-    int AppendFromSocket(int fd, size_t limit);
-    int ExtractToSocket(int fd);
+    int AppendFromSocket(int fd, SocketCalls& calls);
+    int AppendFromSocket(int fd, size_t limit, SocketCalls& calls);
+    int ExtractToSocket(int fd, SocketCalls& calls);
+    int PeekToSocketFastOpen(int fd, const struct sockaddr* addr, socklen_t addrlen);
+    void Discard(size_t len);
     size_t Size();
+    // Heap bytes held, live or not
+    size_t Capacity() const { return capacity_; }
+    // Frees the memory if no bytes are left in it, returns the bytes freed
+    size_t Release();
+
+    // Buffers allocated and freed on this thread count into metrics from
+    // now on, a worker loop sets its own before it runs
+    static void AccountTo(Metrics* metrics) { metrics_ = metrics; }
 private:
     void EnsureCapacity(size_t len);
     void Expand(size_t len);
-    void Shrink();
+    // Drained: start over at the front instead of compacting later
+    void Rewind();
 private:
     char* buffer_;
-    size_t capacity_;
-    size_t size_;
-    size_t read_index_;
-    size_t write_index_;
+    // Allocated bytes, live data is [read_index_, write_index_)
+    uint32_t capacity_;
+    uint32_t read_index_;
+    uint32_t write_index_;
+
+    static thread_local Metrics* metrics_;
 };
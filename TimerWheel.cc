@@ -0,0 +1,215 @@
+#include <cmath>
+#include "TimerWheel.h"
+
+const ev::tstamp TimerWheel::kDefaultTick = 0.1;
+
+TimerWheel::Timer::Timer() :
+    wheel_(nullptr),
+    prev_(nullptr),
+    next_(nullptr),
+    expire_tick_(0),
+    cb_(nullptr),
+    data_(nullptr)
+{
+}
+
+TimerWheel::Timer::~Timer()
+{
+    Cancel();
+}
+
+void TimerWheel::Timer::Cancel()
+{
+    if(wheel_ != nullptr)
+    {
+        wheel_->Cancel(*this);
+    }
+}
+
+TimerWheel::TimerWheel(struct ev_loop* loop, ev::tstamp tick) :
+    tick_(tick),
+    start_time_(0),
+    current_tick_(0),
+    armed_(0),
+    slots_(kLevels * kSlots),
+    loop_(loop),
+    tick_timer_(loop)
+{
+    start_time_ = ev::now(loop_);
+    for(auto& slot : slots_)
+    {
+        InitList(slot);
+    }
+    tick_timer_.set<TimerWheel, &TimerWheel::OnTick>(this);
+}
+
+TimerWheel::~TimerWheel()
+{
+    tick_timer_.stop();
+    for(auto& slot : slots_)
+    {
+        while(slot.next_ != &slot)
+        {
+            Timer* timer = slot.next_;
+            Unlink(*timer);
+            timer->wheel_ = nullptr;
+        }
+    }
+}
+
+void TimerWheel::InitList(Timer& head)
+{
+    head.prev_ = &head;
+    head.next_ = &head;
+}
+
+void TimerWheel::LinkBefore(Timer& head, Timer& timer)
+{
+    timer.prev_ = head.prev_;
+    timer.next_ = &head;
+    head.prev_->next_ = &timer;
+    head.prev_ = &timer;
+}
+
+void TimerWheel::Unlink(Timer& timer)
+{
+    timer.prev_->next_ = timer.next_;
+    timer.next_->prev_ = timer.prev_;
+    timer.prev_ = nullptr;
+    timer.next_ = nullptr;
+}
+
+void TimerWheel::MoveList(Timer& from, Timer& to)
+{
+    InitList(to);
+    if(from.next_ != &from)
+    {
+        to.next_ = from.next_;
+        to.prev_ = from.prev_;
+        to.next_->prev_ = &to;
+        to.prev_->next_ = &to;
+        InitList(from);
+    }
+}
+
+uint64_t TimerWheel::TickOf(ev::tstamp time) const
+{
+    return (uint64_t)floor((time - start_time_) / tick_);
+}
+
+void TimerWheel::Arm(Timer& timer, ev::tstamp after)
+{
+    if(timer.wheel_ != nullptr)
+    {
+        Cancel(timer);
+    }
+
+    if(armed_ == 0)
+    {
+        // The tick is stopped while nothing is armed, catch up with the clock
+        current_tick_ = TickOf(ev::now(loop_));
+        tick_timer_.start(tick_, tick_);
+    }
+
+    // Round up so a timer never fires early
+    uint64_t expire = (uint64_t)ceil((ev::now(loop_) + after - start_time_) / tick_);
+    if(expire < current_tick_)
+    {
+        expire = current_tick_;
+    }
+
+    timer.wheel_ = this;
+    timer.expire_tick_ = expire;
+    Link(timer);
+    armed_ ++;
+}
+
+void TimerWheel::Link(Timer& timer)
+{
+    uint64_t expire = timer.expire_tick_;
+    uint64_t delta = expire > current_tick_ ? expire - current_tick_ : 0;
+    if(delta > kMaxDelta)
+    {
+        // Parked at the far end of the wheel, it is re-linked when it gets there
+        expire = current_tick_ + kMaxDelta;
+        delta = kMaxDelta;
+    }
+
+    int level = 0;
+    while(level < kLevels - 1 && delta >= (1ull << (kSlotBits * (level + 1))))
+    {
+        level ++;
+    }
+    LinkBefore(Slot(level, (expire >> (kSlotBits * level)) & kSlotMask), timer);
+}
+
+void TimerWheel::Cascade(int level, size_t index)
+{
+    Timer cascading;
+    MoveList(Slot(level, index), cascading);
+    while(cascading.next_ != &cascading)
+    {
+        Timer* timer = cascading.next_;
+        Unlink(*timer);
+        Link(*timer);
+    }
+}
+
+void TimerWheel::Cancel(Timer& timer)
+{
+    if(timer.wheel_ != this)
+    {
+        return;
+    }
+    Unlink(timer);
+    timer.wheel_ = nullptr;
+    armed_ --;
+}
+
+void TimerWheel::OnTick(ev::timer& watcher, int revents)
+{
+    uint64_t target = TickOf(ev::now(loop_));
+    while(current_tick_ <= target && armed_ > 0)
+    {
+        size_t index = current_tick_ & kSlotMask;
+        if(index == 0)
+        {
+            // Level 0 wrapped, pull the next span down from the upper levels
+            for(int level = 1; level < kLevels; level++)
+            {
+                size_t upper = (current_tick_ >> (kSlotBits * level)) & kSlotMask;
+                Cascade(level, upper);
+                if(upper != 0)
+                {
+                    break;
+                }
+            }
+        }
+
+        // Move the slot aside first: callbacks may arm or cancel any timer,
+        // including the ones still waiting in this slot
+        Timer expiring;
+        MoveList(Slot(0, index), expiring);
+        uint64_t tick = current_tick_ ++;
+
+        while(expiring.next_ != &expiring)
+        {
+            Timer* timer = expiring.next_;
+            Unlink(*timer);
+            if(timer->expire_tick_ > tick)
+            {
+                // Was parked beyond the reach of the wheel
+                Link(*timer);
+                continue;
+            }
+            timer->wheel_ = nullptr;
+            armed_ --;
+            timer->cb_(timer->data_);
+        }
+    }
+
+    if(armed_ == 0)
+    {
+        tick_timer_.stop();
+    }
+}
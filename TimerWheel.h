@@ -0,0 +1,85 @@
+#pragma once
+
+#include <cstdint>
+#include <vector>
+#include <ev++.h>
+
+// Hierarchical timing wheel driven by a single ev::timer tick. Arming or
+// cancelling a deadline is O(1) and costs no libev watcher, so every
+// session can carry its own timers. Level 0 resolves single ticks, each
+// further level covers 256 times the span of the one below and cascades
+// its timers down when the lower level wraps around.
+class TimerWheel
+{
+    static const int kLevels = 4;
+    static const int kSlotBits = 8;
+    static const size_t kSlots = 1 << kSlotBits;
+    static const uint64_t kSlotMask = kSlots - 1;
+    static const uint64_t kMaxDelta = (1ull << (kLevels * kSlotBits)) - 1;
+public:
+    static const ev::tstamp kDefaultTick;
+
+    class Timer
+    {
+        friend class TimerWheel;
+    public:
+        Timer();
+        ~Timer();
+        Timer(const Timer&) = delete;
+        Timer& operator=(const Timer&) = delete;
+
+        template<class K, void (K::*method)()>
+        void set(K* object)
+        {
+            cb_ = &Thunk<K, method>;
+            data_ = object;
+        }
+        bool IsArmed() const { return wheel_ != nullptr; }
+        void Cancel();
+    private:
+        template<class K, void (K::*method)()>
+        static void Thunk(void* object)
+        {
+            (static_cast<K*>(object)->*method)();
+        }
+    private:
+        TimerWheel* wheel_;
+        Timer* prev_;
+        Timer* next_;
+        uint64_t expire_tick_;
+        void (*cb_)(void*);
+        void* data_;
+    };
+
+    TimerWheel(struct ev_loop* loop, ev::tstamp tick = kDefaultTick);
+    ~TimerWheel();
+
+    // (Re)arms timer to fire after the given number of seconds
+    void Arm(Timer& timer, ev::tstamp after);
+    void Cancel(Timer& timer);
+    size_t Size() const { return armed_; }
+private:
+    uint64_t TickOf(ev::tstamp time) const;
+    static void InitList(Timer& head);
+    static void LinkBefore(Timer& head, Timer& timer);
+    static void Unlink(Timer& timer);
+    static void MoveList(Timer& from, Timer& to);
+
+    Timer& Slot(int level, size_t index) { return slots_[level * kSlots + index]; }
+    void Link(Timer& timer);
+    void Cascade(int level, size_t index);
+
+    void OnTick(ev::timer& watcher, int revents);
+private:
+    ev::tstamp tick_;
+    ev::tstamp start_time_;
+    // Next tick to be processed
+    uint64_t current_tick_;
+    size_t armed_;
+
+    // kLevels * kSlots sentinels, each heads a circular list of armed timers
+    std::vector<Timer> slots_;
+
+    ev::loop_ref loop_;
+    ev::timer tick_timer_;
+};
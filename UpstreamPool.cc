@@ -0,0 +1,252 @@
+#include <cerrno>
+#include <cstring>
+#include <unistd.h>
+#include <fcntl.h>
+#include <arpa/inet.h>
+#include <sys/socket.h>
+#include "UpstreamPool.h"
+
+#include "AsyncLog.h"
+
+const ev::tstamp UpstreamPool::kMaintenanceInterval = 1.0;
+
+UpstreamPool::UpstreamPool(struct ev_loop* loop, size_t size, ev::tstamp idle_timeout, Metrics& metrics) :
+    size_(size),
+    idle_timeout_(idle_timeout),
+    loop_(loop),
+    maintenance_timer_(loop),
+    metrics_(metrics),
+    hits_(0),
+    misses_(0),
+    stale_(0),
+    expired_(0),
+    connect_failed_(0),
+    saved_connect_time_(0)
+{
+    maintenance_timer_.set<UpstreamPool, &UpstreamPool::OnMaintenance>(this);
+}
+
+UpstreamPool::~UpstreamPool()
+{
+    maintenance_timer_.stop();
+    for(auto& it : connecting_)
+    {
+        it.second.watcher_->stop();
+        close(it.first);
+    }
+    for(auto& it : dests_)
+    {
+        for(auto& idle : it.second.idle_)
+        {
+            close(idle.fd_);
+        }
+    }
+}
+
+uint64_t UpstreamPool::Key(const struct sockaddr_in& addr)
+{
+    return ((uint64_t)addr.sin_addr.s_addr << 16) | addr.sin_port;
+}
+
+bool UpstreamPool::IsAlive(int fd)
+{
+    // A healthy idle socket has nothing to read; EOF or a pending error
+    // means the upstream dropped it while it sat in the pool
+    char c;
+    int rv = recv(fd, &c, 1, MSG_PEEK | MSG_DONTWAIT);
+    if(rv == 0)
+    {
+        return false;
+    }
+    if(rv == -1 && errno != EAGAIN && errno != EWOULDBLOCK)
+    {
+        return false;
+    }
+    return true;
+}
+
+void UpstreamPool::AddDestination(const struct sockaddr_in& addr)
+{
+    if(size_ == 0)
+    {
+        return;
+    }
+    Destination& dest = dests_[Key(addr)];
+    dest.addr_ = addr;
+    dest.connecting_ = 0;
+    LOG(INFO) << "Upstream pool destination " << inet_ntoa(addr.sin_addr) << ":" << ntohs(addr.sin_port) << ", size=" << size_;
+
+    Refill(dest);
+    if(!maintenance_timer_.is_active())
+    {
+        maintenance_timer_.start(kMaintenanceInterval, kMaintenanceInterval);
+    }
+}
+
+int UpstreamPool::Acquire(const struct sockaddr_in& addr)
+{
+    auto it = dests_.find(Key(addr));
+    if(it == dests_.end())
+    {
+        return -1;
+    }
+
+    Destination& dest = it->second;
+    int fd = -1;
+    while(!dest.idle_.empty())
+    {
+        // Most recently connected first, it is the least likely to be stale
+        IdleSocket idle = dest.idle_.back();
+        dest.idle_.pop_back();
+        metrics_.AddSyscalls(Metrics::kRecvCall, 1);
+        if(IsAlive(idle.fd_))
+        {
+            fd = idle.fd_;
+            saved_connect_time_ += idle.connect_time_;
+            break;
+        }
+        stale_ ++;
+        close(idle.fd_);
+    }
+
+    if(fd == -1)
+    {
+        misses_ ++;
+    }
+    else
+    {
+        hits_ ++;
+    }
+    Refill(dest);
+    return fd;
+}
+
+void UpstreamPool::Refill(Destination& dest)
+{
+    while(dest.idle_.size() + dest.connecting_ < size_)
+    {
+        size_t before = dest.connecting_;
+        Connect(dest);
+        if(dest.connecting_ == before)
+        {
+            // Could not even start a connect, retry on next maintenance tick
+            break;
+        }
+    }
+}
+
+void UpstreamPool::Connect(Destination& dest)
+{
+    int fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK, IPPROTO_TCP);
+    if(fd == -1)
+    {
+        LOG(INFO) << "Upstream pool socket failed, error=" << strerror(errno);
+        return;
+    }
+
+    int ret = ::connect(fd, (struct sockaddr*)&dest.addr_, sizeof(dest.addr_));
+    metrics_.AddSyscalls(Metrics::kConnectCall, 1);
+    if(ret == -1 && errno != EINPROGRESS)
+    {
+        LOG(INFO) << "Upstream pool connect failed, error=" << strerror(errno);
+        connect_failed_ ++;
+        close(fd);
+        return;
+    }
+
+    PendingConnect& pending = connecting_[fd];
+    pending.watcher_ = std::make_shared<ev::io>(loop_);
+    pending.key_ = Key(dest.addr_);
+    pending.started_ = ev::now(loop_);
+    pending.watcher_->set<UpstreamPool, &UpstreamPool::OnConnectEvent>(this);
+    pending.watcher_->start(fd, ev::WRITE);
+    dest.connecting_ ++;
+}
+
+void UpstreamPool::OnConnectEvent(ev::io& watcher, int revents)
+{
+    int fd = watcher.fd;
+    auto it = connecting_.find(fd);
+    if(it == connecting_.end())
+    {
+        watcher.stop();
+        return;
+    }
+
+    // Keep the watcher alive until we are out of its callback
+    std::shared_ptr<ev::io> holder = it->second.watcher_;
+    uint64_t key = it->second.key_;
+    ev::tstamp started = it->second.started_;
+    holder->stop();
+    connecting_.erase(it);
+
+    int err = 0;
+    socklen_t len = sizeof(err);
+    if(getsockopt(fd, SOL_SOCKET, SO_ERROR, &err, &len) == -1)
+    {
+        err = errno;
+    }
+
+    auto dit = dests_.find(key);
+    if(dit == dests_.end())
+    {
+        close(fd);
+        return;
+    }
+
+    Destination& dest = dit->second;
+    dest.connecting_ --;
+    if(err != 0)
+    {
+        LOG(INFO) << "Upstream pool connect to " << inet_ntoa(dest.addr_.sin_addr) << ":" << ntohs(dest.addr_.sin_port)
+                  << " failed, error=" << strerror(err);
+        connect_failed_ ++;
+        close(fd);
+        // Leave the slot empty, the maintenance tick retries later instead
+        // of hammering a destination that refuses us
+        return;
+    }
+
+    IdleSocket idle;
+    idle.fd_ = fd;
+    idle.since_ = ev::now(loop_);
+    idle.connect_time_ = idle.since_ - started;
+    dest.idle_.push_back(idle);
+}
+
+void UpstreamPool::OnMaintenance(ev::timer& watcher, int revents)
+{
+    ev::tstamp now = ev::now(loop_);
+    for(auto& it : dests_)
+    {
+        Destination& dest = it.second;
+        // Oldest sockets sit at the front
+        while(!dest.idle_.empty() && now - dest.idle_.front().since_ > idle_timeout_)
+        {
+            close(dest.idle_.front().fd_);
+            dest.idle_.pop_front();
+            expired_ ++;
+        }
+        Refill(dest);
+    }
+}
+
+void UpstreamPool::LogStats()
+{
+    if(dests_.empty())
+    {
+        return;
+    }
+
+    size_t idle = 0;
+    for(auto& it : dests_)
+    {
+        idle += it.second.idle_.size();
+    }
+    uint64_t total = hits_ + misses_;
+    LOG(INFO) << "Upstream pool: destinations=" << dests_.size() << ", idle=" << idle << ", connecting=" << connecting_.size()
+              << ", hits=" << hits_ << ", misses=" << misses_
+              << ", hit_rate=" << (total ? (double)hits_ * 100 / total : 0) << "%"
+              << ", stale=" << stale_ << ", expired=" << expired_ << ", connect_failed=" << connect_failed_
+              << ", saved_connect_time=" << saved_connect_time_ * 1000 << "ms";
+}
@@ -0,0 +1,71 @@
+#pragma once
+
+#include <cstdint>
+#include <deque>
+#include <memory>
+#include <unordered_map>
+#include <ev++.h>
+#include <netinet/in.h>
+#include "Metrics.h"
+
+// Keeps a few idle, already connected upstream sockets for hot destinations
+// so a SOCKS CONNECT to them can skip the TCP handshake.
+class UpstreamPool
+{
+    struct IdleSocket
+    {
+        int fd_;
+        ev::tstamp since_;
+        ev::tstamp connect_time_;
+    };
+
+    struct Destination
+    {
+        struct sockaddr_in addr_;
+        std::deque<IdleSocket> idle_;
+        size_t connecting_;
+    };
+
+    struct PendingConnect
+    {
+        std::shared_ptr<ev::io> watcher_;
+        uint64_t key_;
+        ev::tstamp started_;
+    };
+
+    static const ev::tstamp kMaintenanceInterval;
+public:
+    // Counts its probes and connects into metrics
+    UpstreamPool(struct ev_loop* loop, size_t size, ev::tstamp idle_timeout, Metrics& metrics);
+    ~UpstreamPool();
+
+    void AddDestination(const struct sockaddr_in& addr);
+    // Returns a connected socket to addr, or -1 when none is available
+    int Acquire(const struct sockaddr_in& addr);
+    void LogStats();
+private:
+    static uint64_t Key(const struct sockaddr_in& addr);
+    static bool IsAlive(int fd);
+
+    void Refill(Destination& dest);
+    void Connect(Destination& dest);
+    void OnConnectEvent(ev::io& watcher, int revents);
+    void OnMaintenance(ev::timer& watcher, int revents);
+private:
+    size_t size_;
+    ev::tstamp idle_timeout_;
+
+    std::unordered_map<uint64_t, Destination> dests_;
+    std::unordered_map<int, PendingConnect> connecting_;
+
+    ev::loop_ref loop_;
+    ev::timer maintenance_timer_;
+    Metrics& metrics_;
+
+    uint64_t hits_;
+    uint64_t misses_;
+    uint64_t stale_;
+    uint64_t expired_;
+    uint64_t connect_failed_;
+    ev::tstamp saved_connect_time_;
+};
@@ -0,0 +1,77 @@
+#include <algorithm>
+#include <chrono>
+#include "Watchdog.h"
+#include "AsyncLog.h"
+#include "Socks5Session.h"
+
+Watchdog::Watchdog() :
+    threshold_ms_(0),
+    stopping_(false)
+{
+}
+
+Watchdog::~Watchdog()
+{
+    Stop();
+}
+
+void Watchdog::Start(const std::vector<const LoopActivity*>& loops, uint32_t threshold_ms)
+{
+    loops_ = loops;
+    threshold_ms_ = threshold_ms;
+    stopping_ = false;
+    thread_ = std::thread(&Watchdog::Run, this);
+}
+
+void Watchdog::Stop()
+{
+    if(!thread_.joinable())
+    {
+        return;
+    }
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        stopping_ = true;
+    }
+    wake_.notify_one();
+    thread_.join();
+}
+
+void Watchdog::Run()
+{
+    // A loop whose word is the same on n looks in a row has been on that
+    // one site for at least n - 1 ticks
+    uint32_t tick_ms = std::max<uint32_t>(threshold_ms_ / 2, 1);
+    uint32_t stall_ticks = (threshold_ms_ + tick_ms - 1) / tick_ms;
+    std::vector<uint64_t> last(loops_.size(), 0);
+    std::vector<uint32_t> unchanged(loops_.size(), 0);
+    std::unique_lock<std::mutex> lock(mutex_);
+    while(!wake_.wait_for(lock, std::chrono::milliseconds(tick_ms), [this] { return stopping_; }))
+    {
+        for(size_t i = 0; i < loops_.size(); i++)
+        {
+            uint64_t word = loops_[i]->Load();
+            if(word != last[i] || LoopActivity::SiteOf(word) == LoopActivity::kIdle)
+            {
+                last[i] = word;
+                unchanged[i] = 0;
+                continue;
+            }
+            // Once per stall, the loop logs how long it took when it is back
+            if(++unchanged[i] == stall_ticks)
+            {
+                LoopActivity::Site site = LoopActivity::SiteOf(word);
+                int fd = LoopActivity::FdOf(word);
+                if(fd == -1)
+                {
+                    LOG(WARNING) << "Worker " << i << " stuck for over " << threshold_ms_ << "ms in " << LoopActivity::SiteName(site);
+                }
+                else
+                {
+                    LOG(WARNING) << "Worker " << i << " stuck for over " << threshold_ms_ << "ms in " << LoopActivity::SiteName(site)
+                                 << ", peerfd=" << fd << ", state=" << Socks5Session::StateName(LoopActivity::StateOf(word));
+                }
+            }
+        }
+    }
+}
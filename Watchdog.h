@@ -0,0 +1,88 @@
+#pragma once
+
+#include <atomic>
+#include <condition_variable>
+#include <cstdint>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+// Names what a worker loop is busy with, so a stall can be pinned on the
+// code path that caused it. The loop only stores one word per callback, no
+// clock read, no lock; a watchdog thread looks at every loop's word a few
+// times per threshold and logs the loop whose word stopped changing, while
+// it is still stuck. See --stall-threshold.
+class LoopActivity
+{
+public:
+    enum Site : uint8_t
+    {
+        // Blocked in epoll_wait, never a stall
+        kIdle,
+        // Back from epoll_wait, in libev or a callback that isn't marked
+        kLoop,
+        kAccept,
+        kAsync,
+        kReap,
+        kStats,
+        kPeerEvent,
+        kRemoteEvent,
+        kResume,
+        kFlush,
+        kTimer,
+        // The blocking lookup of a requested domain
+        kResolve,
+        kSiteCount,
+    };
+
+    LoopActivity() : word_(0), seq_(0) {}
+
+    // Owning loop only. fd and state are the session's, -1 and 0 outside
+    // of one
+    void Mark(Site site, int fd = -1, uint8_t state = 0)
+    {
+        seq_ ++;
+        word_.store((uint64_t)seq_ << 48 | (uint64_t)site << 40 | (uint64_t)state << 32 | (uint32_t)fd, std::memory_order_relaxed);
+    }
+
+    // Any thread
+    uint64_t Load() const { return word_.load(std::memory_order_relaxed); }
+    static Site SiteOf(uint64_t word) { return (Site)(word >> 40 & 0xff); }
+    static uint8_t StateOf(uint64_t word) { return word >> 32 & 0xff; }
+    static int FdOf(uint64_t word) { return (int)(uint32_t)word; }
+    static const char* SiteName(uint8_t site)
+    {
+        static const char* const kNames[kSiteCount] = {
+            "idle", "loop", "accept", "async", "reap", "stats",
+            "OnPeerEvent", "OnRemoteEvent", "OnResume", "Flush", "OnTimer", "resolve",
+        };
+        return site < kSiteCount ? kNames[site] : "unknown";
+    }
+private:
+    std::atomic<uint64_t> word_;
+    // Tells two marks of the same site apart
+    uint16_t seq_;
+};
+
+// The thread checking the loops, started before and stopped after them
+class Watchdog
+{
+public:
+    Watchdog();
+    ~Watchdog();
+
+    // One per worker loop, in worker order. threshold_ms is the stall
+    // reported, detected within 1.5 times that
+    void Start(const std::vector<const LoopActivity*>& loops, uint32_t threshold_ms);
+    void Stop();
+private:
+    void Run();
+private:
+    std::vector<const LoopActivity*> loops_;
+    uint32_t threshold_ms_;
+    std::thread thread_;
+    std::mutex mutex_;
+    std::condition_variable wake_;
+    bool stopping_;
+};
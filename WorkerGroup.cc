@@ -0,0 +1,107 @@
+#include <sstream>
+#include "WorkerGroup.h"
+#include "AsyncLog.h"
+
+const double WorkerGroup::kMinImbalance = 0.1;
+
+WorkerGroup::WorkerGroup(const Socks5Config& config) :
+    config_(config)
+{
+    std::vector<Socks5Server*> peers;
+    for(size_t i = 0; i < config_.workers_; i++)
+    {
+        struct ev_loop* loop = ev::get_default_loop();
+        if(i > 0)
+        {
+            loops_.emplace_back(new ev::dynamic_loop());
+            loop = *loops_.back();
+        }
+        workers_.emplace_back(new Socks5Server(config_, loop, i));
+        peers.push_back(workers_.back().get());
+    }
+    for(auto& worker : workers_)
+    {
+        worker->SetPeers(peers);
+    }
+
+    if(config_.workers_ > 1 && config_.rebalance_interval_ > 0)
+    {
+        balance_timer_.set<WorkerGroup, &WorkerGroup::OnBalanceTimer>(this);
+        balance_timer_.start(config_.rebalance_interval_, config_.rebalance_interval_);
+    }
+}
+
+WorkerGroup::~WorkerGroup()
+{
+    // Worker 0 already returned from Run() on this thread
+    watchdog_.Stop();
+    for(size_t i = 1; i < workers_.size(); i++)
+    {
+        workers_[i]->Stop();
+    }
+    for(auto& thread : threads_)
+    {
+        thread.join();
+    }
+    if(!config_.latency_file_.empty())
+    {
+        std::vector<const Metrics*> sources;
+        for(auto& worker : workers_)
+        {
+            sources.push_back(&worker->GetMetrics());
+        }
+        Metrics::WriteLatencies(sources, config_.latency_file_);
+    }
+}
+
+void WorkerGroup::Run()
+{
+    if(config_.stall_threshold_ms_ > 0)
+    {
+        std::vector<const LoopActivity*> loops;
+        for(auto& worker : workers_)
+        {
+            loops.push_back(&worker->Activity());
+        }
+        watchdog_.Start(loops, config_.stall_threshold_ms_);
+    }
+    // Every watcher was set up on this thread, before any loop runs
+    for(size_t i = 1; i < workers_.size(); i++)
+    {
+        threads_.emplace_back(&Socks5Server::Run, workers_[i].get());
+    }
+    workers_[0]->Run();
+}
+
+void WorkerGroup::OnBalanceTimer()
+{
+    size_t busiest = 0;
+    size_t idlest = 0;
+    std::ostringstream loads;
+    for(size_t i = 0; i < workers_.size(); i++)
+    {
+        Socks5Server& worker = *workers_[i];
+        loads << (i > 0 ? ", " : "") << i << ": cpu=" << (int)(worker.CpuLoad() * 100) << "% "
+              << worker.ByteRate() / 1e6 << "MB/s sessions=" << worker.SessionCount();
+        if(worker.CpuLoad() > workers_[busiest]->CpuLoad())
+        {
+            busiest = i;
+        }
+        if(worker.CpuLoad() < workers_[idlest]->CpuLoad())
+        {
+            idlest = i;
+        }
+    }
+    LOG(INFO) << "Worker loads: " << loads.str();
+
+    double busy = workers_[busiest]->CpuLoad();
+    double idle = workers_[idlest]->CpuLoad();
+    if(busy - idle < kMinImbalance)
+    {
+        return;
+    }
+    // Moving half the difference leaves both at the mean of the two
+    double fraction = (busy - idle) / (2 * busy);
+    LOG(INFO) << "Rebalancing " << (int)(fraction * 100) << "% of worker " << busiest << "'s traffic to worker " << idlest;
+    workers_[busiest]->RequestMigration(idlest, fraction);
+}
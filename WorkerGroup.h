@@ -0,0 +1,33 @@
+#pragma once
+
+#include <memory>
+#include <thread>
+#include <vector>
+#include <ev++.h>
+#include "Socks5Config.h"
+#include "Socks5Server.h"
+
+// Runs one Socks5Server per worker loop, each on its own thread and
+// listening socket. Accept-time spreading is left to the kernel, but
+// tunnels live for hours and their load drifts, so every rebalance
+// interval the busiest worker is asked to hand its hottest tunnels to the
+// idlest one, see Socks5Server::MigrateTo().
+class WorkerGroup
+{
+    // Difference in core share below which workers count as balanced
+    static const double kMinImbalance;
+public:
+    WorkerGroup(const Socks5Config& config);
+    ~WorkerGroup();
+
+    // Worker 0 runs on the calling thread and the default loop
+    void Run();
+    void OnBalanceTimer();
+private:
+    Socks5Config config_;
+    std::vector<std::unique_ptr<ev::dynamic_loop>> loops_;
+    std::vector<std::unique_ptr<Socks5Server>> workers_;
+    std::vector<std::thread> threads_;
+    ev::timer balance_timer_;
+    Watchdog watchdog_;
+};
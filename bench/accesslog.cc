@@ -0,0 +1,139 @@
+// AccessLog append cost: THREADS threads, like worker loops, append
+// RATE records per second between them for SECONDS, then as fast as they
+// can. 4MB segments rotate every 32767 records, so the appends that map
+// the next segment show up in the tail. Paced CPU includes the sleeps
+// between appends, the flat out run gives the cost of one. Build with make
+// bench, run bench/accesslog [THREADS] [RATE] [SECONDS].
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <thread>
+#include <vector>
+#include <arpa/inet.h>
+#include <dirent.h>
+#include <time.h>
+#include <unistd.h>
+#include "AccessLog.h"
+#include "AsyncLog.h"
+
+INITIALIZE_EASYLOGGINGPP
+
+static const size_t kSegmentSize = 4 << 20;
+static const size_t kSegments = 4;
+
+struct Appender
+{
+    std::vector<double> latency_;
+    double cpu_;
+
+    Appender() : cpu_(0) {}
+};
+
+static double ThreadCpu()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// rate 0 appends flat out
+static void Append(Appender& appender, int worker, size_t records, double rate)
+{
+    AccessLog::Record record;
+    memset(&record, 0, sizeof(record));
+    record.client_addr_ = htonl(0x7f000001);
+    record.worker_ = worker;
+    record.dst_len_ = strlen("example.com");
+    memcpy(record.dst_, "example.com", record.dst_len_);
+
+    appender.latency_.reserve(records);
+    double cpu = ThreadCpu();
+    auto start = std::chrono::steady_clock::now();
+    for(size_t i = 0; i < records; i++)
+    {
+        if(rate > 0)
+        {
+            std::this_thread::sleep_until(start + std::chrono::duration<double>(i / rate));
+        }
+        record.start_us_ = i + 1;
+        record.bytes_up_ = i;
+        auto before = std::chrono::steady_clock::now();
+        AccessLog::Append(record);
+        appender.latency_.push_back(std::chrono::duration<double>(std::chrono::steady_clock::now() - before).count());
+    }
+    appender.cpu_ = ThreadCpu() - cpu;
+}
+
+static void Run(const char* name, size_t threads, size_t records, double rate)
+{
+    uint64_t dropped = AccessLog::Dropped();
+    std::vector<Appender> appenders(threads);
+    std::vector<std::thread> running;
+    auto start = std::chrono::steady_clock::now();
+    for(size_t i = 0; i < threads; i++)
+    {
+        running.emplace_back(Append, std::ref(appenders[i]), i, records, rate / threads);
+    }
+    for(auto& thread : running)
+    {
+        thread.join();
+    }
+    double wall = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+    std::vector<double> latency;
+    double cpu = 0;
+    for(auto& appender : appenders)
+    {
+        latency.insert(latency.end(), appender.latency_.begin(), appender.latency_.end());
+        cpu += appender.cpu_;
+    }
+    std::sort(latency.begin(), latency.end());
+    size_t total = latency.size();
+    printf("%s: %zu threads, %zu records at %.0f/s, append p50 %.0fns p99 %.0fns p99.99 %.1fus max %.1fus, "
+           "cpu %.0fns per record, dropped %lu\n",
+           name, threads, total, total / wall, latency[total / 2] * 1e9, latency[total * 99 / 100] * 1e9,
+           latency[total * 9999 / 10000] * 1e6, latency.back() * 1e6, cpu * 1e9 / total,
+           (unsigned long)(AccessLog::Dropped() - dropped));
+}
+
+int main(int argc, char** argv)
+{
+    size_t threads = argc > 1 ? atol(argv[1]) : 4;
+    double rate = argc > 2 ? atof(argv[2]) : 100000;
+    double seconds = argc > 3 ? atof(argv[3]) : 5;
+
+    char dir[] = "/tmp/accesslog-bench-XXXXXX";
+    if(mkdtemp(dir) == nullptr)
+    {
+        perror("mkdtemp");
+        return 1;
+    }
+    AsyncLog::Start();
+    if(!AccessLog::Open(dir, kSegmentSize, kSegments))
+    {
+        AsyncLog::Stop();
+        return 1;
+    }
+    Run("paced", threads, rate * seconds / threads, rate);
+    Run("flat out", threads, rate * seconds / threads, 0);
+    AccessLog::Close();
+    AsyncLog::Stop();
+
+    DIR* entries = opendir(dir);
+    while(struct dirent* entry = entries != nullptr ? readdir(entries) : nullptr)
+    {
+        if(entry->d_name[0] != '.')
+        {
+            unlink((std::string(dir) + "/" + entry->d_name).c_str());
+        }
+    }
+    if(entries != nullptr)
+    {
+        closedir(entries);
+    }
+    rmdir(dir);
+    return 0;
+}
@@ -0,0 +1,106 @@
+#!/usr/bin/env python3
+# Connection churn: clients open a tunnel, send one request line, read a
+# small reply and close, back to back. The client closes first: builds
+# from before sessions were torn down never pass the upstream's EOF on.
+# Reports connections per second and the proxy's CPU per connection. With
+# --allocs the proxy runs under bench/malloc_count.so (make bench) and the
+# heap calls per connection are reported too, counted over a separate run
+# of 2000 connections so startup does not count.
+#
+#   python3 bench/churn.py [--binary a.out] [--clients 4] [--seconds 5] [--allocs]
+import argparse
+import os
+import struct
+import sys
+import tempfile
+import threading
+import time
+
+sys.path.insert(0, os.path.join(os.path.dirname(os.path.abspath(__file__)), '..', 'test'))
+import proxy  # noqa: E402
+
+HERE = os.path.dirname(os.path.abspath(__file__))
+REPLY = 100
+
+
+def churn(port, origin_port, stop, counts, index):
+    while not stop.is_set():
+        try:
+            s = proxy.connect(port, 'localhost', origin_port, payload=b'GET / HTTP/1.0\r\n\r\n')
+            received = 0
+            while received < REPLY:
+                chunk = s.recv(65536)
+                if not chunk:
+                    raise ConnectionError('short reply')
+                received += len(chunk)
+            s.close()
+            counts[index] += 1
+        except OSError:
+            counts[-1] += 1
+
+
+def run(port, origin_port, clients, seconds=60, connections=None):
+    """Runs for seconds, or until connections are done. Returns (done,
+    failed, wall seconds)"""
+    stop = threading.Event()
+    counts = [0] * (clients + 1)
+    threads = [threading.Thread(target=churn, args=(port, origin_port, stop, counts, i)) for i in range(clients)]
+    start = time.time()
+    for t in threads:
+        t.start()
+    while True:
+        time.sleep(0.01)
+        elapsed = time.time() - start
+        if elapsed >= seconds or (connections is not None and sum(counts[:-1]) >= connections):
+            break
+    stop.set()
+    for t in threads:
+        t.join()
+    return sum(counts[:-1]), counts[-1], time.time() - start
+
+
+def read_counts(path):
+    with open(path, 'rb') as f:
+        return struct.unpack('4Q', f.read(32))
+
+
+def main():
+    parser = argparse.ArgumentParser()
+    parser.add_argument('--binary', default=None)
+    parser.add_argument('--clients', type=int, default=4)
+    parser.add_argument('--seconds', type=float, default=5)
+    parser.add_argument('--allocs', action='store_true')
+    parser.add_argument('--old', action='store_true', help='the binary predates --metrics')
+    args = parser.parse_args()
+
+    origin = proxy.Origin(proxy.reply(REPLY))
+    env = {}
+    count_file = None
+    if args.allocs:
+        count_file = tempfile.mktemp(prefix='malloc-count-')
+        env = {'LD_PRELOAD': os.path.join(HERE, 'malloc_count.so'), 'MALLOC_COUNT_FILE': count_file}
+    p = proxy.Proxy(binary=args.binary, env=env, metrics=not args.old)
+    try:
+        run(p.port, origin.port, args.clients, connections=200)
+        cpu = p.cpu()
+        done, failed, wall = run(p.port, origin.port, args.clients, seconds=args.seconds)
+        cpu = p.cpu() - cpu
+        print('connections %d, failed %d, %.0f/s, proxy cpu %.3f ms per connection'
+              % (done, failed, done / wall, cpu * 1000 / max(done, 1)))
+        if args.allocs:
+            before = read_counts(count_file)
+            done, failed, _ = run(p.port, origin.port, args.clients, connections=2000)
+            time.sleep(0.5)
+            after = read_counts(count_file)
+            calls = [(a - b) / done for a, b in zip(after, before)]
+            print('heap calls per connection: malloc %.1f, calloc %.1f, realloc %.1f, free %.1f'
+                  % tuple(calls))
+    finally:
+        p.cleanup()
+        origin.stop()
+        if count_file:
+            os.unlink(count_file)
+
+
+if __name__ == '__main__':
+    main()
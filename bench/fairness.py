@@ -0,0 +1,99 @@
+#!/usr/bin/env python3
+# Interactive latency next to bulk transfers on the same loop: one tunnel
+# echoes 64-byte messages every 3ms while --bulk other tunnels download
+# from a local source as fast as they can read. Reports the interactive
+# round trip percentiles and the bulk throughput. The bulk readers run in
+# processes of their own so they don't share the interpreter lock with
+# the timed client. Each step ends after --messages echoes or --seconds,
+# whichever comes first, a starved tunnel gets few echoes done.
+#
+#   python3 bench/fairness.py [--binary a.out] [--bulk 0,1,2] [--messages 800] [--seconds 30] [--old]
+import argparse
+import multiprocessing
+import os
+import socket
+import sys
+import time
+
+sys.path.insert(0, os.path.join(os.path.dirname(os.path.abspath(__file__)), '..', 'test'))
+import proxy  # noqa: E402
+
+MESSAGE = 64
+INTERVAL = 0.003
+# Seconds without an echo that count as starved
+STALL = 10
+
+
+def bulk(proxy_port, origin_port, stop, received):
+    s = proxy.connect(proxy_port, 'localhost', origin_port, payload=b'x')
+    buf = bytearray(1 << 20)
+    total = 0
+    while not stop.is_set():
+        n = s.recv_into(buf)
+        if n == 0:
+            break
+        total += n
+    received.put(total)
+    s.close()
+
+
+def main():
+    parser = argparse.ArgumentParser()
+    parser.add_argument('--binary', default=None)
+    parser.add_argument('--bulk', default='0,1,2')
+    parser.add_argument('--messages', type=int, default=800)
+    parser.add_argument('--seconds', type=float, default=30)
+    parser.add_argument('--old', action='store_true', help='the binary predates --metrics')
+    args = parser.parse_args()
+
+    source = proxy.Origin(proxy.source)
+    echo = proxy.Origin(proxy.echo)
+    p = proxy.Proxy(binary=args.binary, metrics=not args.old)
+    try:
+        for flows in [int(n) for n in args.bulk.split(',')]:
+            stop = multiprocessing.Event()
+            received = multiprocessing.Queue()
+            readers = [multiprocessing.Process(target=bulk, args=(p.port, source.port, stop, received))
+                       for _ in range(flows)]
+            for r in readers:
+                r.start()
+            time.sleep(0.5)
+
+            rtts = []
+            start = time.time()
+            try:
+                s = proxy.connect(p.port, 'localhost', echo.port, timeout=STALL)
+                while len(rtts) < args.messages and time.time() - start < args.seconds:
+                    sent = time.time()
+                    s.sendall(b'x' * MESSAGE)
+                    data = b''
+                    while len(data) < MESSAGE:
+                        data += s.recv(MESSAGE - len(data))
+                    rtts.append(time.time() - sent)
+                    time.sleep(INTERVAL)
+                s.close()
+            except socket.timeout:
+                # A loop that never leaves the bulk callbacks
+                pass
+            wall = time.time() - start
+            stop.set()
+            total = sum(received.get() for _ in readers)
+            for r in readers:
+                r.join()
+
+            rtts.sort()
+            if not rtts:
+                print('bulk flows %d: interactive tunnel stalled for %ds, bulk %.0f MB/s'
+                      % (flows, STALL, total / (wall + 0.5) / (1 << 20)))
+                continue
+            print('bulk flows %d: %d echoes, interactive rtt p50 %.2fms p99 %.2fms max %.2fms, bulk %.0f MB/s'
+                  % (flows, len(rtts), rtts[len(rtts) // 2] * 1e3, rtts[len(rtts) * 99 // 100] * 1e3,
+                     rtts[-1] * 1e3, total / (wall + 0.5) / (1 << 20)))
+    finally:
+        p.cleanup()
+        source.stop()
+        echo.stop()
+
+
+if __name__ == '__main__':
+    main()
@@ -0,0 +1,55 @@
+#!/usr/bin/env python3
+# Memory per idle tunnel: opens N tunnels to an echo origin, moves a small
+# message through each so both directions have read, then lets them sit
+# for --settle seconds and reports the proxy's RSS growth per tunnel. The
+# fd limit caps N, each tunnel costs the test two fds and the proxy two.
+#
+#   python3 bench/idle_rss.py [--binary a.out] [--sessions 8000] [--settle 3]
+import argparse
+import os
+import resource
+import sys
+import time
+
+sys.path.insert(0, os.path.join(os.path.dirname(os.path.abspath(__file__)), '..', 'test'))
+import proxy  # noqa: E402
+
+
+def main():
+    parser = argparse.ArgumentParser()
+    parser.add_argument('--binary', default=None)
+    parser.add_argument('--sessions', type=int, default=8000)
+    parser.add_argument('--settle', type=float, default=3)
+    args = parser.parse_args()
+
+    soft, hard = resource.getrlimit(resource.RLIMIT_NOFILE)
+    resource.setrlimit(resource.RLIMIT_NOFILE, (hard, hard))
+    origin = proxy.Origin(proxy.echo)
+    p = proxy.Proxy('-i', 600, binary=args.binary)
+    tunnels = []
+    try:
+        time.sleep(0.5)
+        base = p.rss_kb()
+        for _ in range(args.sessions):
+            s = proxy.connect(p.port, 'localhost', origin.port)
+            s.sendall(b'ping')
+            if s.recv(4) != b'ping':
+                raise RuntimeError('echo failed')
+            tunnels.append(s)
+        active = p.rss_kb()
+        time.sleep(args.settle)
+        idle = p.rss_kb()
+        print('%d tunnels: rss %d kB idle, +%.2f kB per tunnel just after traffic, +%.2f kB after %gs idle'
+              % (len(tunnels), idle, (active - base) / len(tunnels), (idle - base) / len(tunnels), args.settle))
+        buffered = p.metrics().get('uladder_buffer_bytes')
+        if buffered is not None:
+            print('buffer bytes held after %gs idle: %d' % (args.settle, buffered))
+    finally:
+        for s in tunnels:
+            s.close()
+        p.cleanup()
+        origin.stop()
+
+
+if __name__ == '__main__':
+    main()
@@ -0,0 +1,85 @@
+// Metrics update cost: a worker's plain load and store on its own block,
+// against the locked fetch_add a shared counter would take, on one thread
+// and then on two threads updating at once, with and without sharing a
+// cache line. Build with make bench, run bench/metrics [N], N updates
+// per thread and case. The default flags don't optimize, which leaves
+// Metrics::Add() a call: build with make bench ccflags="-O2 -g -Wall"
+// for numbers that match a release build.
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <thread>
+#include "Metrics.h"
+
+// Two counters on one cache line, each updated by one thread like
+// Metrics::Bump(), to show what the alignment of Metrics saves
+struct SharedLine
+{
+    std::atomic<uint64_t> counters_[2];
+
+    SharedLine()
+    {
+        counters_[0].store(0, std::memory_order_relaxed);
+        counters_[1].store(0, std::memory_order_relaxed);
+    }
+
+    void Add(int i, uint64_t n)
+    {
+        counters_[i].store(counters_[i].load(std::memory_order_relaxed) + n, std::memory_order_relaxed);
+    }
+};
+
+static double Seconds(std::chrono::steady_clock::time_point start)
+{
+    return std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+}
+
+// ns per update of body(i, n), run count times on each of threads threads
+template<typename Body>
+static double Run(size_t threads, size_t count, Body body)
+{
+    auto start = std::chrono::steady_clock::now();
+    std::thread other;
+    if(threads > 1)
+    {
+        other = std::thread([&]() {
+            for(size_t n = 0; n < count; n++)
+            {
+                body(1, n);
+            }
+        });
+    }
+    for(size_t n = 0; n < count; n++)
+    {
+        body(0, n);
+    }
+    if(other.joinable())
+    {
+        other.join();
+    }
+    return Seconds(start) * 1e9 / count;
+}
+
+int main(int argc, char** argv)
+{
+    size_t count = argc > 1 ? atol(argv[1]) : 100000000;
+    Metrics metrics[2];
+    std::atomic<uint64_t> shared(0);
+    SharedLine line;
+
+    double own = Run(1, count, [&](int i, size_t n) { metrics[i].Add(Metrics::kBytesUp, n); });
+    double locked = Run(1, count, [&](int, size_t n) { shared.fetch_add(n, std::memory_order_relaxed); });
+    printf("1 thread: Metrics::Add %.2fns, fetch_add %.2fns per update\n", own, locked);
+
+    own = Run(2, count, [&](int i, size_t n) { metrics[i].Add(Metrics::kBytesUp, n); });
+    double same_line = Run(2, count, [&](int i, size_t n) { line.Add(i, n); });
+    locked = Run(2, count, [&](int, size_t n) { shared.fetch_add(n, std::memory_order_relaxed); });
+    printf("2 threads: Metrics::Add %.2fns, own counters on one line %.2fns, one fetch_add counter %.2fns "
+           "per update, wall time over updates of one thread\n", own, same_line, locked);
+
+    // Keep the sums alive
+    uint64_t sum = metrics[0].Get(Metrics::kBytesUp) + metrics[1].Get(Metrics::kBytesUp) + shared.load() +
+                   line.counters_[0].load() + line.counters_[1].load();
+    return sum == 0 ? 1 : 0;
+}
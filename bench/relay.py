@@ -0,0 +1,79 @@
+#!/usr/bin/env python3
+# Relay throughput: one tunnel downloads --megabytes from a local source as
+# fast as the client reads, then --requests small request/reply exchanges
+# go through tunnels of their own. Reports MB/s and the proxy's CPU per MB
+# and per request, plus the log lines it wrote. Compare the builds of each
+# log level (make log_level=trace|debug|info) and --trace-sample settings,
+# arguments after -- go to the proxy:
+#
+#   python3 bench/relay.py [--binary a.out] [--megabytes 512] [--requests 2000] [-- --trace-sample 1]
+import argparse
+import os
+import sys
+import time
+
+sys.path.insert(0, os.path.join(os.path.dirname(os.path.abspath(__file__)), '..', 'test'))
+import proxy  # noqa: E402
+
+REPLY = 100
+
+
+def log_lines(p):
+    return p.output().count('\n')
+
+
+def main():
+    parser = argparse.ArgumentParser()
+    parser.add_argument('--binary', default=None)
+    parser.add_argument('--megabytes', type=int, default=512)
+    parser.add_argument('--requests', type=int, default=2000)
+    parser.add_argument('args', nargs='*', help='passed to the proxy')
+    args = parser.parse_args()
+
+    source = proxy.Origin(proxy.source)
+    small = proxy.Origin(proxy.reply(REPLY))
+    p = proxy.Proxy(*args.args, binary=args.binary)
+    try:
+        s = proxy.connect(p.port, 'localhost', source.port, payload=b'x')
+        # Warm up past slow start and the first buffer allocations
+        received = 0
+        while received < 16 << 20:
+            received += len(s.recv(1 << 20))
+        cpu = p.cpu()
+        start = time.time()
+        received = 0
+        while received < args.megabytes << 20:
+            received += len(s.recv(1 << 20))
+        wall = time.time() - start
+        cpu = p.cpu() - cpu
+        s.close()
+        print('download %d MB: %.0f MB/s, proxy cpu %.2f ms per MB'
+              % (args.megabytes, args.megabytes / wall, cpu * 1000 / args.megabytes))
+
+        time.sleep(0.5)
+        lines = log_lines(p)
+        cpu = p.cpu()
+        start = time.time()
+        for _ in range(args.requests):
+            s = proxy.connect(p.port, 'localhost', small.port, payload=b'GET / HTTP/1.0\r\n\r\n')
+            received = 0
+            while received < REPLY:
+                chunk = s.recv(65536)
+                if not chunk:
+                    raise ConnectionError('short reply')
+                received += len(chunk)
+            s.close()
+        wall = time.time() - start
+        # Let the log backend catch up before counting its lines and CPU
+        time.sleep(0.5)
+        cpu = p.cpu() - cpu
+        print('requests %d: %.0f/s, proxy cpu %.3f ms per request, %d log lines'
+              % (args.requests, args.requests / wall, cpu * 1000 / args.requests, log_lines(p) - lines))
+    finally:
+        p.cleanup()
+        source.stop()
+        small.stop()
+
+
+if __name__ == '__main__':
+    main()
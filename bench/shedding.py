@@ -0,0 +1,107 @@
+#!/usr/bin/env python3
+# Load shedding: an upstream that answers each request after --delay, and
+# a growing number of clients looping on one request per tunnel, pausing
+# 10ms after a failure. Past --max-sessions the proxy turns clients away
+# with a fast general-failure reply; goodput should hold steady instead of
+# collapsing. Reports requests served, rejected and failed per second at
+# each client count. --nofile N lowers the proxy's fd limit instead, to see
+# it back off accepting rather than die; --max-sessions 0 leaves sessions
+# unlimited.
+#
+#   python3 bench/shedding.py [--binary a.out] [--max-sessions 32] [--clients 16,32,64,128,256] [--seconds 4]
+#   python3 bench/shedding.py --max-sessions 0 --nofile 64 --clients 128
+import argparse
+import os
+import resource
+import socket
+import struct
+import sys
+import threading
+import time
+
+sys.path.insert(0, os.path.join(os.path.dirname(os.path.abspath(__file__)), '..', 'test'))
+import proxy  # noqa: E402
+
+BODY = b'hello\n'
+
+
+def delayed_reply(delay):
+    def handler(conn):
+        data = b''
+        while b'\n' not in data:
+            chunk = conn.recv(4096)
+            if not chunk:
+                conn.close()
+                return
+            data += chunk
+        time.sleep(delay)
+        conn.sendall(BODY)
+        conn.close()
+    return handler
+
+
+def client(port, origin_port, stop, counts):
+    request = (b'\x05\x01\x00\x05\x01\x00\x03\x09localhost' + struct.pack('>H', origin_port)
+               + b'GET / HTTP/1.0\r\n\r\n')
+    while not stop.is_set():
+        kind = 'failed'
+        try:
+            s = socket.create_connection(('127.0.0.1', port), timeout=5)
+            s.sendall(request)
+            data = b''
+            while True:
+                chunk = s.recv(65536)
+                if not chunk:
+                    break
+                data += chunk
+            s.close()
+            if data.endswith(BODY):
+                kind = 'ok'
+            elif data[2:4] == b'\x05\x01':
+                kind = 'rejected'
+        except OSError:
+            pass
+        counts[kind] += 1
+        if kind != 'ok':
+            time.sleep(0.01)
+
+
+def main():
+    parser = argparse.ArgumentParser()
+    parser.add_argument('--binary', default=None)
+    parser.add_argument('--max-sessions', type=int, default=32)
+    parser.add_argument('--delay', type=float, default=0.05)
+    parser.add_argument('--clients', default='16,32,64,128,256')
+    parser.add_argument('--seconds', type=float, default=4)
+    parser.add_argument('--nofile', type=int, default=0)
+    args = parser.parse_args()
+
+    origin = proxy.Origin(delayed_reply(args.delay))
+    limits = ['--max-sessions', args.max_sessions] if args.max_sessions > 0 else []
+    p = proxy.Proxy(*limits, binary=args.binary)
+    if args.nofile > 0:
+        resource.prlimit(p.pid, resource.RLIMIT_NOFILE, (args.nofile, args.nofile))
+    try:
+        for clients in [int(n) for n in args.clients.split(',')]:
+            stop = threading.Event()
+            counts = {'ok': 0, 'rejected': 0, 'failed': 0}
+            threads = [threading.Thread(target=client, args=(p.port, origin.port, stop, counts))
+                       for _ in range(clients)]
+            for t in threads:
+                t.start()
+            time.sleep(args.seconds)
+            stop.set()
+            for t in threads:
+                t.join()
+            print('clients %4d: ok %6.1f/s, rejected %7.1f/s, failed %d, accept backoffs so far %d, proxy %s'
+                  % (clients, counts['ok'] / args.seconds, counts['rejected'] / args.seconds, counts['failed'],
+                     p.output().count('Accept failed, backing off'), 'up' if p.alive() else 'DOWN'))
+            # Let the last tunnels finish before the next step
+            time.sleep(args.delay * 4)
+    finally:
+        p.cleanup()
+        origin.stop()
+
+
+if __name__ == '__main__':
+    main()
@@ -0,0 +1,159 @@
+#!/usr/bin/env python3
+# Per-thread CPU under skewed load: --tunnels echo tunnels through
+# --workers loops, then only the ones the busiest-looking worker holds
+# are driven, at --rate MB/s each, for --seconds. Prints every thread's
+# share of a core every 2s, worker 0 (the main thread) first, so the load
+# can be watched moving off the hot worker, then checks every tunnel
+# echoed its bytes back complete and in order. Pass
+# --rebalance-interval 0 to see the same load without migration.
+#
+#   python3 bench/skew.py [--binary a.out] [--workers 4] [--tunnels 16] [--rate 40] [--seconds 20] [--rebalance-interval 5]
+import argparse
+import os
+import sys
+import time
+
+sys.path.insert(0, os.path.join(os.path.dirname(os.path.abspath(__file__)), '..', 'test'))
+import proxy  # noqa: E402
+
+HZ = os.sysconf('SC_CLK_TCK')
+TICK = 0.01
+REPORT = 2
+# Bytes 0..250 repeating, so any loss or reordering shows up
+PATTERN = bytes(i % 251 for i in range(251 * 5000))
+
+
+def thread_ticks(pid):
+    ticks = {}
+    for tid in os.listdir('/proc/%d/task' % pid):
+        with open('/proc/%d/task/%s/stat' % (pid, tid)) as f:
+            fields = f.read().rsplit(')', 1)[1].split()
+        ticks[int(tid)] = int(fields[11]) + int(fields[12])
+    return ticks
+
+
+def pump(s, size):
+    block = b'x' * 65536
+    sent = 0
+    received = 0
+    while received < size:
+        if sent < size:
+            s.sendall(block)
+            sent += len(block)
+        received += len(s.recv(1 << 20))
+
+
+def owner(pid, s):
+    """The thread that burns the most CPU while s carries a burst, the
+    best of three tries"""
+    best = (None, -1)
+    for _ in range(3):
+        before = thread_ticks(pid)
+        pump(s, 8 << 20)
+        after = thread_ticks(pid)
+        used = {tid: ticks - before.get(tid, 0) for tid, ticks in after.items()}
+        tid = max(used, key=used.get)
+        if used[tid] > best[1]:
+            best = (tid, used[tid])
+    return best[0]
+
+
+class Stream(object):
+    """One driven tunnel, sending the pattern and checking the echo"""
+
+    def __init__(self, s):
+        self.s = s
+        self.sent = 0
+        self.received = 0
+        self.mismatched = 0
+        s.setblocking(False)
+
+    def send(self, size):
+        offset = self.sent % 251
+        try:
+            self.sent += self.s.send(PATTERN[offset:offset + size])
+        except BlockingIOError:
+            pass
+
+    def receive(self):
+        received = 0
+        while True:
+            try:
+                data = self.s.recv(1 << 20)
+            except BlockingIOError:
+                break
+            if not data:
+                break
+            self.check(data)
+            received += len(data)
+        return received
+
+    def check(self, data):
+        offset = self.received % 251
+        if data != PATTERN[offset:offset + len(data)]:
+            self.mismatched += 1
+        self.received += len(data)
+
+    def drain(self):
+        self.s.settimeout(5)
+        while self.received < self.sent:
+            data = self.s.recv(1 << 20)
+            if not data:
+                break
+            self.check(data)
+
+
+def main():
+    parser = argparse.ArgumentParser()
+    parser.add_argument('--binary', default=None)
+    parser.add_argument('--workers', type=int, default=4)
+    parser.add_argument('--tunnels', type=int, default=16)
+    parser.add_argument('--rate', type=float, default=40, help='MB/s per driven tunnel')
+    parser.add_argument('--seconds', type=float, default=20)
+    parser.add_argument('--rebalance-interval', default='5')
+    args = parser.parse_args()
+
+    echo = proxy.Origin(proxy.echo)
+    p = proxy.Proxy('-w', args.workers, '--rebalance-interval', args.rebalance_interval, binary=args.binary)
+    try:
+        tunnels = [proxy.connect(p.port, 'localhost', echo.port) for _ in range(args.tunnels)]
+        owners = {}
+        for s in tunnels:
+            owners.setdefault(owner(p.pid, s), []).append(s)
+        threads = sorted(thread_ticks(p.pid))
+        hot = max(owners, key=lambda tid: len(owners[tid]))
+        print('tunnels per thread: %s, driving the %d on thread %d'
+              % (' '.join(str(len(owners.get(tid, []))) for tid in threads), len(owners[hot]), threads.index(hot)))
+
+        streams = [Stream(s) for s in owners[hot]]
+        size = int(args.rate * 1e6 * TICK)
+        start = time.time()
+        last, last_ticks, relayed = start, thread_ticks(p.pid), 0
+        while time.time() - start < args.seconds:
+            tick = time.time()
+            for stream in streams:
+                stream.send(size)
+                relayed += stream.receive()
+            if tick - last >= REPORT:
+                ticks = thread_ticks(p.pid)
+                print('t=%3.0fs %s  %.0f MB/s'
+                      % (tick - start, ' '.join('%3.0f%%' % ((ticks.get(tid, 0) - last_ticks.get(tid, 0)) * 100
+                                                             / HZ / (tick - last)) for tid in threads),
+                         relayed / 1e6 / (tick - last)))
+                last, last_ticks, relayed = tick, ticks, 0
+            time.sleep(max(TICK - (time.time() - tick), 0))
+
+        for stream in streams:
+            stream.drain()
+        print('sent %d, echoed %d, mismatched chunks %d'
+              % (sum(s.sent for s in streams), sum(s.received for s in streams),
+                 sum(s.mismatched for s in streams)))
+        for s in tunnels:
+            s.close()
+    finally:
+        p.cleanup()
+        echo.stop()
+
+
+if __name__ == '__main__':
+    main()
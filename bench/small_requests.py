@@ -0,0 +1,101 @@
+#!/usr/bin/env python3
+# Syscalls and packets per small request: --requests sequential HTTP/1.0
+# style tunnels, greeting, CONNECT and request sent in one go, each read
+# to the upstream's close. The proxy runs under bench/syscall_count.so
+# (make bench), so builds from before the /metrics syscall counters can be
+# compared too. TCP segments are the OutSegs difference of /proc/net/snmp,
+# which counts every socket on the host, client and upstream included.
+# Arguments after -- go to the proxy, like -o.
+#
+#   python3 bench/small_requests.py [--binary a.out] [--requests 1000] [--old] [-- -o]
+import argparse
+import os
+import struct
+import sys
+import tempfile
+import time
+
+sys.path.insert(0, os.path.join(os.path.dirname(os.path.abspath(__file__)), '..', 'test'))
+import proxy  # noqa: E402
+
+HERE = os.path.dirname(os.path.abspath(__file__))
+CALLS = ['writes', 'reads', 'epoll_wait', 'epoll_ctl', 'accept', 'connect']
+HEAD = b'HTTP/1.0 200 OK\r\nContent-Type: text/html\r\nContent-Length: 6\r\n\r\n'
+BODY = b'hello\n'
+
+
+def http_reply(conn):
+    # Head and body in separate sends, the way a small HTTP server writes
+    # a response out
+    data = b''
+    while b'\r\n\r\n' not in data:
+        chunk = conn.recv(4096)
+        if not chunk:
+            conn.close()
+            return
+        data += chunk
+    conn.sendall(HEAD)
+    conn.sendall(BODY)
+    conn.close()
+
+
+def read_counts(path):
+    with open(path, 'rb') as f:
+        reads, writes, epoll_wait, epoll_ctl, accept, connect = struct.unpack('6Q', f.read(48))
+    return [writes, reads, epoll_wait, epoll_ctl, accept, connect]
+
+
+def tcp_out_segments():
+    with open('/proc/net/snmp') as f:
+        lines = [line.split() for line in f if line.startswith('Tcp:')]
+    return int(lines[1][lines[0].index('OutSegs')])
+
+
+def request(port, origin_port):
+    s = proxy.connect(port, 'localhost', origin_port, payload=b'GET / HTTP/1.0\r\n\r\n')
+    data = b''
+    while True:
+        chunk = s.recv(65536)
+        if not chunk:
+            break
+        data += chunk
+    s.close()
+    if data != HEAD + BODY:
+        raise ConnectionError('unexpected reply %r' % data)
+
+
+def main():
+    parser = argparse.ArgumentParser()
+    parser.add_argument('--binary', default=None)
+    parser.add_argument('--requests', type=int, default=1000)
+    parser.add_argument('--old', action='store_true', help='the binary predates --metrics')
+    parser.add_argument('args', nargs='*', help='proxy arguments, after --')
+    args = parser.parse_args()
+
+    count_file = tempfile.mktemp(prefix='syscall-count-')
+    env = {'LD_PRELOAD': os.path.join(HERE, 'syscall_count.so'), 'SYSCALL_COUNT_FILE': count_file}
+    origin = proxy.Origin(http_reply)
+    p = proxy.Proxy(*args.args, binary=args.binary, env=env, metrics=not args.old)
+    try:
+        for _ in range(100):
+            request(p.port, origin.port)
+        time.sleep(0.2)
+        before = read_counts(count_file)
+        segments = tcp_out_segments()
+        for _ in range(args.requests):
+            request(p.port, origin.port)
+        # The last session's teardown may still be running
+        time.sleep(0.2)
+        segments = tcp_out_segments() - segments
+        after = read_counts(count_file)
+        calls = [(a - b) / args.requests for a, b in zip(after, before)]
+        print('per request: %s, tcp segments %.2f'
+              % (', '.join('%s %.2f' % (name, n) for name, n in zip(CALLS, calls)), segments / args.requests))
+    finally:
+        p.cleanup()
+        origin.stop()
+        os.unlink(count_file)
+
+
+if __name__ == '__main__':
+    main()
@@ -0,0 +1,107 @@
+#!/usr/bin/env python3
+# Syscall and wakeup ratios, the numbers to track across changes to the
+# data path: a bulk download, a bulk upload and small request/reply
+# tunnels, each measured as the difference of the proxy's /metrics
+# counters around it. Reports bytes per syscall, wakeups per MB and the
+# syscalls of each kind per MB (bulk) or per connection (small).
+#
+#   python3 bench/syscalls.py [--binary a.out] [--megabytes 256] [--connections 2000]
+import argparse
+import os
+import sys
+import time
+
+sys.path.insert(0, os.path.join(os.path.dirname(os.path.abspath(__file__)), '..', 'test'))
+import proxy  # noqa: E402
+import churn  # noqa: E402
+
+CALLS = ['read', 'write', 'recv', 'send', 'epoll_ctl', 'accept', 'connect']
+REPLY = 100
+
+
+class Delta(object):
+    """Counter differences across a with block"""
+
+    def __init__(self, p):
+        self.p = p
+
+    def __enter__(self):
+        self.before = self.p.metrics()
+        return self
+
+    def __exit__(self, *exc):
+        # The last callbacks of the phase may still be running
+        time.sleep(0.2)
+        after = self.p.metrics()
+        self.values = {k: v - self.before.get(k, 0) for k, v in after.items()}
+
+    def __getitem__(self, key):
+        return self.values.get(key, 0)
+
+    def calls(self, name):
+        return self['uladder_syscalls_total{call="%s"}' % name]
+
+
+def report(name, delta, unit, units):
+    syscalls = delta['uladder_syscalls_total']
+    relayed = delta['uladder_relayed_bytes_total']
+    print('%s: %.0f bytes per syscall, %.1f wakeups per MB, %.1f%% EAGAIN'
+          % (name, relayed / max(syscalls, 1), delta['uladder_loop_wakeups_total'] / max(relayed / (1 << 20), 1e-9),
+             delta['uladder_syscalls_eagain_total'] * 100 / max(syscalls, 1)))
+    print('  per %s: %s, wakeups %.1f' % (unit, ', '.join('%s %.1f' % (c, delta.calls(c) / units) for c in CALLS),
+                                          delta['uladder_loop_wakeups_total'] / units))
+
+
+def download(p, origin_port, megabytes):
+    s = proxy.connect(p.port, 'localhost', origin_port, payload=b'x')
+    received = 0
+    while received < 16 << 20:
+        received += len(s.recv(1 << 20))
+    with Delta(p) as delta:
+        received = 0
+        while received < megabytes << 20:
+            received += len(s.recv(1 << 20))
+    s.close()
+    return delta
+
+
+def upload(p, origin_port, megabytes):
+    s = proxy.connect(p.port, 'localhost', origin_port)
+    block = b'\0' * (1 << 20)
+    for _ in range(16):
+        s.sendall(block)
+    with Delta(p) as delta:
+        for _ in range(megabytes):
+            s.sendall(block)
+    s.close()
+    return delta
+
+
+def main():
+    parser = argparse.ArgumentParser()
+    parser.add_argument('--binary', default=None)
+    parser.add_argument('--megabytes', type=int, default=256)
+    parser.add_argument('--connections', type=int, default=2000)
+    parser.add_argument('--clients', type=int, default=4)
+    args = parser.parse_args()
+
+    source = proxy.Origin(proxy.source)
+    sink = proxy.Origin(proxy.discard)
+    small = proxy.Origin(proxy.reply(REPLY))
+    p = proxy.Proxy(binary=args.binary)
+    try:
+        report('download', download(p, source.port, args.megabytes), 'MB', args.megabytes)
+        report('upload', upload(p, sink.port, args.megabytes), 'MB', args.megabytes)
+        churn.run(p.port, small.port, args.clients, connections=200)
+        with Delta(p) as delta:
+            done, _, _ = churn.run(p.port, small.port, args.clients, connections=args.connections)
+        report('small requests', delta, 'connection', done)
+    finally:
+        p.cleanup()
+        source.stop()
+        sink.stop()
+        small.stop()
+
+
+if __name__ == '__main__':
+    main()
@@ -0,0 +1,115 @@
+// TimerWheel cost at a million armed timers, and how close to their
+// deadline timers fire. Build with make bench, run bench/timerwheel [N].
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <memory>
+#include <random>
+#include <vector>
+#include <ev++.h>
+#include "TimerWheel.h"
+
+struct Armed
+{
+    TimerWheel::Timer timer_;
+    ev::tstamp deadline_;
+    std::vector<double>* lateness_;
+    size_t* early_;
+    ev::loop_ref loop_;
+
+    explicit Armed(struct ev_loop* loop) : deadline_(0), lateness_(nullptr), early_(nullptr), loop_(loop) {}
+
+    void OnTimer()
+    {
+        ev::tstamp now = ev::now(loop_);
+        if(now < deadline_)
+        {
+            (*early_) ++;
+        }
+        lateness_->push_back(now - deadline_);
+    }
+};
+
+static double Seconds(std::chrono::steady_clock::time_point start)
+{
+    return std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+}
+
+int main(int argc, char** argv)
+{
+    size_t count = argc > 1 ? atol(argv[1]) : 1000000;
+    struct ev_loop* loop = ev::get_default_loop();
+    std::mt19937_64 random(42);
+    std::uniform_real_distribution<double> after(1, 600);
+
+    {
+        // Deadlines up to 10 minutes at the default 100ms tick: the first
+        // three levels, like idle and handshake deadlines
+        TimerWheel wheel(loop);
+        std::vector<std::unique_ptr<Armed>> timers;
+        for(size_t i = 0; i < count; i++)
+        {
+            timers.emplace_back(new Armed(loop));
+        }
+        auto start = std::chrono::steady_clock::now();
+        for(auto& armed : timers)
+        {
+            wheel.Arm(armed->timer_, after(random));
+        }
+        double arm = Seconds(start);
+
+        std::uniform_int_distribution<size_t> pick(0, count - 1);
+        size_t rearms = count * 5;
+        std::vector<std::pair<size_t, double>> plan;
+        for(size_t i = 0; i < rearms; i++)
+        {
+            plan.emplace_back(pick(random), after(random));
+        }
+        start = std::chrono::steady_clock::now();
+        for(auto& step : plan)
+        {
+            wheel.Arm(timers[step.first]->timer_, step.second);
+        }
+        double rearm = Seconds(start);
+
+        start = std::chrono::steady_clock::now();
+        for(auto& armed : timers)
+        {
+            armed->timer_.Cancel();
+        }
+        double cancel = Seconds(start);
+        printf("%zu timers: arm %.1fM/s, random re-arm with all armed %.1fM/s, cancel %.1fM/s\n",
+               count, count / arm / 1e6, rearms / rearm / 1e6, count / cancel / 1e6);
+    }
+
+    {
+        // Accuracy with a 1ms tick over 2s of deadlines
+        const size_t kFiring = 20000;
+        TimerWheel wheel(loop, 0.001);
+        std::vector<double> lateness;
+        size_t early = 0;
+        std::vector<std::unique_ptr<Armed>> timers;
+        std::uniform_real_distribution<double> soon(0, 2);
+        ev_now_update(loop);
+        for(size_t i = 0; i < kFiring; i++)
+        {
+            timers.emplace_back(new Armed(loop));
+            Armed& armed = *timers.back();
+            armed.lateness_ = &lateness;
+            armed.early_ = &early;
+            armed.timer_.set<Armed, &Armed::OnTimer>(&armed);
+            double delay = soon(random);
+            armed.deadline_ = ev::now(loop) + delay;
+            wheel.Arm(armed.timer_, delay);
+        }
+        while(lateness.size() < kFiring)
+        {
+            ev_run(loop, EVRUN_ONCE);
+        }
+        std::sort(lateness.begin(), lateness.end());
+        printf("%zu timers, 1ms tick: early %zu, late p50 %.2fms p99 %.2fms max %.2fms\n", kFiring, early,
+               lateness[kFiring / 2] * 1e3, lateness[kFiring * 99 / 100] * 1e3, lateness.back() * 1e3);
+    }
+    return 0;
+}
@@ -0,0 +1,127 @@
+#!/usr/bin/env python3
+# Time to first byte over loopback, with and without TCP Fast Open: each
+# of --requests sequential clients sends greeting, CONNECT and an HTTP
+# request in one go and times from its connect until the first response
+# byte. The upstream listens with TCP_FASTOPEN. The Fast Open run starts
+# the proxy with --tfo and the client connects with MSG_FASTOPEN too, so
+# both hops can carry data in the SYN once cookies are cached (needs
+# net.ipv4.tcp_fastopen = 3). Reports the percentiles and the host's
+# TCPFastOpen counters from /proc/net/netstat over each run.
+#
+#   python3 bench/ttfb.py [--binary a.out] [--requests 2000]
+import argparse
+import os
+import socket
+import struct
+import sys
+import threading
+import time
+
+sys.path.insert(0, os.path.join(os.path.dirname(os.path.abspath(__file__)), '..', 'test'))
+import proxy  # noqa: E402
+
+TCP_FASTOPEN = 23
+MSG_FASTOPEN = 0x20000000
+RESPONSE = b'HTTP/1.0 200 OK\r\nContent-Length: 6\r\n\r\nhello\n'
+COUNTERS = ['TCPFastOpenActive', 'TCPFastOpenActiveFail', 'TCPFastOpenPassive', 'TCPFastOpenCookieReqd']
+
+
+class FastOpenOrigin(object):
+    """An HTTP/1.0 upstream accepting data in the SYN"""
+
+    def __init__(self):
+        self.listener = socket.socket()
+        self.listener.setsockopt(socket.SOL_SOCKET, socket.SO_REUSEADDR, 1)
+        self.listener.setsockopt(socket.IPPROTO_TCP, TCP_FASTOPEN, 64)
+        self.listener.bind(('127.0.0.1', 0))
+        self.listener.listen(128)
+        self.port = self.listener.getsockname()[1]
+        threading.Thread(target=self._accept, daemon=True).start()
+
+    def _accept(self):
+        while True:
+            try:
+                conn, _ = self.listener.accept()
+            except OSError:
+                return
+            threading.Thread(target=self._serve, args=(conn,), daemon=True).start()
+
+    def _serve(self, conn):
+        data = b''
+        while b'\r\n\r\n' not in data:
+            chunk = conn.recv(4096)
+            if not chunk:
+                break
+            data += chunk
+        conn.sendall(RESPONSE)
+        conn.close()
+
+    def stop(self):
+        self.listener.close()
+
+
+def tcp_ext():
+    with open('/proc/net/netstat') as f:
+        lines = [line.split() for line in f if line.startswith('TcpExt:')]
+    return dict(zip(lines[0][1:], (int(v) for v in lines[1][1:])))
+
+
+def request(port, origin_port, fastopen):
+    data = (b'\x05\x01\x00\x05\x01\x00\x03\x09localhost' + struct.pack('>H', origin_port)
+            + b'GET / HTTP/1.0\r\n\r\n')
+    s = socket.socket()
+    s.settimeout(5)
+    start = time.time()
+    if fastopen:
+        s.sendto(data, MSG_FASTOPEN, ('127.0.0.1', port))
+    else:
+        s.connect(('127.0.0.1', port))
+        s.sendall(data)
+    received = b''
+    first = None
+    while True:
+        chunk = s.recv(4096)
+        if not chunk:
+            break
+        if first is None and len(received) + len(chunk) > 12:
+            # Past the greeting and CONNECT replies
+            first = time.time() - start
+        received += chunk
+    s.close()
+    if received[:3] != b'\x05\x00\x05' or not received.endswith(RESPONSE):
+        raise ConnectionError('unexpected reply %r' % received)
+    return first
+
+
+def run(binary, origin_port, requests, fastopen):
+    p = proxy.Proxy(*(['--tfo'] if fastopen else []), binary=binary)
+    try:
+        # Fetches the Fast Open cookies for both hops
+        for _ in range(50):
+            request(p.port, origin_port, fastopen)
+        before = tcp_ext()
+        ttfb = sorted(request(p.port, origin_port, fastopen) for _ in range(requests))
+        after = tcp_ext()
+    finally:
+        p.cleanup()
+    print('%s: ttfb p50 %.3fms p99 %.3fms, %s'
+          % ('fast open' if fastopen else 'regular', ttfb[len(ttfb) // 2] * 1e3, ttfb[len(ttfb) * 99 // 100] * 1e3,
+             ', '.join('%s %d' % (c, after.get(c, 0) - before.get(c, 0)) for c in COUNTERS)))
+
+
+def main():
+    parser = argparse.ArgumentParser()
+    parser.add_argument('--binary', default=None)
+    parser.add_argument('--requests', type=int, default=2000)
+    args = parser.parse_args()
+
+    origin = FastOpenOrigin()
+    try:
+        run(args.binary, origin.port, args.requests, False)
+        run(args.binary, origin.port, args.requests, True)
+    finally:
+        origin.stop()
+
+
+if __name__ == '__main__':
+    main()
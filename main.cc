@@ -1,11 +1,34 @@
+#include <csignal>
 #include "easylogging++.h"
-#include "Socks5Server.h"
+#include "AccessLog.h"
+#include "AsyncLog.h"
+#include "Socks5Config.h"
+#include "WorkerGroup.h"
 
 INITIALIZE_EASYLOGGINGPP
 
-int main()
+int main(int argc, char* argv[])
 {
-    Socks5Server server;
-    server.Run();
+    // A peer resetting under a pending write must fail the write, not kill us
+    signal(SIGPIPE, SIG_IGN);
+
+    Socks5Config config;
+    if(!config.ParseArgs(argc, argv))
+    {
+        return 1;
+    }
+    AsyncLog::Start();
+    if(!config.access_log_dir_.empty() && !AccessLog::Open(config.access_log_dir_, config.access_log_segment_size_, config.access_log_segments_))
+    {
+        AsyncLog::Stop();
+        return 1;
+    }
+    {
+        WorkerGroup workers(config);
+        workers.Run();
+    }
+    // Sessions still open were written when the workers went away
+    AccessLog::Close();
+    AsyncLog::Stop();
     return 0;
 }
@@ -0,0 +1,238 @@
+# Runs the proxy and local origins for the tests in this directory and the
+# benchmarks in bench/. Python 3 standard library only, Linux only: process
+# CPU and memory are read from /proc.
+import os
+import shutil
+import socket
+import struct
+import subprocess
+import tempfile
+import threading
+import time
+
+HERE = os.path.dirname(os.path.abspath(__file__))
+DEFAULT_BINARY = os.path.join(HERE, '..', 'a.out')
+
+
+def free_port():
+    s = socket.socket()
+    s.bind(('127.0.0.1', 0))
+    port = s.getsockname()[1]
+    s.close()
+    return port
+
+
+def wait_listening(port, timeout=5.0):
+    deadline = time.time() + timeout
+    while time.time() < deadline:
+        try:
+            socket.create_connection(('127.0.0.1', port), timeout=0.2).close()
+            return True
+        except OSError:
+            time.sleep(0.02)
+    return False
+
+
+def proc_cpu(pid):
+    # utime + stime of all threads, in seconds
+    with open('/proc/%d/stat' % pid) as f:
+        fields = f.read().rsplit(')', 1)[1].split()
+    return (int(fields[11]) + int(fields[12])) / os.sysconf('SC_CLK_TCK')
+
+
+def proc_rss_kb(pid):
+    with open('/proc/%d/status' % pid) as f:
+        for line in f:
+            if line.startswith('VmRSS:'):
+                return int(line.split()[1])
+    return 0
+
+
+class Proxy(object):
+    """One proxy process listening on a free port, with --metrics on
+    another one unless metrics is False, for builds that predate it. Runs
+    in a scratch directory, where it keeps its logs."""
+
+    def __init__(self, *args, binary=None, env=None, port=None, workdir=None, metrics=True):
+        self.binary = os.path.abspath(binary or os.environ.get('ULADDER', DEFAULT_BINARY))
+        self.port = port or free_port()
+        self.metrics_port = free_port()
+        self.workdir = workdir or tempfile.mkdtemp(prefix='uladder-')
+        self.own_workdir = workdir is None
+        cmd = [self.binary, '-l', '127.0.0.1:%d' % self.port, '-s', '0']
+        if metrics:
+            cmd += ['--metrics', '127.0.0.1:%d' % self.metrics_port]
+        cmd += [str(a) for a in args]
+        self.log = open(os.path.join(self.workdir, 'stdout.log'), 'ab')
+        self.process = subprocess.Popen(cmd, cwd=self.workdir, stdout=self.log, stderr=subprocess.STDOUT,
+                                        env=dict(os.environ, **(env or {})))
+        self.pid = self.process.pid
+        if not wait_listening(self.port):
+            self.stop()
+            raise RuntimeError('proxy did not start: %s' % ' '.join(cmd))
+
+    def metrics(self):
+        """name{labels} -> value, summed over the lines of one name when
+        labels are left out"""
+        s = socket.create_connection(('127.0.0.1', self.metrics_port), timeout=5)
+        s.sendall(b'GET /metrics HTTP/1.0\r\n\r\n')
+        data = b''
+        while True:
+            chunk = s.recv(65536)
+            if not chunk:
+                break
+            data += chunk
+        s.close()
+        values = {}
+        for line in data.split(b'\r\n\r\n', 1)[-1].decode().splitlines():
+            if not line or line.startswith('#'):
+                continue
+            key, value = line.rsplit(' ', 1)
+            values[key] = float(value)
+            name = key.split('{', 1)[0]
+            if name != key:
+                values[name] = values.get(name, 0) + float(value)
+        return values
+
+    def cpu(self):
+        return proc_cpu(self.pid)
+
+    def rss_kb(self):
+        return proc_rss_kb(self.pid)
+
+    def alive(self):
+        return self.process.poll() is None
+
+    def output(self):
+        text = ''
+        for root, _, files in os.walk(self.workdir):
+            for name in sorted(files):
+                if name.endswith('.log'):
+                    with open(os.path.join(root, name), errors='replace') as f:
+                        text += f.read()
+        return text
+
+    def stop(self, timeout=10):
+        if self.alive():
+            self.process.terminate()
+            try:
+                self.process.wait(timeout)
+            except subprocess.TimeoutExpired:
+                self.process.kill()
+                self.process.wait()
+        self.log.close()
+
+    def cleanup(self):
+        self.stop()
+        if self.own_workdir:
+            shutil.rmtree(self.workdir, ignore_errors=True)
+
+
+def connect(proxy_port, host, port, timeout=5.0, payload=b''):
+    """A tunnel to host:port through the proxy, by domain name. Returns the
+    socket once the success reply is in, raises otherwise"""
+    s = socket.create_connection(('127.0.0.1', proxy_port), timeout=timeout)
+    name = host.encode()
+    s.sendall(b'\x05\x01\x00' + b'\x05\x01\x00\x03' + bytes([len(name)]) + name + struct.pack('>H', port) + payload)
+    reply = b''
+    while len(reply) < 12:
+        chunk = s.recv(12 - len(reply))
+        if not chunk:
+            s.close()
+            raise ConnectionError('proxy closed during the handshake')
+        reply += chunk
+    if reply[:3] != b'\x05\x00\x05':
+        s.close()
+        raise ConnectionError('unexpected reply %r' % reply)
+    if reply[3] != 0x00:
+        s.close()
+        raise ConnectionError('request failed, rep=%d' % reply[3])
+    return s
+
+
+class Origin(object):
+    """A local upstream on a free port. handler(conn) runs on its own thread
+    per connection"""
+
+    def __init__(self, handler):
+        self.handler = handler
+        self.listener = socket.socket()
+        self.listener.setsockopt(socket.SOL_SOCKET, socket.SO_REUSEADDR, 1)
+        self.listener.bind(('127.0.0.1', 0))
+        self.listener.listen(1024)
+        self.port = self.listener.getsockname()[1]
+        self.connections = []
+        self.stopping = False
+        threading.Thread(target=self._accept, daemon=True).start()
+
+    def _accept(self):
+        while not self.stopping:
+            try:
+                conn, _ = self.listener.accept()
+            except OSError:
+                return
+            self.connections.append(conn)
+            threading.Thread(target=self._serve, args=(conn,), daemon=True).start()
+
+    def _serve(self, conn):
+        try:
+            self.handler(conn)
+        except OSError:
+            pass
+
+    def stop(self):
+        self.stopping = True
+        self.listener.close()
+        for conn in self.connections:
+            try:
+                conn.close()
+            except OSError:
+                pass
+
+
+def echo(conn):
+    while True:
+        data = conn.recv(65536)
+        if not data:
+            break
+        conn.sendall(data)
+    conn.close()
+
+
+def never_read(conn):
+    # Accepts and then leaves the connection alone, its receive window
+    # fills up and the sender sees EAGAIN
+    while True:
+        time.sleep(3600)
+
+
+def discard(conn):
+    while conn.recv(1 << 20):
+        pass
+    conn.close()
+
+
+def source(conn):
+    # Waits for one request byte, then sends until the client goes away
+    conn.recv(1)
+    block = b'\0' * (1 << 20)
+    while True:
+        conn.sendall(block)
+
+
+def reply(size):
+    # Answers each request line with size bytes and closes, like a small
+    # HTTP/1.0 response
+    body = b'x' * size
+
+    def handler(conn):
+        data = b''
+        while b'\n' not in data:
+            chunk = conn.recv(4096)
+            if not chunk:
+                conn.close()
+                return
+            data += chunk
+        conn.sendall(body)
+        conn.close()
+    return handler
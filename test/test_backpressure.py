@@ -0,0 +1,102 @@
+#!/usr/bin/env python3
+# A receiver that stops reading must stall its sender, not grow the
+# proxy's buffers or spin its loop. Each direction in turn: the sender
+# pushes a fixed amount at a receiver that does not read for a while, the
+# proxy's buffered bytes and CPU are checked during the stall, then the
+# receiver reads and must get every byte.
+import os
+import socket
+import sys
+import threading
+import time
+import unittest
+
+sys.path.insert(0, os.path.dirname(os.path.abspath(__file__)))
+import proxy  # noqa: E402
+
+TOTAL = 32 << 20
+STALL = 2.0
+# Both directions of one tunnel, a few trunks each
+MAX_BUFFERED = 512 << 10
+# Share of a core the proxy may use while everything waits
+MAX_CPU = 0.02
+MAX_RSS_GROWTH_KB = 8 << 10
+
+
+def send_all(sock, total):
+    block = b'\0' * (1 << 20)
+    sent = 0
+    while sent < total:
+        sent += sock.send(block[:min(len(block), total - sent)])
+
+
+def receive_all(sock):
+    received = 0
+    while True:
+        chunk = sock.recv(1 << 20)
+        if not chunk:
+            return received
+        received += len(chunk)
+
+
+class BackpressureTest(unittest.TestCase):
+    def setUp(self):
+        self.proxy = proxy.Proxy()
+
+    def tearDown(self):
+        self.proxy.cleanup()
+
+    def check_stalled(self, rss_before):
+        # The sender has filled every socket buffer on the way by now
+        time.sleep(0.5)
+        cpu = self.proxy.cpu()
+        time.sleep(STALL - 0.5)
+        cpu = (self.proxy.cpu() - cpu) / (STALL - 0.5)
+        buffered = self.proxy.metrics()['uladder_buffer_bytes']
+        growth = self.proxy.rss_kb() - rss_before
+        print('%s: buffered %dkB, cpu %.1f%%, rss +%dkB' % (self.id().rsplit('.', 1)[1], buffered / 1024, cpu * 100,
+                                                            growth))
+        self.assertLessEqual(buffered, MAX_BUFFERED)
+        self.assertLess(cpu, MAX_CPU)
+        self.assertLess(growth, MAX_RSS_GROWTH_KB)
+
+    def test_upload_to_stalled_upstream(self):
+        counted = []
+        done = threading.Event()
+
+        def stall_then_count(conn):
+            time.sleep(STALL)
+            counted.append(receive_all(conn))
+            conn.close()
+            done.set()
+        origin = proxy.Origin(stall_then_count)
+        try:
+            rss = self.proxy.rss_kb()
+            s = proxy.connect(self.proxy.port, 'localhost', origin.port)
+            sender = threading.Thread(target=lambda: (send_all(s, TOTAL), s.shutdown(socket.SHUT_WR)), daemon=True)
+            sender.start()
+            self.check_stalled(rss)
+            self.assertTrue(done.wait(30), 'upload did not complete')
+            self.assertEqual(counted, [TOTAL])
+            s.close()
+        finally:
+            origin.stop()
+
+    def test_download_to_stalled_client(self):
+        def send_then_close(conn):
+            conn.recv(1)
+            send_all(conn, TOTAL)
+            conn.close()
+        origin = proxy.Origin(send_then_close)
+        try:
+            rss = self.proxy.rss_kb()
+            s = proxy.connect(self.proxy.port, 'localhost', origin.port, timeout=30, payload=b'x')
+            self.check_stalled(rss)
+            self.assertEqual(receive_all(s), TOTAL)
+            s.close()
+        finally:
+            origin.stop()
+
+
+if __name__ == '__main__':
+    unittest.main()
@@ -0,0 +1,111 @@
+#!/usr/bin/env python3
+# Requests the proxy does not serve: each must get its SOCKS5 error reply
+# followed by EOF, and the proxy must stay up and keep serving CONNECT. A
+# rejected greeting must not let a CONNECT pipelined behind it through. A
+# greeting is answered on its own unless a whole request came with it.
+import os
+import socket
+import struct
+import sys
+import time
+import unittest
+
+sys.path.insert(0, os.path.dirname(os.path.abspath(__file__)))
+import proxy  # noqa: E402
+
+CMD_NOT_SUPPORTED = 0x07
+ATYPE_NOT_SUPPORTED = 0x08
+
+
+def domain_request(cmd, port):
+    return b'\x05' + bytes([cmd]) + b'\x00\x03\x09localhost' + struct.pack('>H', port)
+
+
+class ProtocolTest(unittest.TestCase):
+    def setUp(self):
+        self.origin = proxy.Origin(proxy.echo)
+        self.proxy = proxy.Proxy()
+
+    def tearDown(self):
+        self.proxy.cleanup()
+        self.origin.stop()
+
+    def request(self, request, greeting=b'\x05\x01\x00'):
+        """Sends the greeting and request, returns everything the proxy
+        sends back until it closes"""
+        s = socket.create_connection(('127.0.0.1', self.proxy.port), timeout=5)
+        s.sendall(greeting + request)
+        data = b''
+        while True:
+            chunk = s.recv(4096)
+            if not chunk:
+                break
+            data += chunk
+        s.close()
+        return data
+
+    def check_refused(self, request, rep):
+        data = self.request(request)
+        self.assertEqual(data[:2], b'\x05\x00')
+        self.assertEqual(data[2:4], bytes([0x05, rep]))
+        self.assertEqual(len(data), 2 + 10)
+
+    def check_greeting_rejected(self, greeting):
+        data = self.request(domain_request(0x01, self.origin.port) + b'ping', greeting=greeting)
+        self.assertEqual(data, b'\x05\xff')
+        self.assertEqual(self.origin.connections, [])
+
+    def test_no_acceptable_method(self):
+        # Username/password only
+        self.check_greeting_rejected(b'\x05\x01\x02')
+
+    def test_version_mismatch(self):
+        self.check_greeting_rejected(b'\x04\x01\x00')
+
+    def test_greeting_reply_not_held(self):
+        # Part of a request behind the greeting, the client may wait for
+        # the greeting reply before sending the rest
+        request = domain_request(0x01, self.origin.port)
+        s = socket.create_connection(('127.0.0.1', self.proxy.port), timeout=5)
+        s.sendall(b'\x05\x01\x00' + request[:4])
+        self.assertEqual(s.recv(2), b'\x05\x00')
+        s.sendall(request[4:])
+        self.assertEqual(s.recv(10)[:2], b'\x05\x00')
+        s.sendall(b'ping')
+        self.assertEqual(s.recv(4), b'ping')
+        s.close()
+
+    def test_bind(self):
+        self.check_refused(domain_request(0x02, self.origin.port), CMD_NOT_SUPPORTED)
+
+    def test_udp_associate(self):
+        self.check_refused(domain_request(0x03, self.origin.port), CMD_NOT_SUPPORTED)
+
+    def test_unknown_command(self):
+        self.check_refused(domain_request(0x7f, self.origin.port), CMD_NOT_SUPPORTED)
+
+    def test_ipv4(self):
+        self.check_refused(b'\x05\x01\x00\x01\x7f\x00\x00\x01' + struct.pack('>H', self.origin.port),
+                           ATYPE_NOT_SUPPORTED)
+
+    def test_ipv6(self):
+        self.check_refused(b'\x05\x01\x00\x04' + b'\0' * 15 + b'\x01' + struct.pack('>H', self.origin.port),
+                           ATYPE_NOT_SUPPORTED)
+
+    def test_unknown_address_type(self):
+        self.check_refused(b'\x05\x01\x00\x09', ATYPE_NOT_SUPPORTED)
+
+    def test_still_serving(self):
+        self.request(domain_request(0x02, self.origin.port))
+        self.request(b'\x05\x01\x00\x09')
+        time.sleep(0.2)
+        self.assertTrue(self.proxy.alive())
+        s = proxy.connect(self.proxy.port, 'localhost', self.origin.port)
+        s.sendall(b'ping')
+        self.assertEqual(s.recv(4), b'ping')
+        s.close()
+        self.assertEqual(self.proxy.metrics().get('uladder_handshake_failures_total{reason="unsupported"}'), 2)
+
+
+if __name__ == '__main__':
+    unittest.main()
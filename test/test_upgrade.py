@@ -0,0 +1,118 @@
+#!/usr/bin/env python3
+# Hot upgrade with --upgrade-sessions: tunnels carry echo traffic without
+# pause while the proxy is sent SIGHUP. Every tunnel must keep working in
+# the new process, with no byte lost, reordered or duplicated. Prints the
+# longest round trip seen, the stall the handoff costs.
+import os
+import re
+import shutil
+import signal
+import sys
+import tempfile
+import threading
+import time
+import unittest
+
+sys.path.insert(0, os.path.dirname(os.path.abspath(__file__)))
+import proxy  # noqa: E402
+
+TUNNELS = 20
+MESSAGE = 512
+
+
+def started_pid(old):
+    # The old process logs the pid of the one it starts
+    match = re.search(r'Upgrade started .*, pid=(\d+)', old.output())
+    return int(match.group(1)) if match else None
+
+
+class Tunnel(threading.Thread):
+    def __init__(self, sock, stop):
+        threading.Thread.__init__(self, daemon=True)
+        self.sock = sock
+        self.stop = stop
+        self.sent = 0
+        self.error = None
+        self.max_rtt = 0
+        self.echoes = []
+
+    def run(self):
+        try:
+            while not self.stop.is_set():
+                message = (b'%08d' % self.sent) * (MESSAGE // 8)
+                start = time.time()
+                self.sock.sendall(message)
+                received = b''
+                while len(received) < MESSAGE:
+                    chunk = self.sock.recv(MESSAGE - len(received))
+                    if not chunk:
+                        raise ConnectionError('tunnel closed after %d messages' % self.sent)
+                    received += chunk
+                if received != message:
+                    raise ValueError('message %d came back as %r' % (self.sent, received[:16]))
+                self.max_rtt = max(self.max_rtt, time.time() - start)
+                self.echoes.append(time.time())
+                self.sent += 1
+                time.sleep(0.005)
+        except (OSError, ValueError) as e:
+            self.error = e
+
+
+class UpgradeTest(unittest.TestCase):
+    def test_tunnels_survive_upgrade(self):
+        origin = proxy.Origin(proxy.echo)
+        workdir = tempfile.mkdtemp(prefix='uladder-')
+        path = os.path.join(workdir, 'upgrade.sock')
+        old = proxy.Proxy('-u', path, '--upgrade-sessions', workdir=workdir)
+        new_pid = None
+        stop = threading.Event()
+        tunnels = []
+        try:
+            tunnels += [Tunnel(proxy.connect(old.port, 'localhost', origin.port), stop) for _ in range(TUNNELS)]
+            for t in tunnels:
+                t.start()
+            time.sleep(1)
+
+            upgraded = time.time()
+            os.kill(old.pid, signal.SIGHUP)
+            deadline = time.time() + 5
+            while new_pid is None and time.time() < deadline:
+                new_pid = started_pid(old)
+                time.sleep(0.01)
+            self.assertIsNotNone(new_pid, 'no new process started')
+            # Everything was handed over, nothing left to drain
+            old.process.wait(10)
+            time.sleep(1)
+            stop.set()
+            for t in tunnels:
+                t.join(5)
+
+            for t in tunnels:
+                self.assertIsNone(t.error)
+                self.assertTrue(any(echo > upgraded + 0.5 for echo in t.echoes),
+                                'tunnel quiet after the upgrade')
+            self.assertTrue(os.path.exists('/proc/%d' % new_pid))
+            # The new process also accepts
+            s = proxy.connect(old.port, 'localhost', origin.port)
+            s.sendall(b'ping')
+            self.assertEqual(s.recv(4), b'ping')
+            s.close()
+            self.assertIn('sessions handed over=%d, kept to drain=0' % TUNNELS, old.output())
+            print('%d tunnels across the upgrade, %d messages, longest round trip %.1fms'
+                  % (TUNNELS, sum(t.sent for t in tunnels), max(t.max_rtt for t in tunnels) * 1000))
+        finally:
+            stop.set()
+            for t in tunnels:
+                t.sock.close()
+            if new_pid is not None:
+                try:
+                    os.kill(new_pid, signal.SIGTERM)
+                except OSError:
+                    pass
+            old.cleanup()
+            shutil.rmtree(workdir, ignore_errors=True)
+            origin.stop()
+
+
+if __name__ == '__main__':
+    unittest.main()